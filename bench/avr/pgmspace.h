@@ -0,0 +1,22 @@
+/*
+ * Host stand-in for <avr/pgmspace.h>, so that the core builds natively
+ * (env:native_bench): there is only one address space, reads are plain loads.
+ */
+#ifndef _BENCH_PGMSPACE_H_
+#define _BENCH_PGMSPACE_H_
+
+#include <stdint.h>
+
+#define PROGMEM
+
+#define pgm_read_byte_near(p)		(*(const uint8_t *) (p))
+#define pgm_read_word_near(p)		(*(const uint16_t *) (p))
+#define pgm_read_dword_near(p)		(*(const uint32_t *) (p))
+#define pgm_read_ptr_near(p)		(*(void * const *) (p))
+
+#define pgm_read_byte(p)		pgm_read_byte_near(p)
+#define pgm_read_word(p)		pgm_read_word_near(p)
+#define pgm_read_dword(p)		pgm_read_dword_near(p)
+#define pgm_read_ptr(p)			pgm_read_ptr_near(p)
+
+#endif /* _BENCH_PGMSPACE_H_ */
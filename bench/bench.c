@@ -0,0 +1,732 @@
+/*
+ * Host benchmark of the emulation core (pio run -e native_bench)
+ *
+ * Runs the ROM from the state in hardcoded_state.h for a fixed amount of
+ * emulated time, as fast as possible with a stub HAL, then prints the host
+ * time per emulated instruction, the instruction mix and a hash of the
+ * final state. The hash only changes when the emulation itself does, so
+ * it tells a pure speed change (decode, dispatch...) from a behavior one.
+ *
+ * With more than one pet, each one runs the same on its own tamalib_t, on
+ * one thread per host CPU taking the next pet not started yet, and all the
+ * hashes must be the one of a single pet.
+ *
+ * With ENABLE_INPUT_RECORD, -r replays input sessions (INPUT_SESSION_MAGIC)
+ * recorded on the device or with -w, and prints the time and the final
+ * state hash of each one. -w records a session of pseudo-random presses
+ * from the hardcoded state.
+ *
+ * -I steps the ROM one instruction at a time from the hardcoded state and
+ * counts the ones that leave the CPU idle until the next interrupt: HALT,
+ * and a jump to itself. Both are emulated cycle by cycle like any other
+ * instruction, the check fails when the ROM runs into one of them.
+ *
+ * With ENABLE_REWIND, -R runs the rewind ring of rewind_ring.c on small
+ * buffers through many wraps, with records of every size, and checks that
+ * each snapshot kept still decodes to the state it was taken from.
+ *
+ * Usage: program [emulated seconds, default 600] [pets, default 1]
+ *        program -r session...
+ *        program -w session [emulated seconds, default 600]
+ *        program -I [emulated seconds, default 600]
+ *        program -R
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <avr/pgmspace.h>
+
+#include "tamalib.h"
+#include "hardcoded_state.h"
+#ifdef ENABLE_REWIND
+#include "rewind_ring.h"
+#endif
+
+#define TICK_FREQUENCY			32768 // Hz, matches cpu.c
+#define DEFAULT_SECONDS			600
+#define RECORD_WARMUP_SECONDS		1
+#define RECORD_MAX_EVENTS		4096
+#define RING_TEST_STEPS			6000
+#define RING_TEST_REWIND_EVERY		211
+#define RING_TEST_MAX_DATA		4096
+
+/* hardcoded_state.h is a cpu_state_t dumped on AVR (packed, 16-bit pointer) followed by the memory */
+#define AVR_STATE_SIZE			56
+
+static const struct {
+	const char *prefix;
+	const char *name;
+} op_classes[] = {
+	{"JP", "jump"},
+	{"CALL", "call/ret"},
+	{"CALZ", "call/ret"},
+	{"RET", "call/ret"},
+	{"PUSH", "stack"},
+	{"POP", "stack"},
+	{"INC_SP", "stack"},
+	{"DEC_SP", "stack"},
+	{"LD", "load"},
+	{"LBPX", "load"},
+	{"SET", "flags"},
+	{"RST", "flags"},
+	{"SCF", "flags"},
+	{"RCF", "flags"},
+	{"SZF", "flags"},
+	{"RZF", "flags"},
+	{"SDF", "flags"},
+	{"RDF", "flags"},
+	{"EI", "flags"},
+	{"DI", "flags"},
+	{"PSET", "other"},
+	{"NOP", "other"},
+	{"HALT", "other"},
+	{"", "alu"}, // Everything else
+};
+
+#define OP_CLASS_NUM			(sizeof(op_classes) / sizeof(op_classes[0]))
+
+static struct timespec start_time;
+
+static u32_t seconds = DEFAULT_SECONDS;
+static tamalib_t *pets;
+static u32_t pet_num;
+static u32_t next_pet = 0;
+static u32_t halt_num = 0;
+
+
+static uint64_t host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) (ts.tv_sec - start_time.tv_sec) * 1000000000ULL + ts.tv_nsec - start_time.tv_nsec;
+}
+
+static void hal_halt(void)
+{
+	__atomic_fetch_add(&halt_num, 1, __ATOMIC_RELAXED);
+}
+
+static void hal_log(log_level_t level, char *buff, ...)
+{
+	fprintf(stderr, "%s\n", buff);
+}
+
+static void hal_sleep_until(timestamp_t ts)
+{
+}
+
+static timestamp_t hal_get_timestamp(void)
+{
+	return (timestamp_t) (host_ns() / 1000);
+}
+
+static void hal_update_screen(void)
+{
+}
+
+#ifndef LCD_FRAMEBUFFER
+/* Without a framebuffer, the core draws through these */
+static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+{
+}
+
+static void hal_set_lcd_icon(u8_t icon, bool_t val)
+{
+}
+#endif
+
+static void hal_set_frequency(u32_t freq)
+{
+}
+
+static void hal_play_frequency(bool_t en)
+{
+}
+
+static int hal_handler(void)
+{
+	return 0;
+}
+
+static hal_t hal = {
+	.halt = &hal_halt,
+	.log = &hal_log,
+	.sleep_until = &hal_sleep_until,
+	.get_timestamp = &hal_get_timestamp,
+	.update_screen = &hal_update_screen,
+#ifdef LCD_FRAMEBUFFER
+	.set_lcd_matrix = NULL, // Read back with tamalib_get_frame()
+	.set_lcd_icon = NULL,
+#else
+	.set_lcd_matrix = &hal_set_lcd_matrix,
+	.set_lcd_icon = &hal_set_lcd_icon,
+#endif
+	.set_frequency = &hal_set_frequency,
+	.play_frequency = &hal_play_frequency,
+	.handler = &hal_handler,
+};
+
+static u32_t get_le(const uint8_t *p, u8_t size)
+{
+	u32_t v = 0;
+
+	while (size--) {
+		v = (v << 8) | p[size];
+	}
+
+	return v;
+}
+
+#ifdef ENABLE_INPUT_RECORD
+static void put_le(uint8_t *p, u32_t v, u8_t size)
+{
+	while (size--) {
+		*p++ = v;
+		v >>= 8;
+	}
+}
+#endif
+
+static void load_hardcoded_state(tamalib_t *t)
+{
+	const uint8_t *s = hardcodedState;
+	cpu_state_t state;
+	u8_t i;
+
+	if (sizeof(hardcodedState) != AVR_STATE_SIZE + MEMORY_SIZE) {
+		fprintf(stderr, "Unexpected hardcoded state size %u\n", (unsigned) sizeof(hardcodedState));
+		exit(1);
+	}
+
+	cpu_get_state_ctx(&t->cpu, &state);
+
+	state.pc = get_le(s + 0, 2);
+	state.x = get_le(s + 2, 2);
+	state.y = get_le(s + 4, 2);
+	state.a = s[6];
+	state.b = s[7];
+	state.np = s[8];
+	state.sp = s[9];
+	state.flags = s[10];
+	state.tick_counter = get_le(s + 11, 4);
+	state.clk_timer_timestamp = get_le(s + 15, 4);
+	state.prog_timer_timestamp = get_le(s + 19, 4);
+	state.prog_timer_enabled = s[23];
+	state.prog_timer_data = s[24];
+	state.prog_timer_rld = s[25];
+	state.call_depth = get_le(s + 26, 4);
+	/* 2 bytes of memory pointer */
+	for (i = 0; i < 6; i++) {
+		state.interrupts[i].factor_flag_reg = s[32 + i * 4];
+		state.interrupts[i].mask_reg = s[33 + i * 4];
+		state.interrupts[i].triggered = s[34 + i * 4];
+		state.interrupts[i].vector = s[35 + i * 4];
+	}
+
+	memcpy(state.memory, s + AVR_STATE_SIZE, MEMORY_SIZE);
+	cpu_set_state_ctx(&t->cpu, &state);
+}
+
+static void print_mix(u32_t ops)
+{
+	u32_t class_ops[OP_CLASS_NUM] = {0};
+	u8_t i, c;
+
+	for (i = 0; i < cpu_get_op_num(); i++) {
+		for (c = 0; strncmp(cpu_get_op_name(i), op_classes[c].prefix, strlen(op_classes[c].prefix)) != 0; c++);
+		class_ops[c] += cpu_get_op_stat(i);
+	}
+
+	printf("Instruction mix:\n");
+	for (c = 0; c < OP_CLASS_NUM; c++) {
+		u32_t n = 0;
+		u8_t k;
+
+		/* Several prefixes share a class name, print each class once */
+		for (k = 0; k < c && strcmp(op_classes[k].name, op_classes[c].name) != 0; k++);
+		if (k < c) {
+			continue;
+		}
+		for (k = c; k < OP_CLASS_NUM; k++) {
+			if (strcmp(op_classes[k].name, op_classes[c].name) == 0) {
+				n += class_ops[k];
+			}
+		}
+		printf("  %-10s %10u  %5.1f%%\n", op_classes[c].name, n, 100.0 * n / ops);
+	}
+
+	printf("Per opcode:\n");
+	for (i = 0; i < cpu_get_op_num(); i++) {
+		if (cpu_get_op_stat(i) != 0) {
+			printf("  %-10s %10u  %5.1f%%\n", cpu_get_op_name(i), cpu_get_op_stat(i), 100.0 * cpu_get_op_stat(i) / ops);
+		}
+	}
+}
+
+static void *run_pets(void *arg)
+{
+	u32_t n, i;
+
+	while ((n = __atomic_fetch_add(&next_pet, 1, __ATOMIC_RELAXED)) < pet_num) {
+		for (i = 0; i < seconds; i++) {
+			cpu_run_cycles_ctx(&pets[n].cpu, TICK_FREQUENCY);
+		}
+	}
+
+	return NULL;
+}
+
+static int run_farm(uint64_t expected)
+{
+	u32_t thread_num = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *threads;
+	uint64_t ns, ops = 0;
+	u32_t i, bad = 0;
+
+	if (thread_num > pet_num) {
+		thread_num = pet_num;
+	}
+	pets = calloc(pet_num, sizeof(tamalib_t));
+	threads = calloc(thread_num, sizeof(pthread_t));
+	for (i = 0; i < pet_num; i++) {
+		tamalib_init_ctx(&pets[i], &hal, 1000000);
+		load_hardcoded_state(&pets[i]);
+		tamalib_set_speed_ctx(&pets[i], 0);
+	}
+
+	ns = host_ns();
+	for (i = 0; i < thread_num; i++) {
+		pthread_create(&threads[i], NULL, run_pets, NULL);
+	}
+	for (i = 0; i < thread_num; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	ns = host_ns() - ns;
+
+	for (i = 0; i < pet_num; i++) {
+		ops += tamalib_get_op_count_ctx(&pets[i]);
+		bad += (tamalib_get_state_hash_ctx(&pets[i]) != expected);
+	}
+
+	printf("Pets: %u on %u threads, %.1f ms, %.0f instructions/s, %u hash mismatches\n",
+		pet_num, thread_num, ns / 1e6, ops * 1e9 / ns, bad);
+
+	free(threads);
+	free(pets);
+	return bad != 0;
+}
+
+#if defined(ENABLE_INPUT_RECORD) || defined(ENABLE_REWIND)
+static u32_t rand_next(u32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+static int record_session(const char *path)
+{
+	static input_event_t events[RECORD_MAX_EVENTS];
+	static uint8_t buf[INPUT_SESSION_HEADER_SIZE + RECORD_MAX_EVENTS * INPUT_SESSION_EVENT_SIZE];
+	bool_t pressed[3] = {0};
+	u32_t seed = 1, end, num, i;
+	uint8_t *p;
+	FILE *f;
+
+	/* From a state reached by running, like a recording started on the device */
+	cpu_run_cycles(RECORD_WARMUP_SECONDS * TICK_FREQUENCY);
+	cpu_pack_state(buf + INPUT_SESSION_HEADER_SIZE - CPU_PACKED_STATE_SIZE);
+	hw_record_inputs(events, RECORD_MAX_EVENTS);
+
+	/* Bursts of random lengths, with the buttons changed in between as by the HAL handler */
+	end = tamalib_get_tick_count() + seconds * TICK_FREQUENCY;
+	while ((int32_t) (end - tamalib_get_tick_count()) > 0) {
+		cpu_run_cycles(64 + rand_next(&seed) % 2048);
+		if (rand_next(&seed) % 16 == 0) {
+			u8_t btn = rand_next(&seed) % 3;
+
+			pressed[btn] = !pressed[btn];
+			hw_set_button(btn, pressed[btn] ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+		}
+	}
+	end = tamalib_get_tick_count();
+	num = hw_record_inputs(NULL, 0);
+	if (num > RECORD_MAX_EVENTS) {
+		fprintf(stderr, "More than %u events, session not written\n", RECORD_MAX_EVENTS);
+		return 1;
+	}
+
+	memcpy(buf, INPUT_SESSION_MAGIC, 4);
+	put_le(buf + 4, end, 4);
+	put_le(buf + 8, num, 4);
+	p = buf + INPUT_SESSION_HEADER_SIZE;
+	for (i = 0; i < num; i++, p += INPUT_SESSION_EVENT_SIZE) {
+		put_le(p, events[i].tick, 4);
+		p[4] = events[i].btn;
+		p[5] = events[i].state;
+	}
+
+	f = fopen(path, "wb");
+	if (f == NULL || fwrite(buf, 1, p - buf, f) != (size_t) (p - buf) || fclose(f) != 0) {
+		fprintf(stderr, "Cannot write %s\n", path);
+		return 1;
+	}
+
+	printf("Recorded: %s, %u s, %u events\n", path, seconds, num);
+	printf("State hash: %016llx\n", (unsigned long long) tamalib_get_state_hash_ctx(&g_tamalib));
+	return 0;
+}
+
+static int replay_session(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	uint8_t *buf = NULL;
+	input_event_t *events = NULL;
+	tamalib_t *t = NULL;
+	u32_t start, end, num, ops, i;
+	uint64_t ns;
+	long size;
+	int res = 1;
+
+	if (f == NULL || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < INPUT_SESSION_HEADER_SIZE) {
+		fprintf(stderr, "%s: cannot read\n", path);
+		goto out;
+	}
+	buf = malloc(size);
+	rewind(f);
+	if (fread(buf, 1, size, f) != (size_t) size || memcmp(buf, INPUT_SESSION_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a session\n", path);
+		goto out;
+	}
+	end = get_le(buf + 4, 4);
+	num = get_le(buf + 8, 4);
+	if (size != INPUT_SESSION_HEADER_SIZE + (long) num * INPUT_SESSION_EVENT_SIZE) {
+		fprintf(stderr, "%s: truncated\n", path);
+		goto out;
+	}
+
+	events = calloc(num + 1, sizeof(input_event_t));
+	for (i = 0; i < num; i++) {
+		const uint8_t *p = buf + INPUT_SESSION_HEADER_SIZE + i * INPUT_SESSION_EVENT_SIZE;
+
+		events[i].tick = get_le(p, 4);
+		events[i].btn = p[4];
+		events[i].state = p[5];
+	}
+
+	t = calloc(1, sizeof(tamalib_t));
+	tamalib_init_ctx(t, &hal, 1000000);
+	cpu_unpack_state_ctx(&t->cpu, buf + INPUT_SESSION_HEADER_SIZE - CPU_PACKED_STATE_SIZE);
+	tamalib_set_speed_ctx(t, 0);
+
+	start = tamalib_get_tick_count_ctx(t);
+	ops = tamalib_get_op_count_ctx(t);
+	ns = host_ns();
+	if (tamalib_replay_ctx(t, events, num, end)) {
+		fprintf(stderr, "%s: stopped on an unknown opcode at pc 0x%04X\n", path, t->cpu.pc);
+		goto out;
+	}
+	ns = host_ns() - ns;
+	ops = tamalib_get_op_count_ctx(t) - ops;
+
+	printf("Replayed: %s, %.1f s, %u events\n", path, (double) (end - start) / TICK_FREQUENCY, num);
+	printf("Host: %.1f ms, %.2f ns/instruction\n", ns / 1e6, ops ? (double) ns / ops : 0.0);
+	printf("State hash: %016llx\n", (unsigned long long) tamalib_get_state_hash_ctx(t));
+	res = 0;
+
+out:
+	if (f != NULL) {
+		fclose(f);
+	}
+	free(t);
+	free(events);
+	free(buf);
+	return res;
+}
+#endif
+
+static int check_idle(void)
+{
+	u32_t end, ops, self_jumps = 0;
+	u13_t pc;
+	u8_t sp;
+
+	end = tamalib_get_tick_count() + seconds * TICK_FREQUENCY;
+	ops = tamalib_get_op_count();
+	while ((int32_t) (end - tamalib_get_tick_count()) > 0) {
+		pc = g_tamalib.cpu.pc;
+		sp = g_tamalib.cpu.sp;
+		if (cpu_step()) {
+			fprintf(stderr, "Stopped on an unknown opcode at pc 0x%04X\n", g_tamalib.cpu.pc);
+			return 1;
+		}
+		/* A RET can also land on itself, when it returns from an interrupt taken just before it */
+		self_jumps += (g_tamalib.cpu.pc == pc && g_tamalib.cpu.sp == sp);
+	}
+	ops = tamalib_get_op_count() - ops;
+
+	printf("Idle check: %u s, %u instructions, %u HALT, %u jumps to self\n", seconds, ops, halt_num, self_jumps);
+	return halt_num != 0 || self_jumps != 0;
+}
+
+#ifdef ENABLE_REWIND
+/* Nothing changed, a few bytes, a run, or enough scattered ones to make a keyframe */
+static void ring_test_mutate(u8_t *state, u32_t *seed)
+{
+	u32_t i, n, at;
+
+	switch (rand_next(seed) % 4) {
+		case 0:
+			break;
+
+		case 1:
+			for (n = 1 + rand_next(seed) % 3; n != 0; n--) {
+				state[rand_next(seed) % CPU_PACKED_STATE_SIZE]++;
+			}
+			break;
+
+		case 2:
+			n = 20 + rand_next(seed) % 100;
+			at = rand_next(seed) % (CPU_PACKED_STATE_SIZE - n);
+			for (i = 0; i < n; i++) {
+				state[at + i] ^= 1 + rand_next(seed) % 255;
+			}
+			break;
+
+		case 3:
+			for (i = rand_next(seed) % 4; i < CPU_PACKED_STATE_SIZE; i += 4) {
+				state[i]++;
+			}
+			break;
+	}
+}
+
+/* Decoding changes the scalars and prev only, a copy leaves the ring as it was */
+static int ring_test_check_entry(const rewind_ring_t *r, uint32_t i, u8_t (*history)[CPU_PACKED_STATE_SIZE])
+{
+	static rewind_ring_t copy;
+
+	copy = *r;
+	rewind_ring_decode(&copy, i);
+	return memcmp(copy.prev, history[rewind_ring_entry(&copy, i)->tick], CPU_PACKED_STATE_SIZE) != 0;
+}
+
+static int ring_test_check(rewind_ring_t *r, u8_t (*history)[CPU_PACKED_STATE_SIZE])
+{
+	static uint8_t used[RING_TEST_MAX_DATA];
+	uint32_t i, j, bytes = 0;
+	rewind_entry_t *e;
+
+	if (r->num == 0 || !rewind_ring_entry(r, 0)->keyframe) {
+		return 1;
+	}
+	/* No record kept may share a byte with another one */
+	memset(used, 0, r->data_size);
+	for (i = 0; i < r->num; i++) {
+		e = rewind_ring_entry(r, i);
+		if (e->offset + e->size > r->data_size) {
+			return 1;
+		}
+		for (j = e->offset; j < e->offset + e->size; j++) {
+			if (used[j]++) {
+				return 1;
+			}
+		}
+		bytes += e->size;
+	}
+	if (bytes != r->bytes) {
+		return 1;
+	}
+
+	for (i = 0; i < r->num; i++) {
+		if (ring_test_check_entry(r, i, history)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int test_rewind_ring(void)
+{
+	static const uint32_t data_sizes[] = {CPU_PACKED_STATE_SIZE, 1000, 1500, RING_TEST_MAX_DATA};
+	static const uint32_t max_entries[] = {8, 64, RING_TEST_STEPS};
+	static const uint16_t keyframe_every[] = {1, 5, 64};
+	u8_t (*history)[CPU_PACKED_STATE_SIZE] = malloc(RING_TEST_STEPS * CPU_PACKED_STATE_SIZE);
+	static rewind_ring_t ring;
+	u8_t state[CPU_PACKED_STATE_SIZE];
+	uint32_t s, m, k, step, i, wraps, rewinds;
+	u32_t seed = 1;
+	int bad = 0;
+
+	load_hardcoded_state(&g_tamalib);
+
+	for (s = 0; s < sizeof(data_sizes) / sizeof(data_sizes[0]); s++) {
+		for (m = 0; m < sizeof(max_entries) / sizeof(max_entries[0]); m++) {
+			for (k = 0; k < sizeof(keyframe_every) / sizeof(keyframe_every[0]); k++) {
+				uint8_t *data = malloc(data_sizes[s]);
+				rewind_entry_t *entries = malloc(max_entries[m] * sizeof(rewind_entry_t));
+				uint32_t head = 0;
+				int fail = 0;
+
+				rewind_ring_init(&ring, data, data_sizes[s], entries, max_entries[m], keyframe_every[k]);
+				cpu_pack_state(state);
+				wraps = rewinds = 0;
+
+				for (step = 0; step < RING_TEST_STEPS && !fail; step++) {
+					ring_test_mutate(state, &seed);
+					memcpy(history[step], state, CPU_PACKED_STATE_SIZE);
+					rewind_ring_append(&ring, state, step);
+					wraps += (rewind_ring_entry(&ring, ring.num - 1)->offset < head);
+					head = ring.data_head;
+
+					fail = ring_test_check(&ring, history);
+
+					/* Then carry on from an older snapshot, like 'b' on the console */
+					if (!fail && step % RING_TEST_REWIND_EVERY == 0 && ring.num > 1) {
+						i = rand_next(&seed) % ring.num;
+						rewind_ring_decode(&ring, i);
+						fail = memcmp(ring.prev, history[rewind_ring_entry(&ring, i)->tick], CPU_PACKED_STATE_SIZE) != 0 ||
+							ring.num != i + 1;
+						memcpy(state, ring.prev, CPU_PACKED_STATE_SIZE);
+						head = ring.data_head;
+						rewinds++;
+					}
+				}
+
+				printf("Ring %4u B, %4u entries, keyframe every %2u: %u wraps, %u rewinds, %s\n",
+					data_sizes[s], max_entries[m], keyframe_every[k], wraps, rewinds,
+					fail ? "FAILED" : "ok");
+				bad |= fail || wraps < 3;
+				free(entries);
+				free(data);
+			}
+		}
+	}
+
+	free(history);
+	return bad;
+}
+#endif
+
+/* A count of at least 1, strtoul() alone takes "-1", "10s" or "" */
+static bool_t parse_count(const char *s, u32_t *v)
+{
+	char *end;
+	unsigned long n;
+
+	if (*s < '0' || *s > '9') {
+		return 0;
+	}
+	n = strtoul(s, &end, 10);
+	if (*end != '\0' || n == 0 || n > 0xFFFFFFFFUL) {
+		return 0;
+	}
+	*v = (u32_t) n;
+	return 1;
+}
+
+static int usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [emulated seconds, default %u] [pets, default 1]\n", prog, DEFAULT_SECONDS);
+#ifdef ENABLE_INPUT_RECORD
+	fprintf(stderr, "       %s -r session...\n", prog);
+	fprintf(stderr, "       %s -w session [emulated seconds, default %u]\n", prog, DEFAULT_SECONDS);
+#endif
+	fprintf(stderr, "       %s -I [emulated seconds, default %u]\n", prog, DEFAULT_SECONDS);
+#ifdef ENABLE_REWIND
+	fprintf(stderr, "       %s -R\n", prog);
+#endif
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	u32_t i, ops;
+	uint64_t ns, h;
+	bool_t recording = 0, idle;
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+#ifdef ENABLE_REWIND
+	if (argc == 2 && strcmp(argv[1], "-R") == 0) {
+		tamalib_register_hal(&hal);
+		tamalib_init(1000000); // us
+		return test_rewind_ring();
+	}
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		int res = 0;
+
+		if (argc < 3) {
+			return usage(argv[0]);
+		}
+		for (i = 2; i < (u32_t) argc; i++) {
+			res |= replay_session(argv[i]);
+		}
+		return res;
+	}
+
+	recording = argc > 1 && strcmp(argv[1], "-w") == 0;
+#endif
+	idle = argc > 1 && strcmp(argv[1], "-I") == 0;
+
+	/* Without ENABLE_INPUT_RECORD, -w and -r are not counts and end up here */
+	pet_num = 1;
+	if (recording) {
+		if (argc < 3 || argc > 4 || (argc > 3 && !parse_count(argv[3], &seconds))) {
+			return usage(argv[0]);
+		}
+	} else if (idle) {
+		if (argc > 3 || (argc > 2 && !parse_count(argv[2], &seconds))) {
+			return usage(argv[0]);
+		}
+	} else if (argc > 3 || (argc > 1 && !parse_count(argv[1], &seconds)) ||
+		(argc > 2 && !parse_count(argv[2], &pet_num))) {
+		return usage(argv[0]);
+	}
+
+	/* The first pet is the one behind the functions without a context */
+	tamalib_register_hal(&hal);
+	tamalib_init(1000000); // us
+	load_hardcoded_state(&g_tamalib);
+	tamalib_set_speed(0);
+	cpu_reset_op_stats();
+
+	if (idle) {
+		return check_idle();
+	}
+
+#ifdef ENABLE_INPUT_RECORD
+	if (recording) {
+		return record_session(argv[2]);
+	}
+#endif
+
+	ops = tamalib_get_op_count();
+	ns = host_ns();
+	for (i = 0; i < seconds; i++) {
+		cpu_run_cycles(TICK_FREQUENCY);
+	}
+	ns = host_ns() - ns;
+	ops = tamalib_get_op_count() - ops;
+	h = tamalib_get_state_hash_ctx(&g_tamalib);
+
+	printf("Emulated: %u s, %u instructions\n", seconds, ops);
+	printf("Host: %.1f ms, %.2f ns/instruction, %.0fx real time\n",
+		ns / 1e6, (double) ns / ops, seconds * 1e9 / ns);
+	printf("State hash: %016llx\n", (unsigned long long) h);
+	print_mix(ops);
+
+	if (pet_num > 1) {
+		return run_farm(h);
+	}
+
+	return 0;
+}
@@ -22,13 +22,14 @@
 #else
 #include <avr/pgmspace.h>
 #endif
+#include <string.h>
 #include "cpu.h"
 #include "hw.h"
 #include "hal.h"
+#include "tamalib.h"
 #include "rom_12bit.h"
 
 
-#define CPU_SPEED_RATIO      0
 #define TICK_FREQUENCY        32768 // Hz
 
 #define TIMER_1HZ_PERIOD      32768 // in ticks
@@ -41,48 +42,48 @@
 #define MASK_10B        0xFFC
 #define MASK_12B        0xFFF
 
-#define PCS         (pc & 0xFF)
-#define PCSL          (pc & 0xF)
-#define PCSH          ((pc >> 4) & 0xF)
-#define PCP         ((pc >> 8) & 0xF)
-#define PCB         ((pc >> 12) & 0x1)
+#define PCS         (cpu->pc & 0xFF)
+#define PCSL          (cpu->pc & 0xF)
+#define PCSH          ((cpu->pc >> 4) & 0xF)
+#define PCP         ((cpu->pc >> 8) & 0xF)
+#define PCB         ((cpu->pc >> 12) & 0x1)
 #define TO_PC(bank, page, step)     ((step & 0xFF) | ((page & 0xF) << 8) | (bank & 0x1) << 12)
-#define NBP         ((np >> 4) & 0x1)
-#define NPP         (np & 0xF)
+#define NBP         ((cpu->np >> 4) & 0x1)
+#define NPP         (cpu->np & 0xF)
 #define TO_NP(bank, page)     ((page & 0xF) | (bank & 0x1) << 4)
-#define XHL         (x & 0xFF)
-#define XL1         (x & 0xF)
-#define XH1         ((x >> 4) & 0xF)
-#define XP          ((x >> 8) & 0xF)
-#define YHL         (y & 0xFF)
-#define YL1         (y & 0xF)
-#define YH1         ((y >> 4) & 0xF)
-#define YP          ((y >> 8) & 0xF)
-#define M(n)          get_memory(n)
-#define SET_M(n, v)       set_memory(n, v)
-#define RQ(i)         get_rq(i)
-#define SET_RQ(i, v)        set_rq(i, v)
-#define SPL1          (sp & 0xF)
-#define SPH1          ((sp >> 4) & 0xF)
+#define XHL         (cpu->x & 0xFF)
+#define XL1         (cpu->x & 0xF)
+#define XH1         ((cpu->x >> 4) & 0xF)
+#define XP          ((cpu->x >> 8) & 0xF)
+#define YHL         (cpu->y & 0xFF)
+#define YL1         (cpu->y & 0xF)
+#define YH1         ((cpu->y >> 4) & 0xF)
+#define YP          ((cpu->y >> 8) & 0xF)
+#define M(n)          get_memory(cpu, n)
+#define SET_M(n, v)       set_memory(cpu, n, v)
+#define RQ(i)         get_rq(cpu, i)
+#define SET_RQ(i, v)        set_rq(cpu, i, v)
+#define SPL1          (cpu->sp & 0xF)
+#define SPH1          ((cpu->sp >> 4) & 0xF)
 
 #define FLAG_C          (0x1 << 0)
 #define FLAG_Z          (0x1 << 1)
 #define FLAG_D          (0x1 << 2)
 #define FLAG_I          (0x1 << 3)
 
-#define C         !!(flags & FLAG_C)
-#define Z         !!(flags & FLAG_Z)
-#define D         !!(flags & FLAG_D)
-#define I         !!(flags & FLAG_I)
+#define C         !!(cpu->flags & FLAG_C)
+#define Z         !!(cpu->flags & FLAG_Z)
+#define D         !!(cpu->flags & FLAG_D)
+#define I         !!(cpu->flags & FLAG_I)
 
-#define SET_C()         {flags |= FLAG_C;}
-#define CLEAR_C()       {flags &= ~FLAG_C;}
-#define SET_Z()         {flags |= FLAG_Z;}
-#define CLEAR_Z()       {flags &= ~FLAG_Z;}
-#define SET_D()         {flags |= FLAG_D;}
-#define CLEAR_D()       {flags &= ~FLAG_D;}
-#define SET_I()         {flags |= FLAG_I;}
-#define CLEAR_I()       {flags &= ~FLAG_I;}
+#define SET_C()         {cpu->flags |= FLAG_C;}
+#define CLEAR_C()       {cpu->flags &= ~FLAG_C;}
+#define SET_Z()         {cpu->flags |= FLAG_Z;}
+#define CLEAR_Z()       {cpu->flags &= ~FLAG_Z;}
+#define SET_D()         {cpu->flags |= FLAG_D;}
+#define CLEAR_D()       {cpu->flags &= ~FLAG_D;}
+#define SET_I()         {cpu->flags |= FLAG_I;}
+#define CLEAR_I()       {cpu->flags &= ~FLAG_I;}
 
 #define REG_CLK_INT_FACTOR_FLAGS    0xF00
 #define REG_SW_INT_FACTOR_FLAGS     0xF01
@@ -114,7 +115,41 @@
 #define REG_PROG_TIMER_CTRL     0xF78
 #define REG_PROG_TIMER_CLK_SEL      0xF79
 
-#define INPUT_PORT_NUM        2
+/* Opcode decoding uses a table built once in cpu_init(): one pre-decoded entry
+ * per 12-bit opcode, or on AVR (not enough RAM for 16 KB) one entry per group of
+ * 16 opcodes with a short scan of ops0[] for the few groups that are not uniform.
+ */
+#ifdef __AVR__
+#define DECODE_TABLE_TWO_LEVEL
+#endif
+
+#define OP_UNKNOWN        0xFF
+#define DECODE_SCAN_FLAG      0x80
+
+/* With ENABLE_ROM_CACHE, the whole ROM is also expanded at boot into one decoded
+ * entry per address (~24 KB), so that fetching an instruction is a single load
+ * instead of unpacking 12 bits out of g_program_b12 and decoding them.
+ */
+#define ROM_OP_NUM        (sizeof(g_program_b12) * 2 / 3)
+
+#if defined(ENABLE_ROM_CACHE) && defined(DECODE_TABLE_TWO_LEVEL)
+#error "ENABLE_ROM_CACHE requires the full decode table"
+#endif
+
+#if defined(ENABLE_THREADED_DISPATCH) && !defined(ENABLE_ROM_CACHE)
+#error "ENABLE_THREADED_DISPATCH requires ENABLE_ROM_CACHE"
+#endif
+
+/* With ENABLE_UNPACKED_RAM, RAM is kept one nibble per byte (640 bytes instead
+ * of 320), so that accessing it is a single load or store. cpu_get_state() then
+ * exposes a packed copy in cpu_state_t.memory, which cpu_set_state() reads back.
+ */
+
+#if defined(__GNUC__)
+#define ALWAYS_INLINE       inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE       inline
+#endif
 
 typedef struct {
   //char *log;
@@ -133,55 +168,35 @@ typedef struct {
 //  u12_t shift_arg1;
 //  u12_t mask_arg1;      // != 0 only if there are two arguments
 //  u8_t cycles;
-  void (*cb1)(u8_t arg0, u8_t arg1);
+  void (*cb1)(cpu_t *cpu, u8_t arg0, u8_t arg1);
 } op_t1;
 
 typedef struct {
-  u4_t states;
-} input_port_t;
-
-/* Registers */
-static u13_t pc, next_pc;
-static u12_t x, y;
-static u4_t a, b;
-static u5_t np;
-static u8_t sp;
-
-/* Flags */
-static u4_t flags;
-
-//static const u12_t *g_program = NULL;
-static u4_t memory[MEMORY_SIZE];
-//static u4_t io_memory[MEM_IO_SIZE];
-
-static input_port_t inputs[INPUT_PORT_NUM] = {{0}};
-
-//static u8_t maxNumber = 0;
-
-/* Interrupts (in priority order) */
-static interrupt_t interrupts[INT_SLOT_NUM] = {
-  {0x0, 0x0, 0, 0x0C}, // Prog timer
-  {0x0, 0x0, 0, 0x0A}, // Serial interface
-  {0x0, 0x0, 0, 0x08}, // Input (K10-K13)
-  {0x0, 0x0, 0, 0x06}, // Input (K00-K03)
-  {0x0, 0x0, 0, 0x04}, // Stopwatch timer
-  {0x0, 0x0, 0, 0x02}, // Clock timer
-};
+  u8_t op; // Index in ops0[]/ops1[], OP_UNKNOWN if not supported
+  u8_t cycles;
+  u8_t arg0;
+  u8_t arg1;
+} decoded_op_t;
 
-//static breakpoint_t *g_breakpoints = NULL;
+/* The registers, RAM and timers of each CPU are in cpu_t (cpu.h), only what
+ * is derived from the ROM is shared
+ */
 
-static u32_t call_depth = 0;
+#ifdef DECODE_TABLE_TWO_LEVEL
+/* Indexed by (op >> 4): OP index, or DECODE_SCAN_FLAG | first OP index to scan */
+static u8_t decode_table[256];
+#else
+/* Indexed by op */
+static decoded_op_t decode_table[4096];
+#endif
 
-static u32_t clk_timer_timestamp = 0; // in ticks
-static u32_t prog_timer_timestamp = 0; // in ticks
-static bool_t prog_timer_enabled = 0;
-static u8_t prog_timer_data = 0;
-static u8_t prog_timer_rld = 0;
+#ifdef ENABLE_ROM_CACHE
+/* Indexed by PC */
+static decoded_op_t rom_cache[ROM_OP_NUM];
+#endif
 
-static u32_t tick_counter = 0;
-static u32_t ts_freq;
-//static u8_t speed_ratio = 0;
-static timestamp_t ref_ts;
+static timestamp_t decode_init_time = 0;
+static bool_t decode_ready = 0;
 
 /*
 static state_t cpu_state = {
@@ -240,196 +255,391 @@ void cpu_free_bp(breakpoint_t **list)
   }
   *list = NULL; */
 }
-/*
-void cpu_set_speed(u8_t speed)
+
+void cpu_set_speed_ctx(cpu_t *cpu, u8_t speed)
 {
-  speed_ratio = speed;
-}*/
+  cpu->speed_ratio = speed;
+  cpu_sync_ref_timestamp_ctx(cpu);
+}
 
 
-void cpu_get_state(cpu_state_t *cpustate)
+u32_t cpu_get_op_count_ctx(cpu_t *cpu)
+{
+  return cpu->op_count;
+}
+
+u32_t cpu_get_tick_count_ctx(cpu_t *cpu)
+{
+  return cpu->tick_counter;
+}
+
+/* RAM two nibbles per byte, whatever the layout of memory[] */
+static u8_t get_ram_byte(cpu_t *cpu, u13_t i)
+{
+#ifdef ENABLE_UNPACKED_RAM
+  return (cpu->memory[i * 2] << 4) | cpu->memory[i * 2 + 1];
+#else
+  return cpu->memory[i];
+#endif
+}
+
+static void set_ram_byte(cpu_t *cpu, u13_t i, u8_t v)
+{
+#ifdef ENABLE_UNPACKED_RAM
+  cpu->memory[i * 2] = v >> 4;
+  cpu->memory[i * 2 + 1] = v & 0xF;
+#else
+  cpu->memory[i] = v;
+#endif
+}
+
+/* Next-event scheduling: instead of checking both timers after every
+ * instruction, handle_timers() only compares tick_counter with the nearest
+ * deadline, the 1 Hz period or the next 256 Hz decrement of the prog timer.
+ * It has to be scheduled again whenever the timers or tick_counter are
+ * written from elsewhere. A deadline that has already passed, such as one
+ * from a loaded state, is due right away.
+ */
+static void schedule_timers(cpu_t *cpu)
+{
+  u32_t elapsed, ticks, prog_ticks;
+
+  elapsed = cpu->tick_counter - cpu->clk_timer_timestamp;
+  ticks = (elapsed >= TIMER_1HZ_PERIOD) ? 0 : TIMER_1HZ_PERIOD - elapsed;
+
+  if (cpu->prog_timer_enabled) {
+    elapsed = cpu->tick_counter - cpu->prog_timer_timestamp;
+    prog_ticks = (elapsed >= TIMER_256HZ_PERIOD) ? 0 : TIMER_256HZ_PERIOD - elapsed;
+    if (prog_ticks < ticks) {
+      ticks = prog_ticks;
+    }
+  }
+
+  cpu->next_timer_tick = cpu->tick_counter + ticks;
+}
+
+void cpu_get_state_ctx(cpu_t *cpu, cpu_state_t *cpustate)
 {
-  cpustate->pc = pc;
-  cpustate->x = x;
-  cpustate->y = y;
-  cpustate->a = a;
-  cpustate->b = b;
-  cpustate->np = np;
-  cpustate->sp = sp;
-
-  cpustate->flags = flags;
-  cpustate->tick_counter = tick_counter;
-  cpustate->clk_timer_timestamp = clk_timer_timestamp;
-  cpustate->prog_timer_timestamp = prog_timer_timestamp;
-  cpustate->prog_timer_enabled = prog_timer_enabled;
-  cpustate->prog_timer_data = prog_timer_data;
-  cpustate->prog_timer_rld = prog_timer_rld;
-  cpustate->call_depth = call_depth;
-  cpustate->memory = (u4_t *)memory;
+  cpustate->pc = cpu->pc;
+  cpustate->x = cpu->x;
+  cpustate->y = cpu->y;
+  cpustate->a = cpu->a;
+  cpustate->b = cpu->b;
+  cpustate->np = cpu->np;
+  cpustate->sp = cpu->sp;
+
+  cpustate->flags = cpu->flags;
+  cpustate->tick_counter = cpu->tick_counter;
+  cpustate->clk_timer_timestamp = cpu->clk_timer_timestamp;
+  cpustate->prog_timer_timestamp = cpu->prog_timer_timestamp;
+  cpustate->prog_timer_enabled = cpu->prog_timer_enabled;
+  cpustate->prog_timer_data = cpu->prog_timer_data;
+  cpustate->prog_timer_rld = cpu->prog_timer_rld;
+  cpustate->call_depth = cpu->call_depth;
   uint8_t i;
+#ifdef ENABLE_UNPACKED_RAM
+  u13_t n;
+
+  for (n = 0; n < MEMORY_SIZE; n++) {
+    cpu->packed_memory[n] = get_ram_byte(cpu, n);
+  }
+  cpustate->memory = cpu->packed_memory;
+#else
+  cpustate->memory = (u4_t *)cpu->memory;
+#endif
   for(i=0;i<6;i++) {
-    cpustate->interrupts[i].factor_flag_reg = interrupts[i].factor_flag_reg;
-    cpustate->interrupts[i].mask_reg = interrupts[i].mask_reg;
-    cpustate->interrupts[i].triggered = interrupts[i].triggered;
-    cpustate->interrupts[i].vector = interrupts[i].vector;
+    cpustate->interrupts[i].factor_flag_reg = cpu->interrupts[i].factor_flag_reg;
+    cpustate->interrupts[i].mask_reg = cpu->interrupts[i].mask_reg;
+    cpustate->interrupts[i].triggered = cpu->interrupts[i].triggered;
+    cpustate->interrupts[i].vector = cpu->interrupts[i].vector;
   }
 }
 
-void cpu_set_state(cpu_state_t *cpustate)
-{
-  pc = cpustate->pc;
-  x = cpustate->x;
-  y = cpustate->y;
-  a = cpustate->a;
-  b = cpustate->b;
-  np = cpustate->np;
-  sp = cpustate->sp;
-  flags = cpustate->flags;
-  tick_counter = cpustate->tick_counter;
-  clk_timer_timestamp = cpustate->clk_timer_timestamp;
-  prog_timer_timestamp = cpustate->prog_timer_timestamp;
-  prog_timer_enabled = cpustate->prog_timer_enabled;
-  prog_timer_data = cpustate->prog_timer_data;
-  prog_timer_rld = cpustate->prog_timer_rld;
-  call_depth = cpustate->call_depth;
+void cpu_set_state_ctx(cpu_t *cpu, cpu_state_t *cpustate)
+{
+  cpu->pc = cpustate->pc;
+  cpu->x = cpustate->x;
+  cpu->y = cpustate->y;
+  cpu->a = cpustate->a;
+  cpu->b = cpustate->b;
+  cpu->np = cpustate->np;
+  cpu->sp = cpustate->sp;
+  cpu->flags = cpustate->flags;
+  cpu->tick_counter = cpustate->tick_counter;
+  cpu->clk_timer_timestamp = cpustate->clk_timer_timestamp;
+  cpu->prog_timer_timestamp = cpustate->prog_timer_timestamp;
+  cpu->prog_timer_enabled = cpustate->prog_timer_enabled;
+  cpu->prog_timer_data = cpustate->prog_timer_data;
+  cpu->prog_timer_rld = cpustate->prog_timer_rld;
+  cpu->call_depth = cpustate->call_depth;
   //memory = (u4_t *)cpustate->memory;
   uint8_t i;
+#ifdef ENABLE_UNPACKED_RAM
+  u13_t n;
+
+  for (n = 0; n < MEMORY_SIZE; n++) {
+    set_ram_byte(cpu, n, cpustate->memory[n]);
+  }
+#endif
   for(i=0;i<6;i++) {
-    interrupts[i].factor_flag_reg = cpustate->interrupts[i].factor_flag_reg;
-    interrupts[i].mask_reg = cpustate->interrupts[i].mask_reg;
-    interrupts[i].triggered = cpustate->interrupts[i].triggered;
-    interrupts[i].vector = cpustate->interrupts[i].vector;
+    cpu->interrupts[i].factor_flag_reg = cpustate->interrupts[i].factor_flag_reg;
+    cpu->interrupts[i].mask_reg = cpustate->interrupts[i].mask_reg;
+    cpu->interrupts[i].triggered = cpustate->interrupts[i].triggered;
+    cpu->interrupts[i].vector = cpustate->interrupts[i].vector;
   }
+
+  schedule_timers(cpu);
 }
 
-u32_t cpu_get_depth(void)
+static u8_t *put_le(u8_t *p, u32_t v, u8_t size)
+{
+  while (size--) {
+    *p++ = v & 0xFF;
+    v >>= 8;
+  }
+
+  return p;
+}
+
+static u32_t get_le(const u8_t **p, u8_t size)
+{
+  u32_t v = 0;
+  u8_t i;
+
+  for (i = 0; i < size; i++) {
+    v |= (u32_t) (*p)[i] << (i * 8);
+  }
+  *p += size;
+
+  return v;
+}
+
+/* next_pc is not saved, it is always set again before being used */
+void cpu_pack_regs_ctx(cpu_t *cpu, u8_t *buf)
+{
+  u8_t *p = buf;
+  u8_t triggered = 0;
+  u13_t i;
+
+  p = put_le(p, cpu->pc, 2);
+  p = put_le(p, cpu->x, 2);
+  p = put_le(p, cpu->y, 2);
+  *p++ = cpu->a | (cpu->b << 4);
+  *p++ = cpu->np;
+  *p++ = cpu->sp;
+  *p++ = cpu->flags | (cpu->inputs[0].states << 4);
+  *p++ = cpu->inputs[1].states | (cpu->prog_timer_enabled << 4);
+  p = put_le(p, cpu->tick_counter, 4);
+  p = put_le(p, cpu->clk_timer_timestamp, 4);
+  p = put_le(p, cpu->prog_timer_timestamp, 4);
+  *p++ = cpu->prog_timer_data;
+  *p++ = cpu->prog_timer_rld;
+  p = put_le(p, cpu->call_depth, 4);
+  *p++ = cpu->previous_cycles;
+  for (i = 0; i < INT_SLOT_NUM; i++) {
+    *p++ = cpu->interrupts[i].factor_flag_reg | (cpu->interrupts[i].mask_reg << 4);
+    triggered |= cpu->interrupts[i].triggered << i;
+  }
+  *p++ = triggered;
+}
+
+void cpu_pack_state_ctx(cpu_t *cpu, u8_t *buf)
+{
+  u8_t *p = buf + CPU_PACKED_REGS_SIZE;
+  u13_t i;
+
+  cpu_pack_regs_ctx(cpu, buf);
+  for (i = 0; i < MEMORY_SIZE; i++) {
+    *p++ = get_ram_byte(cpu, i);
+  }
+}
+
+u8_t cpu_get_packed_ram_ctx(cpu_t *cpu, u13_t i)
+{
+  return get_ram_byte(cpu, i);
+}
+
+void cpu_unpack_regs_ctx(cpu_t *cpu, const u8_t *buf)
+{
+  const u8_t *p = buf;
+  u8_t v;
+  u13_t i;
+
+  cpu->pc = get_le(&p, 2) & 0x1FFF;
+  cpu->x = get_le(&p, 2) & 0xFFF;
+  cpu->y = get_le(&p, 2) & 0xFFF;
+  v = *p++;
+  cpu->a = v & 0xF;
+  cpu->b = v >> 4;
+  cpu->np = *p++ & 0x1F;
+  cpu->sp = *p++;
+  v = *p++;
+  cpu->flags = v & 0xF;
+  cpu->inputs[0].states = v >> 4;
+  v = *p++;
+  cpu->inputs[1].states = v & 0xF;
+  cpu->prog_timer_enabled = (v >> 4) & 0x1;
+  cpu->tick_counter = get_le(&p, 4);
+  cpu->clk_timer_timestamp = get_le(&p, 4);
+  cpu->prog_timer_timestamp = get_le(&p, 4);
+  cpu->prog_timer_data = *p++;
+  cpu->prog_timer_rld = *p++;
+  cpu->call_depth = get_le(&p, 4);
+  cpu->previous_cycles = *p++;
+  for (i = 0; i < INT_SLOT_NUM; i++) {
+    cpu->interrupts[i].factor_flag_reg = p[i] & 0xF;
+    cpu->interrupts[i].mask_reg = p[i] >> 4;
+    cpu->interrupts[i].triggered = (p[INT_SLOT_NUM] >> i) & 0x1;
+  }
+
+  schedule_timers(cpu);
+}
+
+void cpu_set_packed_ram_ctx(cpu_t *cpu, u13_t i, u8_t v)
+{
+  set_ram_byte(cpu, i, v);
+}
+
+void cpu_unpack_state_ctx(cpu_t *cpu, const u8_t *buf)
+{
+  const u8_t *p = buf + CPU_PACKED_REGS_SIZE;
+  u13_t i;
+
+  cpu_unpack_regs_ctx(cpu, buf);
+  for (i = 0; i < MEMORY_SIZE; i++) {
+    set_ram_byte(cpu, i, *p++);
+  }
+}
+
+u32_t cpu_get_depth_ctx(cpu_t *cpu)
 {
-  return call_depth;
+  return cpu->call_depth;
 }
 
-static void generate_interrupt(int_slot_t slot, u8_t bit)
+static void generate_interrupt(cpu_t *cpu, int_slot_t slot, u8_t bit)
 {
   /* Set the factor flag no matter what */
-  interrupts[slot].factor_flag_reg = interrupts[slot].factor_flag_reg | (0x1 << bit);
+  cpu->interrupts[slot].factor_flag_reg = cpu->interrupts[slot].factor_flag_reg | (0x1 << bit);
 
   /* Trigger the INT only if not masked */
-  if (interrupts[slot].mask_reg & (0x1 << bit)) {
-    interrupts[slot].triggered = 1;
+  if (cpu->interrupts[slot].mask_reg & (0x1 << bit)) {
+    cpu->interrupts[slot].triggered = 1;
   }
 }
 
-void cpu_set_input_pin(pin_t pin, pin_state_t state)
+void cpu_set_input_pin_ctx(cpu_t *cpu, pin_t pin, pin_state_t state)
 {
   /* Set the I/O */
-  inputs[pin & 0x4].states = (inputs[pin & 0x4].states & ~(0x1 << (pin & 0x3))) | (state << (pin & 0x3));
+  cpu->inputs[pin & 0x4].states = (cpu->inputs[pin & 0x4].states & ~(0x1 << (pin & 0x3))) | (state << (pin & 0x3));
 
   /* Trigger the interrupt (TODO: handle relation register) */
   if (state == PIN_STATE_LOW) {
     switch ((pin & 0x4) >> 2) {
       case 0:
-        generate_interrupt(INT_K00_K03_SLOT, pin & 0x3);
+        generate_interrupt(cpu, INT_K00_K03_SLOT, pin & 0x3);
         break;
 
       case 1:
-        generate_interrupt(INT_K10_K13_SLOT, pin & 0x3);
+        generate_interrupt(cpu, INT_K10_K13_SLOT, pin & 0x3);
         break;
     }
   }
 }
 
-void cpu_sync_ref_timestamp(void)
+void cpu_sync_ref_timestamp_ctx(cpu_t *cpu)
 {
-  ref_ts = g_hal->get_timestamp();
+  cpu->ref_ts = cpu->hal->get_timestamp();
+  cpu->pending_ticks = 0;
 }
 
-static u4_t get_io(u12_t n)
+static u4_t get_io(cpu_t *cpu, u12_t n)
 {
   u4_t tmp;
 
   switch (n) {
     case REG_CLK_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (clock timer) */
-      tmp = interrupts[INT_CLOCK_TIMER_SLOT].factor_flag_reg;
-      interrupts[INT_CLOCK_TIMER_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_CLOCK_TIMER_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_CLOCK_TIMER_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_SW_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (stopwatch) */
-      tmp = interrupts[INT_STOPWATCH_SLOT].factor_flag_reg;
-      interrupts[INT_STOPWATCH_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_STOPWATCH_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_STOPWATCH_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_PROG_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (prog timer) */
-      tmp = interrupts[INT_PROG_TIMER_SLOT].factor_flag_reg;
-      interrupts[INT_PROG_TIMER_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_PROG_TIMER_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_PROG_TIMER_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_SERIAL_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (serial) */
-      tmp = interrupts[INT_SERIAL_SLOT].factor_flag_reg;
-      interrupts[INT_SERIAL_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_SERIAL_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_SERIAL_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_K00_K03_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (K00-K03) */
-      tmp = interrupts[INT_K00_K03_SLOT].factor_flag_reg;
-      interrupts[INT_K00_K03_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_K00_K03_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_K00_K03_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_K10_K13_INT_FACTOR_FLAGS:
       /* Interrupt factor flags (K10-K13) */
-      tmp = interrupts[INT_K10_K13_SLOT].factor_flag_reg;
-      interrupts[INT_K10_K13_SLOT].factor_flag_reg = 0;
+      tmp = cpu->interrupts[INT_K10_K13_SLOT].factor_flag_reg;
+      cpu->interrupts[INT_K10_K13_SLOT].factor_flag_reg = 0;
       return tmp;
 
     case REG_CLOCK_INT_MASKS:
       /* Clock timer interrupt masks */
-      return interrupts[INT_CLOCK_TIMER_SLOT].mask_reg;
+      return cpu->interrupts[INT_CLOCK_TIMER_SLOT].mask_reg;
 
     case REG_SW_INT_MASKS:
       /* Stopwatch interrupt masks */
-      return interrupts[INT_STOPWATCH_SLOT].mask_reg & 0x3;
+      return cpu->interrupts[INT_STOPWATCH_SLOT].mask_reg & 0x3;
 
     case REG_PROG_INT_MASKS:
       /* Prog timer interrupt masks */
-      return interrupts[INT_PROG_TIMER_SLOT].mask_reg & 0x1;
+      return cpu->interrupts[INT_PROG_TIMER_SLOT].mask_reg & 0x1;
 
     case REG_SERIAL_INT_MASKS:
       /* Serial interface interrupt masks */
-      return interrupts[INT_SERIAL_SLOT].mask_reg & 0x1;
+      return cpu->interrupts[INT_SERIAL_SLOT].mask_reg & 0x1;
 
     case REG_K00_K03_INT_MASKS:
       /* Input (K00-K03) interrupt masks */
-      return interrupts[INT_K00_K03_SLOT].mask_reg;
+      return cpu->interrupts[INT_K00_K03_SLOT].mask_reg;
 
     case REG_K10_K13_INT_MASKS:
       /* Input (K10-K13) interrupt masks */
-      return interrupts[INT_K10_K13_SLOT].mask_reg;
+      return cpu->interrupts[INT_K10_K13_SLOT].mask_reg;
 
     case REG_PROG_TIMER_DATA_L:
       /* Prog timer data (low) */
-      return prog_timer_data & 0xF;
+      return cpu->prog_timer_data & 0xF;
 
     case REG_PROG_TIMER_DATA_H:
       /* Prog timer data (high) */
-      return (prog_timer_data >> 4) & 0xF;
+      return (cpu->prog_timer_data >> 4) & 0xF;
 
     case REG_PROG_TIMER_RELOAD_DATA_L:
       /* Prog timer reload data (low) */
-      return prog_timer_rld & 0xF;
+      return cpu->prog_timer_rld & 0xF;
 
     case REG_PROG_TIMER_RELOAD_DATA_H:
       /* Prog timer reload data (high) */
-      return (prog_timer_rld >> 4) & 0xF;
+      return (cpu->prog_timer_rld >> 4) & 0xF;
 
     case REG_K00_K03_INPUT_PORT:
       /* Input port (K00-K03) */
-      return inputs[0].states;
+      return cpu->inputs[0].states;
 
     case REG_K10_K13_INPUT_PORT:
       /* Input port (K10-K13) */
-      return inputs[1].states;
+      return cpu->inputs[1].states;
 
     case REG_K40_K43_BZ_OUTPUT_PORT:
       /* Output port (R40-R43) */
@@ -469,7 +679,7 @@ static u4_t get_io(u12_t n)
 
     case REG_PROG_TIMER_CTRL:
       /* Prog timer stop/run/reset */
-      return !!prog_timer_enabled;
+      return !!cpu->prog_timer_enabled;
 
     case REG_PROG_TIMER_CLK_SEL:
       /* Prog timer clock selection */
@@ -483,53 +693,53 @@ static u4_t get_io(u12_t n)
   return 0;
 }
 
-static void set_io(u12_t n, u4_t v)
+static void set_io(cpu_t *cpu, u12_t n, u4_t v)
 {
   switch (n) {
     case REG_CLOCK_INT_MASKS:
       /* Clock timer interrupt masks */
       /* Assume 1Hz timer INT enabled (0x8) */
-      interrupts[INT_CLOCK_TIMER_SLOT].mask_reg = v;
+      cpu->interrupts[INT_CLOCK_TIMER_SLOT].mask_reg = v;
       break;
 
     case REG_SW_INT_MASKS:
       /* Stopwatch interrupt masks */
       /* Assume all INT disabled */
-      interrupts[INT_STOPWATCH_SLOT].mask_reg = v;
+      cpu->interrupts[INT_STOPWATCH_SLOT].mask_reg = v;
       break;
 
     case REG_PROG_INT_MASKS:
       /* Prog timer interrupt masks */
       /* Assume Prog timer INT enabled (0x1) */
-      interrupts[INT_PROG_TIMER_SLOT].mask_reg = v;
+      cpu->interrupts[INT_PROG_TIMER_SLOT].mask_reg = v;
       break;
 
     case REG_SERIAL_INT_MASKS:
       /* Serial interface interrupt masks */
       /* Assume all INT disabled */
-      interrupts[INT_K10_K13_SLOT].mask_reg = v;
+      cpu->interrupts[INT_K10_K13_SLOT].mask_reg = v;
       break;
 
     case REG_K00_K03_INT_MASKS:
       /* Input (K00-K03) interrupt masks */
       /* Assume all INT disabled */
-      interrupts[INT_SERIAL_SLOT].mask_reg = v;
+      cpu->interrupts[INT_SERIAL_SLOT].mask_reg = v;
       break;
 
     case REG_K10_K13_INT_MASKS:
       /* Input (K10-K13) interrupt masks */
       /* Assume all INT disabled */
-      interrupts[INT_K10_K13_SLOT].mask_reg = v;
+      cpu->interrupts[INT_K10_K13_SLOT].mask_reg = v;
       break;
 
     case REG_PROG_TIMER_RELOAD_DATA_L:
       /* Prog timer reload data (low) */
-      prog_timer_rld = v | (prog_timer_rld & 0xF0);
+      cpu->prog_timer_rld = v | (cpu->prog_timer_rld & 0xF0);
       break;
 
     case REG_PROG_TIMER_RELOAD_DATA_H:
       /* Prog timer reload data (high) */
-      prog_timer_rld = (prog_timer_rld & 0xF) | (v << 4);
+      cpu->prog_timer_rld = (cpu->prog_timer_rld & 0xF) | (v << 4);
       break;
 
     case REG_K00_K03_INPUT_PORT:
@@ -540,7 +750,7 @@ static void set_io(u12_t n, u4_t v)
     case REG_K40_K43_BZ_OUTPUT_PORT:
       /* Output port (R40-R43) */
       //g_hal->log(LOG_INFO, "Output/Buzzer: 0x%X\n", v);
-      hw_enable_buzzer(!(v & 0x8));
+      hw_enable_buzzer_ctx(cpu->hw, !(v & 0x8));
       break;
 
     case REG_CPU_OSC3_CTRL:
@@ -564,7 +774,7 @@ static void set_io(u12_t n, u4_t v)
 
     case REG_BUZZER_CTRL1:
       /* Buzzer config 1 */
-      hw_set_buzzer_freq(v & 0x7);
+      hw_set_buzzer_freq_ctx(cpu->hw, v & 0x7);
       break;
 
     case REG_BUZZER_CTRL2:
@@ -583,14 +793,15 @@ static void set_io(u12_t n, u4_t v)
     case REG_PROG_TIMER_CTRL:
       /* Prog timer stop/run/reset */
       if (v & 0x2) {
-        prog_timer_data = prog_timer_rld;
+        cpu->prog_timer_data = cpu->prog_timer_rld;
       }
 
-      if ((v & 0x1) && !prog_timer_enabled) {
-        prog_timer_timestamp = tick_counter;
+      if ((v & 0x1) && !cpu->prog_timer_enabled) {
+        cpu->prog_timer_timestamp = cpu->tick_counter;
       }
 
-      prog_timer_enabled = v & 0x1;
+      cpu->prog_timer_enabled = v & 0x1;
+      schedule_timers(cpu);
       break;
 
     case REG_PROG_TIMER_CLK_SEL:
@@ -604,17 +815,14 @@ static void set_io(u12_t n, u4_t v)
   }
 }
 
-static void set_lcd(u12_t n, u4_t v)
+static void set_lcd(cpu_t *cpu, u12_t n, u4_t v)
 {
-  u8_t i;
   u8_t seg, com0;
 
   seg = ((n & 0x7F) >> 1);
   com0 = (((n & 0x80) >> 7) * 8 + (n & 0x1) * 4);
 
-  for (i = 0; i < 4; i++) {
-    hw_set_lcd_pin(seg, com0 + i, (v >> i) & 0x1);
-  }
+  hw_set_lcd_nibble_ctx(cpu->hw, seg, com0, v);
 }
 
 /*
@@ -638,76 +846,92 @@ u8_t cpu_get_max_number() {
   return maxNumber;
 }
 */
-static u4_t get_memory(u12_t n)
+/* Most accesses are to RAM through x/y, so that check comes first and is inlined
+ * in every instruction, the other ranges are handled out of line below.
+ */
+static ALWAYS_INLINE u4_t get_ram(cpu_t *cpu, u12_t n)
 {
-  u4_t res = 0;
-  
+#ifdef ENABLE_UNPACKED_RAM
+  return cpu->memory[n];
+#else
+  if ((n & 0x1)==0) {
+    return cpu->memory[n>>1] >> 4;
+  }
+  return cpu->memory[n>>1] & 0b00001111;
+#endif
+}
 
-  if (n < MEM_RAM_SIZE) {
-    /* RAM */
-    //g_hal->log(LOG_MEMORY, "RAM              - ");
-    //if (n > max_memory_addr_access) max_memory_addr_access = n;
-    if ((n & 0x1)==0) {
-      res = memory[n>>1] >> 4;
-    } else {
-      res = memory[n>>1] & 0b00001111;
-    }
-    
-  } else if (n >= MEM_DISPLAY1_ADDR && n < (MEM_DISPLAY1_ADDR + MEM_DISPLAY1_SIZE)) {
+static ALWAYS_INLINE void set_ram(cpu_t *cpu, u12_t n, u4_t v)
+{
+#ifdef ENABLE_UNPACKED_RAM
+  cpu->memory[n] = v;
+#else
+  if ((n & 0x1)==0) {
+    cpu->memory[n>>1] = (cpu->memory[n>>1] & 0x0F) | (v << 4);
+  } else {
+    cpu->memory[n>>1] = (cpu->memory[n>>1] & 0xF0) | v;
+  }
+#endif
+}
+
+static u4_t get_memory_hw(cpu_t *cpu, u12_t n)
+{
+  if (n >= MEM_DISPLAY1_ADDR && n < (MEM_DISPLAY1_ADDR + MEM_DISPLAY1_SIZE)) {
     /* Display Memory 1 */
     //g_hal->log(LOG_MEMORY, "Display Memory 1 - ");
     //res = memory[n - MEM_DISPLAY1_ADDR_OFS];
-      res = 0;  
-
+    return 0;
   } else if (n >= MEM_DISPLAY2_ADDR && n < (MEM_DISPLAY2_ADDR + MEM_DISPLAY2_SIZE)) {
     /* Display Memory 2 */
     //g_hal->log(LOG_MEMORY, "Display Memory 2 - ");
     //res = memory[n - MEM_DISPLAY2_ADDR_OFS];
-      res = 0;  
+    return 0;
   } else if (n >= MEM_IO_ADDR && n < (MEM_IO_ADDR + MEM_IO_SIZE)) {
     /* I/O Memory */
     //g_hal->log(LOG_MEMORY, "I/O              - ");
-    res = get_io(n);
-  } else {
-    //g_hal->log(LOG_ERROR,   "Read from invalid memory address 0x%03X - PC = 0x%04X\n", n, pc);
-    return 0;
+    return get_io(cpu, n);
   }
 
-  //g_hal->log(LOG_MEMORY, "Read  0x%X - Address 0x%03X - PC = 0x%04X\n", res, n, pc);
-
-  return res;
+  //g_hal->log(LOG_ERROR,   "Read from invalid memory address 0x%03X - PC = 0x%04X\n", n, pc);
+  return 0;
 }
 
-static void set_memory(u12_t n, u4_t v)
+static void set_memory_hw(cpu_t *cpu, u12_t n, u4_t v)
 {
-  if (n < MEM_RAM_SIZE) {
-    /* RAM */
-    //g_hal->log(LOG_MEMORY, "RAM              - ");
-    if ((n & 0x1)==0) {
-      memory[n>>1] = (memory[n>>1] & 0x0F) | (v << 4);
-    } else {
-      memory[n>>1] = (memory[n>>1] & 0xF0) | v;
-    }
-    //memory[n] = v;
-  } else if (n >= MEM_DISPLAY1_ADDR && n < (MEM_DISPLAY1_ADDR + MEM_DISPLAY1_SIZE)) {
+  if (n >= MEM_DISPLAY1_ADDR && n < (MEM_DISPLAY1_ADDR + MEM_DISPLAY1_SIZE)) {
     /* Display Memory 1 */
-    set_lcd(n, v);
+    set_lcd(cpu, n, v);
     //memory[n - MEM_DISPLAY1_ADDR_OFS] = v;
     //g_hal->log(LOG_MEMORY, "Display Memory 1 - ");
   } else if (n >= MEM_DISPLAY2_ADDR && n < (MEM_DISPLAY2_ADDR + MEM_DISPLAY2_SIZE)) {
     /* Display Memory 2 */
-    set_lcd(n, v);
+    set_lcd(cpu, n, v);
     //memory[n - MEM_DISPLAY2_ADDR_OFS] = v;
     //g_hal->log(LOG_MEMORY, "Display Memory 2 - ");
   } else if (n >= MEM_IO_ADDR && n < (MEM_IO_ADDR + MEM_IO_SIZE)) {
     /* I/O Memory */
-    set_io(n, v);
+    set_io(cpu, n, v);
     //g_hal->log(LOG_MEMORY, "I/O              - ");
   } else {
     //g_hal->log(LOG_ERROR,   "Write 0x%X to invalid memory address 0x%03X - PC = 0x%04X\n", v, n, pc);
-    return;
   }
-  //g_hal->log(LOG_MEMORY, "Write 0x%X - Address 0x%03X - PC = 0x%04X\n", v, n, pc);
+}
+
+static ALWAYS_INLINE u4_t get_memory(cpu_t *cpu, u12_t n)
+{
+  if (n < MEM_RAM_SIZE) {
+    return get_ram(cpu, n);
+  }
+  return get_memory_hw(cpu, n);
+}
+
+static ALWAYS_INLINE void set_memory(cpu_t *cpu, u12_t n, u4_t v)
+{
+  if (n < MEM_RAM_SIZE) {
+    set_ram(cpu, n, v);
+  } else {
+    set_memory_hw(cpu, n, v);
+  }
 }
 /*
 void cpu_refresh_hw(void)
@@ -731,513 +955,513 @@ void cpu_refresh_hw(void)
   }
 }*/
 
-static u4_t get_rq(u12_t rq)
+static ALWAYS_INLINE u4_t get_rq(cpu_t *cpu, u12_t rq)
 {
   switch (rq & 0x3) {
-    case 0x0: return a;
-    case 0x1: return b;
-    case 0x2: return M(x);
-    case 0x3: return M(y);
+    case 0x0: return cpu->a;
+    case 0x1: return cpu->b;
+    case 0x2: return M(cpu->x);
+    case 0x3: return M(cpu->y);
   }
   return 0;
 }
 
-static void set_rq(u12_t rq, u4_t v)
+static ALWAYS_INLINE void set_rq(cpu_t *cpu, u12_t rq, u4_t v)
 {
   switch (rq & 0x3) {
-    case 0x0: a = v; break;
-    case 0x1: b = v; break;
-    case 0x2: SET_M(x, v); break;
-    case 0x3: SET_M(y, v); break;
+    case 0x0: cpu->a = v; break;
+    case 0x1: cpu->b = v; break;
+    case 0x2: SET_M(cpu->x, v); break;
+    case 0x3: SET_M(cpu->y, v); break;
   }
 }
 
 /* Instructions */
-static void op_pset_cb(u8_t arg0, u8_t arg1)
+static void op_pset_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  np = arg0;
+  cpu->np = arg0;
 }
 
-static void op_jp_cb(u8_t arg0, u8_t arg1)
+static void op_jp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  next_pc = arg0 | (np << 8);
+  cpu->next_pc = arg0 | (cpu->np << 8);
 }
 
-static void op_jp_c_cb(u8_t arg0, u8_t arg1)
+static void op_jp_c_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  if (flags & FLAG_C) {
-    next_pc = arg0 | (np << 8);
+  if (cpu->flags & FLAG_C) {
+    cpu->next_pc = arg0 | (cpu->np << 8);
   }
 }
 
-static void op_jp_nc_cb(u8_t arg0, u8_t arg1)
+static void op_jp_nc_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  if (!(flags & FLAG_C)) {
-    next_pc = arg0 | (np << 8);
+  if (!(cpu->flags & FLAG_C)) {
+    cpu->next_pc = arg0 | (cpu->np << 8);
   }
 }
 
-static void op_jp_z_cb(u8_t arg0, u8_t arg1)
+static void op_jp_z_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  if (flags & FLAG_Z) {
-    next_pc = arg0 | (np << 8);
+  if (cpu->flags & FLAG_Z) {
+    cpu->next_pc = arg0 | (cpu->np << 8);
   }
 }
 
-static void op_jp_nz_cb(u8_t arg0, u8_t arg1)
+static void op_jp_nz_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  if (!(flags & FLAG_Z)) {
-    next_pc = arg0 | (np << 8);
+  if (!(cpu->flags & FLAG_Z)) {
+    cpu->next_pc = arg0 | (cpu->np << 8);
   }
 }
 
-static void op_jpba_cb(u8_t arg0, u8_t arg1)
+static void op_jpba_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  next_pc = a | (b << 4) | (np << 8);
+  cpu->next_pc = cpu->a | (cpu->b << 4) | (cpu->np << 8);
 }
 
-static void op_call_cb(u8_t arg0, u8_t arg1)
+static void op_call_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  pc = (pc + 1) & 0x1FFF; // This does not actually change the PC register
-  SET_M(sp - 1, PCP);
-  SET_M(sp - 2, PCSH);
-  SET_M(sp - 3, PCSL);
-  sp = (sp - 3) & 0xFF;
-  next_pc = TO_PC(PCB, NPP, arg0);
-  call_depth++;
+  cpu->pc = (cpu->pc + 1) & 0x1FFF; // This does not actually change the PC register
+  SET_M(cpu->sp - 1, PCP);
+  SET_M(cpu->sp - 2, PCSH);
+  SET_M(cpu->sp - 3, PCSL);
+  cpu->sp = (cpu->sp - 3) & 0xFF;
+  cpu->next_pc = TO_PC(PCB, NPP, arg0);
+  cpu->call_depth++;
 }
 
-static void op_calz_cb(u8_t arg0, u8_t arg1)
+static void op_calz_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  pc = (pc + 1) & 0x1FFF; // This does not actually change the PC register
-  SET_M(sp - 1, PCP);
-  SET_M(sp - 2, PCSH);
-  SET_M(sp - 3, PCSL);
-  sp = (sp - 3) & 0xFF;
-  next_pc = TO_PC(PCB, 0, arg0);
-  call_depth++;
+  cpu->pc = (cpu->pc + 1) & 0x1FFF; // This does not actually change the PC register
+  SET_M(cpu->sp - 1, PCP);
+  SET_M(cpu->sp - 2, PCSH);
+  SET_M(cpu->sp - 3, PCSL);
+  cpu->sp = (cpu->sp - 3) & 0xFF;
+  cpu->next_pc = TO_PC(PCB, 0, arg0);
+  cpu->call_depth++;
 }
 
-static void op_ret_cb(u8_t arg0, u8_t arg1)
+static void op_ret_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  next_pc = M(sp) | (M(sp + 1) << 4) | (M(sp + 2) << 8) | (PCB << 12);
-  sp = (sp + 3) & 0xFF;
-  call_depth--;
+  cpu->next_pc = M(cpu->sp) | (M(cpu->sp + 1) << 4) | (M(cpu->sp + 2) << 8) | (PCB << 12);
+  cpu->sp = (cpu->sp + 3) & 0xFF;
+  cpu->call_depth--;
 }
 
-static void op_rets_cb(u8_t arg0, u8_t arg1)
+static void op_rets_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  next_pc = M(sp) | (M(sp + 1) << 4) | (M(sp + 2) << 8) | (PCB << 12);
-  sp = (sp + 3) & 0xFF;
-  next_pc = (pc + 1) & 0x1FFF;
-  call_depth--;
+  cpu->next_pc = M(cpu->sp) | (M(cpu->sp + 1) << 4) | (M(cpu->sp + 2) << 8) | (PCB << 12);
+  cpu->sp = (cpu->sp + 3) & 0xFF;
+  cpu->next_pc = (cpu->pc + 1) & 0x1FFF;
+  cpu->call_depth--;
 }
 
-static void op_retd_cb(u8_t arg0, u8_t arg1)
+static void op_retd_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  next_pc = M(sp) | (M(sp + 1) << 4) | (M(sp + 2) << 8) | (PCB << 12);
-  sp = (sp + 3) & 0xFF;
-  SET_M(x, arg0 & 0xF);
-  SET_M(x + 1, (arg0 >> 4) & 0xF);
-  x = ((x + 2) & 0xFF) | (XP << 8);
-  call_depth--;
+  cpu->next_pc = M(cpu->sp) | (M(cpu->sp + 1) << 4) | (M(cpu->sp + 2) << 8) | (PCB << 12);
+  cpu->sp = (cpu->sp + 3) & 0xFF;
+  SET_M(cpu->x, arg0 & 0xF);
+  SET_M(cpu->x + 1, (arg0 >> 4) & 0xF);
+  cpu->x = ((cpu->x + 2) & 0xFF) | (XP << 8);
+  cpu->call_depth--;
 }
 
-static void op_nop5_cb(u8_t arg0, u8_t arg1)
+static void op_nop5_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
 }
 
-static void op_nop7_cb(u8_t arg0, u8_t arg1)
+static void op_nop7_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
 }
 
-static void op_halt_cb(u8_t arg0, u8_t arg1)
+static void op_halt_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  g_hal->halt();
+  cpu->hal->halt();
 }
 
-static void op_inc_x_cb(u8_t arg0, u8_t arg1)
+static void op_inc_x_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = ((x + 1) & 0xFF) | (XP << 8);
+  cpu->x = ((cpu->x + 1) & 0xFF) | (XP << 8);
 }
 
-static void op_inc_y_cb(u8_t arg0, u8_t arg1)
+static void op_inc_y_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = ((y + 1) & 0xFF) | (YP << 8);
+  cpu->y = ((cpu->y + 1) & 0xFF) | (YP << 8);
 }
 
-static void op_ld_x_cb(u8_t arg0, u8_t arg1)
+static void op_ld_x_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = arg0 | (XP << 8);
+  cpu->x = arg0 | (XP << 8);
 }
 
-static void op_ld_y_cb(u8_t arg0, u8_t arg1)
+static void op_ld_y_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = arg0 | (YP << 8);
+  cpu->y = arg0 | (YP << 8);
 }
 
-static void op_ld_xp_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_xp_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = XHL | (RQ(arg0) << 8);
+  cpu->x = XHL | (RQ(arg0) << 8);
 }
 
-static void op_ld_xh_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_xh_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = XL1 | (RQ(arg0) << 4) | (XP << 8);
+  cpu->x = XL1 | (RQ(arg0) << 4) | (XP << 8);
 }
 
-static void op_ld_xl_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_xl_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = RQ(arg0) | (XH1 << 4) | (XP << 8);
+  cpu->x = RQ(arg0) | (XH1 << 4) | (XP << 8);
 }
 
-static void op_ld_yp_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_yp_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = YHL | (RQ(arg0) << 8);
+  cpu->y = YHL | (RQ(arg0) << 8);
 }
 
-static void op_ld_yh_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_yh_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = YL1 | (RQ(arg0) << 4) | (YP << 8);
+  cpu->y = YL1 | (RQ(arg0) << 4) | (YP << 8);
 }
 
-static void op_ld_yl_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_yl_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = RQ(arg0) | (YH1 << 4) | (YP << 8);
+  cpu->y = RQ(arg0) | (YH1 << 4) | (YP << 8);
 }
 
-static void op_ld_r_xp_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_xp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, XP);
 }
 
-static void op_ld_r_xh_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_xh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, XH1);
 }
 
-static void op_ld_r_xl_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_xl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, XL1);
 }
 
-static void op_ld_r_yp_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_yp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, YP);
 }
 
-static void op_ld_r_yh_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_yh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, YH1);
 }
 
-static void op_ld_r_yl_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_yl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, YL1);
 }
 
-static void op_adc_xh_cb(u8_t arg0, u8_t arg1)
+static void op_adc_xh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
   tmp = XH1 + arg0 + C;
-  x = XL1 | ((tmp & 0xF) << 4)| (XP << 8);
+  cpu->x = XL1 | ((tmp & 0xF) << 4)| (XP << 8);
   if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
   if (!(tmp & 0xF)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_adc_xl_cb(u8_t arg0, u8_t arg1)
+static void op_adc_xl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
   tmp = XL1 + arg0 + C;
-  x = (tmp & 0xF) | (XH1 << 4) | (XP << 8);
+  cpu->x = (tmp & 0xF) | (XH1 << 4) | (XP << 8);
   if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
   if (!(tmp & 0xF)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_adc_yh_cb(u8_t arg0, u8_t arg1)
+static void op_adc_yh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
   tmp = YH1 + arg0 + C;
-  y = YL1 | ((tmp & 0xF) << 4)| (YP << 8);
+  cpu->y = YL1 | ((tmp & 0xF) << 4)| (YP << 8);
   if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
   if (!(tmp & 0xF)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_adc_yl_cb(u8_t arg0, u8_t arg1)
+static void op_adc_yl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
   tmp = YL1 + arg0 + C;
-  y = (tmp & 0xF) | (YH1 << 4) | (YP << 8);
+  cpu->y = (tmp & 0xF) | (YH1 << 4) | (YP << 8);
   if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
   if (!(tmp & 0xF)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_xh_cb(u8_t arg0, u8_t arg1)
+static void op_cp_xh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (XH1 < arg0) { SET_C(); } else { CLEAR_C(); }
   if (XH1 == arg0) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_xl_cb(u8_t arg0, u8_t arg1)
+static void op_cp_xl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (XL1 < arg0) { SET_C(); } else { CLEAR_C(); }
   if (XL1 == arg0) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_yh_cb(u8_t arg0, u8_t arg1)
+static void op_cp_yh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (YH1 < arg0) { SET_C(); } else { CLEAR_C(); }
   if (YH1 == arg0) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_yl_cb(u8_t arg0, u8_t arg1)
+static void op_cp_yl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (YL1 < arg0) { SET_C(); } else { CLEAR_C(); }
   if (YL1 == arg0) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_ld_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, arg1);
 }
 
-static void op_ld_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg1));
 }
 
-static void op_ld_a_mn_cb(u8_t arg0, u8_t arg1)
+static void op_ld_a_mn_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  a = M(arg0);
+  cpu->a = M(arg0);
 }
 
-static void op_ld_b_mn_cb(u8_t arg0, u8_t arg1)
+static void op_ld_b_mn_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  b = M(arg0);
+  cpu->b = M(arg0);
 }
 
-static void op_ld_mn_a_cb(u8_t arg0, u8_t arg1)
+static void op_ld_mn_a_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_M(arg0, a);
+  SET_M(arg0, cpu->a);
 }
 
-static void op_ld_mn_b_cb(u8_t arg0, u8_t arg1)
+static void op_ld_mn_b_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_M(arg0, b);
+  SET_M(arg0, cpu->b);
 }
 
-static void op_ldpx_mx_cb(u8_t arg0, u8_t arg1)
+static void op_ldpx_mx_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_M(x, arg0);
-  x = ((x + 1) & 0xFF) | (XP << 8);
+  SET_M(cpu->x, arg0);
+  cpu->x = ((cpu->x + 1) & 0xFF) | (XP << 8);
 }
 
-static void op_ldpx_r_cb(u8_t arg0, u8_t arg1)
+static void op_ldpx_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg1));
-  x = ((x + 1) & 0xFF) | (XP << 8);
+  cpu->x = ((cpu->x + 1) & 0xFF) | (XP << 8);
 }
 
-static void op_ldpy_my_cb(u8_t arg0, u8_t arg1)
+static void op_ldpy_my_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_M(y, arg0);
-  y = ((y + 1) & 0xFF) | (YP << 8);
+  SET_M(cpu->y, arg0);
+  cpu->y = ((cpu->y + 1) & 0xFF) | (YP << 8);
 }
 
-static void op_ldpy_r_cb(u8_t arg0, u8_t arg1)
+static void op_ldpy_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg1));
-  y = ((y + 1) & 0xFF) | (YP << 8);
+  cpu->y = ((cpu->y + 1) & 0xFF) | (YP << 8);
 }
 
-static void op_lbpx_cb(u8_t arg0, u8_t arg1)
+static void op_lbpx_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_M(x, arg0 & 0xF);
-  SET_M(x + 1, (arg0 >> 4) & 0xF);
-  x = ((x + 2) & 0xFF) | (XP << 8);
+  SET_M(cpu->x, arg0 & 0xF);
+  SET_M(cpu->x + 1, (arg0 >> 4) & 0xF);
+  cpu->x = ((cpu->x + 2) & 0xFF) | (XP << 8);
 }
 
-static void op_set_cb(u8_t arg0, u8_t arg1)
+static void op_set_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  flags |= arg0;
+  cpu->flags |= arg0;
 }
 
-static void op_rst_cb(u8_t arg0, u8_t arg1)
+static void op_rst_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  flags &= arg0;
+  cpu->flags &= arg0;
 }
 
-static void op_scf_cb(u8_t arg0, u8_t arg1)
+static void op_scf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_C();
 }
 
-static void op_rcf_cb(u8_t arg0, u8_t arg1)
+static void op_rcf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   CLEAR_C();
 }
 
-static void op_szf_cb(u8_t arg0, u8_t arg1)
+static void op_szf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_Z();
 }
 
-static void op_rzf_cb(u8_t arg0, u8_t arg1)
+static void op_rzf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   CLEAR_Z();
 }
 
-static void op_sdf_cb(u8_t arg0, u8_t arg1)
+static void op_sdf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_D();
 }
 
-static void op_rdf_cb(u8_t arg0, u8_t arg1)
+static void op_rdf_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   CLEAR_D();
 }
 
-static void op_ei_cb(u8_t arg0, u8_t arg1)
+static void op_ei_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_I();
 }
 
-static void op_di_cb(u8_t arg0, u8_t arg1)
+static void op_di_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   CLEAR_I();
 }
 
-static void op_inc_sp_cb(u8_t arg0, u8_t arg1)
+static void op_inc_sp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp + 1) & 0xFF;
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_dec_sp_cb(u8_t arg0, u8_t arg1)
+static void op_dec_sp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
+  cpu->sp = (cpu->sp - 1) & 0xFF;
 }
 
-static void op_push_r_cb(u8_t arg0, u8_t arg1)
+static void op_push_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, RQ(arg0));
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, RQ(arg0));
 }
 
-static void op_push_xp_cb(u8_t arg0, u8_t arg1)
+static void op_push_xp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, XP);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, XP);
 }
 
-static void op_push_xh_cb(u8_t arg0, u8_t arg1)
+static void op_push_xh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, XH1);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, XH1);
 }
 
-static void op_push_xl_cb(u8_t arg0, u8_t arg1)
+static void op_push_xl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, XL1);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, XL1);
 }
 
-static void op_push_yp_cb(u8_t arg0, u8_t arg1)
+static void op_push_yp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, YP);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, YP);
 }
 
-static void op_push_yh_cb(u8_t arg0, u8_t arg1)
+static void op_push_yh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, YH1);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, YH1);
 }
 
-static void op_push_yl_cb(u8_t arg0, u8_t arg1)
+static void op_push_yl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, YL1);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, YL1);
 }
 
-static void op_push_f_cb(u8_t arg0, u8_t arg1)
+static void op_push_f_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = (sp - 1) & 0xFF;
-  SET_M(sp, flags);
+  cpu->sp = (cpu->sp - 1) & 0xFF;
+  SET_M(cpu->sp, cpu->flags);
 }
 
-static void op_pop_r_cb(u8_t arg0, u8_t arg1)
+static void op_pop_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  SET_RQ(arg0, M(sp));
-  sp = (sp + 1) & 0xFF;
+  SET_RQ(arg0, M(cpu->sp));
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_xp_cb(u8_t arg0, u8_t arg1)
+static void op_pop_xp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = XL1 | (XH1 << 4)| (M(sp) << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->x = XL1 | (XH1 << 4)| (M(cpu->sp) << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_xh_cb(u8_t arg0, u8_t arg1)
+static void op_pop_xh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = XL1 | (M(sp) << 4)| (XP << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->x = XL1 | (M(cpu->sp) << 4)| (XP << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_xl_cb(u8_t arg0, u8_t arg1)
+static void op_pop_xl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  x = M(sp) | (XH1 << 4)| (XP << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->x = M(cpu->sp) | (XH1 << 4)| (XP << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_yp_cb(u8_t arg0, u8_t arg1)
+static void op_pop_yp_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = YL1 | (YH1 << 4)| (M(sp) << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->y = YL1 | (YH1 << 4)| (M(cpu->sp) << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_yh_cb(u8_t arg0, u8_t arg1)
+static void op_pop_yh_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = YL1 | (M(sp) << 4)| (YP << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->y = YL1 | (M(cpu->sp) << 4)| (YP << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_yl_cb(u8_t arg0, u8_t arg1)
+static void op_pop_yl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  y = M(sp) | (YH1 << 4)| (YP << 8);
-  sp = (sp + 1) & 0xFF;
+  cpu->y = M(cpu->sp) | (YH1 << 4)| (YP << 8);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_pop_f_cb(u8_t arg0, u8_t arg1)
+static void op_pop_f_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  flags = M(sp);
-  sp = (sp + 1) & 0xFF;
+  cpu->flags = M(cpu->sp);
+  cpu->sp = (cpu->sp + 1) & 0xFF;
 }
 
-static void op_ld_sph_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_sph_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = SPL1 | (RQ(arg0) << 4);
+  cpu->sp = SPL1 | (RQ(arg0) << 4);
 }
 
-static void op_ld_spl_r_cb(u8_t arg0, u8_t arg1)
+static void op_ld_spl_r_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  sp = RQ(arg0) | (SPH1 << 4);
+  cpu->sp = RQ(arg0) | (SPH1 << 4);
 }
 
-static void op_ld_r_sph_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_sph_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, SPH1);
 }
 
-static void op_ld_r_spl_cb(u8_t arg0, u8_t arg1)
+static void op_ld_r_spl_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, SPL1);
 }
 
-static void op_add_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_add_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1257,7 +1481,7 @@ static void op_add_r_i_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_add_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_add_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1277,7 +1501,7 @@ static void op_add_r_q_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_adc_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_adc_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1297,7 +1521,7 @@ static void op_adc_r_i_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_adc_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_adc_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1317,7 +1541,7 @@ static void op_adc_r_q_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_sub_cb(u8_t arg0, u8_t arg1)
+static void op_sub_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1335,7 +1559,7 @@ static void op_sub_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_sbc_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_sbc_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1353,7 +1577,7 @@ static void op_sbc_r_i_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_sbc_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_sbc_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1371,65 +1595,65 @@ static void op_sbc_r_q_cb(u8_t arg0, u8_t arg1)
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_and_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_and_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) & arg1);
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_and_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_and_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) & RQ(arg1));
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_or_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_or_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) | arg1);
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_or_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_or_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) | RQ(arg1));
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_xor_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_xor_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) ^ arg1);
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_xor_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_xor_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, RQ(arg0) ^ RQ(arg1));
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_cp_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (RQ(arg0) < arg1) { SET_C(); } else { CLEAR_C(); }
   if (RQ(arg0) == arg1) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_cp_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_cp_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (RQ(arg0) < RQ(arg1)) { SET_C(); } else { CLEAR_C(); }
   if (RQ(arg0) == RQ(arg1)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_fan_r_i_cb(u8_t arg0, u8_t arg1)
+static void op_fan_r_i_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (!(RQ(arg0) & arg1)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_fan_r_q_cb(u8_t arg0, u8_t arg1)
+static void op_fan_r_q_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   if (!(RQ(arg0) & RQ(arg1))) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_rlc_cb(u8_t arg0, u8_t arg1)
+static void op_rlc_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1439,7 +1663,7 @@ static void op_rlc_cb(u8_t arg0, u8_t arg1)
   /* No need to set Z (issue in DS) */
 }
 
-static void op_rrc_cb(u8_t arg0, u8_t arg1)
+static void op_rrc_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1449,7 +1673,7 @@ static void op_rrc_cb(u8_t arg0, u8_t arg1)
   /* No need to set Z (issue in DS) */
 }
 
-static void op_inc_mn_cb(u8_t arg0, u8_t arg1)
+static void op_inc_mn_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1459,7 +1683,7 @@ static void op_inc_mn_cb(u8_t arg0, u8_t arg1)
   if (!M(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_dec_mn_cb(u8_t arg0, u8_t arg1)
+static void op_dec_mn_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   u8_t tmp;
 
@@ -1469,87 +1693,82 @@ static void op_dec_mn_cb(u8_t arg0, u8_t arg1)
   if (!M(arg0)) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_acpx_cb(u8_t arg0, u8_t arg1)
+/* ACPX/ACPY/SCPX/SCPY: in RAM, where x/y point nearly always, Z is taken from
+ * the value written instead of reading it back
+ */
+static ALWAYS_INLINE void acp_m(cpu_t *cpu, u12_t n, u8_t r)
 {
   u8_t tmp;
+  u4_t v;
 
-  tmp = M(x) + RQ(arg0) + C;
+  tmp = M(n) + RQ(r) + C;
   if (D) {
     if (tmp >= 10) {
-      SET_M(x, (tmp - 10) & 0xF);
+      v = (tmp - 10) & 0xF;
       SET_C();
     } else {
-      SET_M(x, tmp);
+      v = tmp;
       CLEAR_C();
     }
   } else {
-    SET_M(x, tmp & 0xF);
+    v = tmp & 0xF;
     if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
   }
-  if (!M(x)) { SET_Z(); } else { CLEAR_Z(); }
-  x = ((x + 1) & 0xFF) | (XP << 8);
+  if (n < MEM_RAM_SIZE) {
+    set_ram(cpu, n, v);
+  } else {
+    set_memory_hw(cpu, n, v);
+    v = get_memory_hw(cpu, n);
+  }
+  if (!v) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_acpy_cb(u8_t arg0, u8_t arg1)
+static ALWAYS_INLINE void scp_m(cpu_t *cpu, u12_t n, u8_t r)
 {
   u8_t tmp;
+  u4_t v;
 
-  tmp = M(y) + RQ(arg0) + C;
-  if (D) {
-    if (tmp >= 10) {
-      SET_M(y, (tmp - 10) & 0xF);
-      SET_C();
-    } else {
-      SET_M(y, tmp);
-      CLEAR_C();
-    }
+  tmp = M(n) - RQ(r) - C;
+  if (D && (tmp >> 4)) {
+    v = (tmp - 6) & 0xF;
   } else {
-    SET_M(y, tmp & 0xF);
-    if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
+    v = tmp & 0xF;
   }
-  if (!M(y)) { SET_Z(); } else { CLEAR_Z(); }
-  y = ((y + 1) & 0xFF) | (YP << 8);
+  if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
+  if (n < MEM_RAM_SIZE) {
+    set_ram(cpu, n, v);
+  } else {
+    set_memory_hw(cpu, n, v);
+    v = get_memory_hw(cpu, n);
+  }
+  if (!v) { SET_Z(); } else { CLEAR_Z(); }
 }
 
-static void op_scpx_cb(u8_t arg0, u8_t arg1)
+static void op_acpx_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  u8_t tmp;
+  acp_m(cpu, cpu->x, arg0);
+  cpu->x = ((cpu->x + 1) & 0xFF) | (XP << 8);
+}
 
-  tmp = M(x) - RQ(arg0) - C;
-  if (D) {
-    if (tmp >> 4) {
-      SET_M(x, (tmp - 6) & 0xF);
-    } else {
-      SET_M(x, tmp);
-    }
-  } else {
-    SET_M(x, tmp & 0xF);
-  }
-  if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
-  if (!M(x)) { SET_Z(); } else { CLEAR_Z(); }
-  x = ((x + 1) & 0xFF) | (XP << 8);
+static void op_acpy_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
+{
+  acp_m(cpu, cpu->y, arg0);
+  cpu->y = ((cpu->y + 1) & 0xFF) | (YP << 8);
 }
 
-static void op_scpy_cb(u8_t arg0, u8_t arg1)
+static void op_scpx_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
-  u8_t tmp;
+  scp_m(cpu, cpu->x, arg0);
+  cpu->x = ((cpu->x + 1) & 0xFF) | (XP << 8);
+}
 
-  tmp = M(y) - RQ(arg0) - C;
-  if (D) {
-    if (tmp >> 4) {
-      SET_M(y, (tmp - 6) & 0xF);
-    } else {
-      SET_M(y, tmp);
-    }
-  } else {
-    SET_M(y, tmp & 0xF);
-  }
-  if (tmp >> 4) { SET_C(); } else { CLEAR_C(); }
-  if (!M(y)) { SET_Z(); } else { CLEAR_Z(); }
-  y = ((y + 1) & 0xFF) | (YP << 8);
+static void op_scpy_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
+{
+  scp_m(cpu, cpu->y, arg0);
+  cpu->y = ((cpu->y + 1) & 0xFF) | (YP << 8);
 }
 
-static void op_not_cb(u8_t arg0, u8_t arg1)
+static void op_not_cb(cpu_t *cpu, u8_t arg0, u8_t arg1)
 {
   SET_RQ(arg0, ~RQ(arg0) & 0xF);
   if (!RQ(arg0)) { SET_Z(); } else { CLEAR_Z(); }
@@ -1669,6 +1888,55 @@ static const op_t0 ops0[] PROGMEM = {
   {NULL, 0, 0, 0, NULL},
 };
 
+#ifdef ENABLE_OP_STATS
+/* Mnemonics in ops0[] order, only used to report the statistics */
+static const char *const op_names[] = {
+  "PSET", "JP", "JP_C", "JP_NC", "JP_Z", "JP_NZ", "JPBA", "CALL", "CALZ",
+  "RET", "RETS", "RETD", "NOP5", "NOP7", "HALT", "INC_X", "INC_Y", "LD_X",
+  "LD_Y", "LD_XP_R", "LD_XH_R", "LD_XL_R", "LD_YP_R", "LD_YH_R", "LD_YL_R",
+  "LD_R_XP", "LD_R_XH", "LD_R_XL", "LD_R_YP", "LD_R_YH", "LD_R_YL", "ADC_XH",
+  "ADC_XL", "ADC_YH", "ADC_YL", "CP_XH", "CP_XL", "CP_YH", "CP_YL", "LD_A_MN",
+  "LD_B_MN", "LD_MN_A", "LD_MN_B", "LDPX_MX", "LDPY_MY", "LBPX", "SET", "RST",
+  "SCF", "RCF", "SZF", "RZF", "SDF", "RDF", "EI", "DI", "INC_SP", "DEC_SP",
+  "PUSH_R", "PUSH_XP", "PUSH_XH", "PUSH_XL", "PUSH_YP", "PUSH_YH", "PUSH_YL",
+  "PUSH_F", "POP_R", "POP_XP", "POP_XH", "POP_XL", "POP_YP", "POP_YH",
+  "POP_YL", "POP_F", "LD_SPH_R", "LD_SPL_R", "LD_R_SPH", "LD_R_SPL", "ADD_R_I",
+  "ADC_R_I", "SBC_R_I", "AND_R_I", "OR_R_I", "XOR_R_I", "CP_R_I", "FAN_R_I",
+  "LD_R_I", "ADD_R_Q", "ADC_R_Q", "SUB", "SBC_R_Q", "AND_R_Q", "OR_R_Q",
+  "XOR_R_Q", "LD_R_Q", "LDPX_R", "LDPY_R", "CP_R_Q", "FAN_R_Q", "RLC", "RRC",
+  "INC_MN", "DEC_MN", "ACPX", "ACPY", "SCPX", "SCPY", "NOT"
+};
+
+#define OP_NUM        (sizeof(op_names) / sizeof(op_names[0]))
+
+/* cpu->op_stats: instructions executed per entry of ops0[] since the last cpu_reset_op_stats() */
+typedef char op_num_check[(OP_NUM == CPU_OP_NUM) ? 1 : -1];
+
+u8_t cpu_get_op_num(void)
+{
+  return OP_NUM;
+}
+
+const char *cpu_get_op_name(u8_t op)
+{
+  return op_names[op];
+}
+
+u32_t cpu_get_op_stat_ctx(cpu_t *cpu, u8_t op)
+{
+  return cpu->op_stats[op];
+}
+
+void cpu_reset_op_stats_ctx(cpu_t *cpu)
+{
+  u8_t i;
+
+  for (i = 0; i < OP_NUM; i++) {
+    cpu->op_stats[i] = 0;
+  }
+}
+#endif
+
 /* The E0C6S46 supported instructions */
 static const op_t1 ops1[] PROGMEM = {
   {&op_pset_cb}, // PSET
@@ -1782,6 +2050,168 @@ static const op_t1 ops1[] PROGMEM = {
   {&op_not_cb}, // NOT
   {NULL}
 };
+
+#ifdef ENABLE_THREADED_DISPATCH
+/* ops0[]/ops1[] entries, in the same order, for the handlers of run_threaded() */
+#define OP_LIST(X) \
+  X(PSET, pset) \
+  X(JP, jp) \
+  X(JP_C, jp_c) \
+  X(JP_NC, jp_nc) \
+  X(JP_Z, jp_z) \
+  X(JP_NZ, jp_nz) \
+  X(JPBA, jpba) \
+  X(CALL, call) \
+  X(CALZ, calz) \
+  X(RET, ret) \
+  X(RETS, rets) \
+  X(RETD, retd) \
+  X(NOP5, nop5) \
+  X(NOP7, nop7) \
+  X(HALT, halt) \
+  X(INC_X, inc_x) \
+  X(INC_Y, inc_y) \
+  X(LD_X, ld_x) \
+  X(LD_Y, ld_y) \
+  X(LD_XP_R, ld_xp_r) \
+  X(LD_XH_R, ld_xh_r) \
+  X(LD_XL_R, ld_xl_r) \
+  X(LD_YP_R, ld_yp_r) \
+  X(LD_YH_R, ld_yh_r) \
+  X(LD_YL_R, ld_yl_r) \
+  X(LD_R_XP, ld_r_xp) \
+  X(LD_R_XH, ld_r_xh) \
+  X(LD_R_XL, ld_r_xl) \
+  X(LD_R_YP, ld_r_yp) \
+  X(LD_R_YH, ld_r_yh) \
+  X(LD_R_YL, ld_r_yl) \
+  X(ADC_XH, adc_xh) \
+  X(ADC_XL, adc_xl) \
+  X(ADC_YH, adc_yh) \
+  X(ADC_YL, adc_yl) \
+  X(CP_XH, cp_xh) \
+  X(CP_XL, cp_xl) \
+  X(CP_YH, cp_yh) \
+  X(CP_YL, cp_yl) \
+  X(LD_A_MN, ld_a_mn) \
+  X(LD_B_MN, ld_b_mn) \
+  X(LD_MN_A, ld_mn_a) \
+  X(LD_MN_B, ld_mn_b) \
+  X(LDPX_MX, ldpx_mx) \
+  X(LDPY_MY, ldpy_my) \
+  X(LBPX, lbpx) \
+  X(SET, set) \
+  X(RST, rst) \
+  X(SCF, scf) \
+  X(RCF, rcf) \
+  X(SZF, szf) \
+  X(RZF, rzf) \
+  X(SDF, sdf) \
+  X(RDF, rdf) \
+  X(EI, ei) \
+  X(DI, di) \
+  X(INC_SP, inc_sp) \
+  X(DEC_SP, dec_sp) \
+  X(PUSH_R, push_r) \
+  X(PUSH_XP, push_xp) \
+  X(PUSH_XH, push_xh) \
+  X(PUSH_XL, push_xl) \
+  X(PUSH_YP, push_yp) \
+  X(PUSH_YH, push_yh) \
+  X(PUSH_YL, push_yl) \
+  X(PUSH_F, push_f) \
+  X(POP_R, pop_r) \
+  X(POP_XP, pop_xp) \
+  X(POP_XH, pop_xh) \
+  X(POP_XL, pop_xl) \
+  X(POP_YP, pop_yp) \
+  X(POP_YH, pop_yh) \
+  X(POP_YL, pop_yl) \
+  X(POP_F, pop_f) \
+  X(LD_SPH_R, ld_sph_r) \
+  X(LD_SPL_R, ld_spl_r) \
+  X(LD_R_SPH, ld_r_sph) \
+  X(LD_R_SPL, ld_r_spl) \
+  X(ADD_R_I, add_r_i) \
+  X(ADC_R_I, adc_r_i) \
+  X(SBC_R_I, sbc_r_i) \
+  X(AND_R_I, and_r_i) \
+  X(OR_R_I, or_r_i) \
+  X(XOR_R_I, xor_r_i) \
+  X(CP_R_I, cp_r_i) \
+  X(FAN_R_I, fan_r_i) \
+  X(LD_R_I, ld_r_i) \
+  X(ADD_R_Q, add_r_q) \
+  X(ADC_R_Q, adc_r_q) \
+  X(SUB, sub) \
+  X(SBC_R_Q, sbc_r_q) \
+  X(AND_R_Q, and_r_q) \
+  X(OR_R_Q, or_r_q) \
+  X(XOR_R_Q, xor_r_q) \
+  X(LD_R_Q, ld_r_q) \
+  X(LDPX_R, ldpx_r) \
+  X(LDPY_R, ldpy_r) \
+  X(CP_R_Q, cp_r_q) \
+  X(FAN_R_Q, fan_r_q) \
+  X(RLC, rlc) \
+  X(RRC, rrc) \
+  X(INC_MN, inc_mn) \
+  X(DEC_MN, dec_mn) \
+  X(ACPX, acpx) \
+  X(ACPY, acpy) \
+  X(SCPX, scpx) \
+  X(SCPY, scpy) \
+  X(NOT, not)
+
+/* Superinstructions: the most frequent pairs of consecutive ROM instructions
+ * in the bench (plus PSET before a far JP/CALL). rom_cache_init() gives the
+ * first instruction of each pair its own dispatch index, so run_threaded()
+ * goes straight from the first handler to the second one.
+ */
+#define FUSED_LIST(X) \
+  X(LBPX, lbpx, LBPX) \
+  X(LD_R_I, ld_r_i, LD_XP_R) \
+  X(LD_X, ld_x, ADD_R_I) \
+  X(INC_X, inc_x, LDPY_R) \
+  X(LDPY_R, ldpy_r, INC_X) \
+  X(LD_XP_R, ld_xp_r, LD_X) \
+  X(LD_X, ld_x, LD_R_Q) \
+  X(ADD_R_I, add_r_i, INC_X) \
+  X(INC_X, inc_x, ADC_R_I) \
+  X(LD_XP_R, ld_xp_r, RET) \
+  X(LD_X, ld_x, CP_R_I) \
+  X(LD_X, ld_x, FAN_R_I) \
+  X(ADD_R_I, add_r_i, JP_NZ) \
+  X(CP_R_I, cp_r_i, JP_Z) \
+  X(CP_R_Q, cp_r_q, JP_Z) \
+  X(FAN_R_I, fan_r_i, JP_NZ) \
+  X(PSET, pset, JP) \
+  X(PSET, pset, CALL)
+
+enum {
+#define X(name, cb) OP_ID_##name,
+  OP_LIST(X)
+#undef X
+  OP_BASE_NUM,
+  OP_FUSED_BEFORE = OP_BASE_NUM - 1,
+#define X(first, cb, second) OP_ID_##first##_##second,
+  FUSED_LIST(X)
+#undef X
+  OP_DISPATCH_NUM,
+};
+
+#define FUSED_NUM         (OP_DISPATCH_NUM - OP_BASE_NUM)
+
+/* Both lists must follow ops1[], and leave room for OP_UNKNOWN */
+typedef char op_list_check[(OP_BASE_NUM == sizeof(ops1) / sizeof(ops1[0]) - 1 &&
+  OP_DISPATCH_NUM <= OP_UNKNOWN) ? 1 : -1];
+
+static const u8_t fused_pairs[FUSED_NUM][2] = {
+#define X(first, cb, second) {OP_ID_##first, OP_ID_##second},
+  FUSED_LIST(X)
+#undef X
+};
+#endif
   
 u12_t getShiftArg0(u12_t code, u12_t mask) {
   if (mask==MASK_6B || mask==0xFCF) return 4;
@@ -1795,70 +2225,239 @@ u12_t getMaskArg0(u12_t shiftArg, u12_t mask) {
   return 0;
 }
 
-static timestamp_t wait_for_cycles(timestamp_t since, u8_t cycles) {
-  timestamp_t deadline;
+static u8_t lookup_op(u12_t op, u8_t first)
+{
+  u8_t i;
+
+  for (i = first; pgm_read_byte_near(&ops0[i].cycles) != 0; i++) {
+    if ((op & pgm_read_word_near(&ops0[i].mask)) == pgm_read_word_near(&ops0[i].code)) {
+      return i;
+    }
+  }
+
+  return OP_UNKNOWN;
+}
+
+static void decode_args(u12_t op, u8_t i, decoded_op_t *d)
+{
+  u12_t mask = pgm_read_word_near(&ops0[i].mask);
+  u12_t shiftArg0 = getShiftArg0(pgm_read_word_near(&ops0[i].code), mask);
+  u12_t maskArg0 = getMaskArg0(shiftArg0, mask);
+
+  d->op = i;
+  d->cycles = pgm_read_byte_near(&ops0[i].cycles);
+
+  if (maskArg0 != 0) {
+    /* Two arguments */
+    d->arg0 = (op & maskArg0) >> shiftArg0;
+    d->arg1 = op & ~(mask | maskArg0);
+  } else {
+    /* One arguments */
+    d->arg0 = (op & ~mask) >> shiftArg0;
+    d->arg1 = 0;
+  }
+}
+
+static void decode_init(void)
+{
+#ifdef DECODE_TABLE_TWO_LEVEL
+  u12_t row;
+  u8_t l, i, first;
+
+  for (row = 0; row < 256; row++) {
+    first = lookup_op(row << 4, 0);
+    decode_table[row] = first;
+
+    for (l = 1; l < 16; l++) {
+      i = lookup_op((row << 4) | l, 0);
+      if (i != decode_table[row]) {
+        /* Mixed group, the scan must start at the lowest matching index */
+        if (i < first) {
+          first = i;
+        }
+        decode_table[row] = DECODE_SCAN_FLAG;
+      }
+    }
 
-  tick_counter += cycles;
+    if (decode_table[row] == DECODE_SCAN_FLAG) {
+      decode_table[row] |= first;
+    }
+  }
+#else
+  u12_t op;
+  u8_t i;
+
+  for (op = 0; op < 4096; op++) {
+    i = lookup_op(op, 0);
+    if (i == OP_UNKNOWN) {
+      decode_table[op].op = OP_UNKNOWN;
+      decode_table[op].cycles = 0;
+    } else {
+      decode_args(op, i, &decode_table[op]);
+    }
+  }
+#endif
+}
+
+static u12_t getProgramOpCode(u12_t addr);
+
+static void rom_cache_init(void)
+{
+#ifdef ENABLE_ROM_CACHE
+  u13_t addr;
+
+  for (addr = 0; addr < ROM_OP_NUM; addr++) {
+    rom_cache[addr] = decode_table[getProgramOpCode(addr)];
+  }
+
+#ifdef ENABLE_THREADED_DISPATCH
+  /* rom_cache[addr + 1] is still undecorated when addr is looked at */
+  for (addr = 0; addr < ROM_OP_NUM - 1; addr++) {
+    u8_t f;
+
+    for (f = 0; f < FUSED_NUM; f++) {
+      if (rom_cache[addr].op == fused_pairs[f][0] && rom_cache[addr + 1].op == fused_pairs[f][1]) {
+        rom_cache[addr].op = OP_BASE_NUM + f;
+        break;
+      }
+    }
+  }
+#endif
+#endif
+}
+
+static void decode_op(u12_t op, decoded_op_t *d)
+{
+#ifdef DECODE_TABLE_TWO_LEVEL
+  u8_t i = decode_table[op >> 4];
+
+  if (i != OP_UNKNOWN && (i & DECODE_SCAN_FLAG)) {
+    i = lookup_op(op, i & ~DECODE_SCAN_FLAG);
+  }
+
+  if (i == OP_UNKNOWN) {
+    d->op = OP_UNKNOWN;
+    d->cycles = 0;
+    return;
+  }
+
+  decode_args(op, i, d);
+#else
+  *d = decode_table[op];
+#endif
+}
+
+static void fetch_op(u13_t addr, decoded_op_t *d)
+{
+#ifdef ENABLE_ROM_CACHE
+  if (addr < ROM_OP_NUM) {
+    *d = rom_cache[addr];
+#ifdef ENABLE_THREADED_DISPATCH
+    if (d->op >= OP_BASE_NUM && d->op != OP_UNKNOWN) {
+      d->op = fused_pairs[d->op - OP_BASE_NUM][0];
+    }
+#endif
+    return;
+  }
+#endif
+
+  decode_op(getProgramOpCode(addr), d);
+}
 
-  if (CPU_SPEED_RATIO == 0) {
+void cpu_get_decode_info(cpu_decode_info_t *info)
+{
+  info->decode_table_size = sizeof(decode_table);
+#ifdef ENABLE_ROM_CACHE
+  info->rom_cache_size = sizeof(rom_cache);
+#else
+  info->rom_cache_size = 0;
+#endif
+  info->init_time = decode_init_time;
+}
+
+static void count_cycles(cpu_t *cpu, u8_t cycles)
+{
+  /* The actual wait happens once per instruction or burst in pace_execution() */
+  cpu->tick_counter += cycles;
+}
+
+static void pace_execution(cpu_t *cpu, u32_t ticks)
+{
+  timestamp_t deadline;
+  u32_t ticks_per_s;
+
+  if (cpu->speed_ratio == 0) {
     /* Emulation will be as fast as possible */
-    return g_hal->get_timestamp();
+    return;
   }
 
-  deadline = since + (cycles * ts_freq)/(TICK_FREQUENCY * CPU_SPEED_RATIO);
-  g_hal->sleep_until(deadline);
+  /* Move the reference by whole seconds, so that no rounding error accumulates */
+  ticks_per_s = (u32_t) TICK_FREQUENCY * cpu->speed_ratio;
+  cpu->pending_ticks += ticks;
+  while (cpu->pending_ticks >= ticks_per_s) {
+    cpu->pending_ticks -= ticks_per_s;
+    cpu->ref_ts += cpu->ts_freq;
+  }
+
+  deadline = cpu->ref_ts + (timestamp_t) (((uint64_t) cpu->pending_ticks * cpu->ts_freq) / ticks_per_s);
+
+  if ((int32_t) (cpu->hal->get_timestamp() - deadline) > (int32_t) cpu->ts_freq) {
+    /* More than one second late, drop the backlog instead of catching up */
+    cpu_sync_ref_timestamp_ctx(cpu);
+    return;
+  }
 
-  return deadline;
+  cpu->hal->sleep_until(deadline);
 }
 
-static void process_interrupts(void)
+static void process_interrupts(cpu_t *cpu)
 {
   u8_t i;
 
   /* Process interrupts in priority order */
   for (i = 0; i < INT_SLOT_NUM; i++) {
-    if (interrupts[i].triggered) {
+    if (cpu->interrupts[i].triggered) {
       //printf("IT %u !\n", i);
-      SET_M(sp - 1, PCP);
-      SET_M(sp - 2, PCSH);
-      SET_M(sp - 3, PCSL);
-      sp = (sp - 3) & 0xFF;
+      SET_M(cpu->sp - 1, PCP);
+      SET_M(cpu->sp - 2, PCSH);
+      SET_M(cpu->sp - 3, PCSL);
+      cpu->sp = (cpu->sp - 3) & 0xFF;
       CLEAR_I();
-      np = TO_NP(NBP, 1);
-      pc = TO_PC(PCB, 1, interrupts[i].vector);
-      call_depth++;
+      cpu->np = TO_NP(NBP, 1);
+      cpu->pc = TO_PC(PCB, 1, cpu->interrupts[i].vector);
+      cpu->call_depth++;
 
-      ref_ts = wait_for_cycles(ref_ts, 12);
-      interrupts[i].triggered = 0;
+      count_cycles(cpu, 12);
+      cpu->interrupts[i].triggered = 0;
     }
   }
 }
 
-static void print_state(u8_t op_num, u12_t op, u13_t addr)
+static void print_state(u8_t op_num, u13_t addr)
 {
 }
 
 //static char logMsg[40];
 
-void cpu_reset(void)
+void cpu_reset_ctx(cpu_t *cpu)
 {
   u13_t i;
 
   /* Registers and variables init */
-  pc = TO_PC(0, 1, 0x00); // PC starts at bank 0, page 1, step 0
-  np = TO_NP(0, 1); // NP starts at page 1
-  a = 0; // undef
-  b = 0; // undef
-  x = 0; // undef
-  y = 0; // undef
-  sp = 0; // undef
-  flags = 0;
+  cpu->pc = TO_PC(0, 1, 0x00); // PC starts at bank 0, page 1, step 0
+  cpu->np = TO_NP(0, 1); // NP starts at page 1
+  cpu->a = 0; // undef
+  cpu->b = 0; // undef
+  cpu->x = 0; // undef
+  cpu->y = 0; // undef
+  cpu->sp = 0; // undef
+  cpu->flags = 0;
 
   //sprintf(logMsg, "Start pc 1:0x%04X, %d", pc, pc); g_hal->log(LOG_ERROR, logMsg);
 
   /* Init RAM to zeros */
   for (i = 0; i < MEMORY_SIZE; i++) {
-    memory[i] = 0;
+    set_ram_byte(cpu, i, 0);
   }
   /*for (i = 0; i < MEM_IO_SIZE; i++) {
     io_memory[i] = 0;
@@ -1868,28 +2467,53 @@ void cpu_reset(void)
   //io_memory[REG_LCD_CTRL - MEM_IO_ADDR_OFS] = 0x8; // LCD control
   /* TODO: Input relation register */
 
-  cpu_sync_ref_timestamp();
+  schedule_timers(cpu);
+
+  cpu_sync_ref_timestamp_ctx(cpu);
 }
 
-bool_t cpu_init(u32_t freq)
+bool_t cpu_init_ctx(cpu_t *cpu, u32_t freq)
 {
+  static const u8_t vectors[INT_SLOT_NUM] = {0x0C, 0x0A, 0x08, 0x06, 0x04, 0x02};
+  hal_t *hal = cpu->hal;
+  struct hw *hw = cpu->hw;
+  u8_t i;
+
   //g_program = program;
   //g_breakpoints = breakpoints;
-  ts_freq = freq;
-  cpu_reset();
+  memset(cpu, 0, sizeof(cpu_t));
+  cpu->hal = hal;
+  cpu->hw = hw;
+  cpu->ts_freq = freq;
+  for (i = 0; i < INT_SLOT_NUM; i++) {
+    cpu->interrupts[i].vector = vectors[i];
+  }
+
+  /* Shared by all the CPUs: the first cpu_init() must return before
+   * another one starts in a different thread
+   */
+  if (!decode_ready) {
+    decode_init_time = cpu->hal->get_timestamp();
+    decode_init();
+    rom_cache_init();
+    decode_init_time = cpu->hal->get_timestamp() - decode_init_time;
+    decode_ready = 1;
+  }
+
+  cpu_reset_ctx(cpu);
   return 0;
 }
 
-void cpu_release(void)
+void cpu_release_ctx(cpu_t *cpu)
 {
 }
 
-u12_t getProgramOpCode(u12_t pc) {
-  u12_t i = pc >> 1;  // divided by 2
-  if ((pc & 0x1)==0) {   // if pc is a even number
+static u12_t getProgramOpCode(u12_t addr) {
+  u12_t i = addr >> 1;  // divided by 2
+  if ((addr & 0x1)==0) {   // if addr is a even number
     return (pgm_read_byte_near(g_program_b12+i+i+i) << 4) | ((pgm_read_byte_near(g_program_b12+i+i+i+1) >> 4) & 0xF);
   } 
-  return (pgm_read_byte_near(g_program_b12+i+i+i+1) << 8) | pgm_read_byte_near(g_program_b12+i+i+i+2);
+  return ((pgm_read_byte_near(g_program_b12+i+i+i+1) & 0xF) << 8) | pgm_read_byte_near(g_program_b12+i+i+i+2);
 }
 
 /*
@@ -1900,98 +2524,94 @@ typedef struct {
 } op_t0;
 */
 
-int cpu_step(void)
+/* Handle timers using the internal tick counter */
+static void run_timers(cpu_t *cpu)
 {
-  u12_t op;
-  u8_t i;
-  //breakpoint_t *bp = g_breakpoints;
-  static u8_t previous_cycles = 0;
+  if (cpu->tick_counter - cpu->clk_timer_timestamp >= TIMER_1HZ_PERIOD) {
+    do {
+      cpu->clk_timer_timestamp += TIMER_1HZ_PERIOD;
+    } while (cpu->tick_counter - cpu->clk_timer_timestamp >= TIMER_1HZ_PERIOD);
 
-  op = getProgramOpCode(pc);
+    generate_interrupt(cpu, INT_CLOCK_TIMER_SLOT, 3);
+  }
 
-  //op_t0 *ops = (op_t0 *)pgm_read_ptr_near(ops0);
+  if (cpu->prog_timer_enabled && cpu->tick_counter - cpu->prog_timer_timestamp >= TIMER_256HZ_PERIOD) {
+    do {
+      cpu->prog_timer_timestamp += TIMER_256HZ_PERIOD;
+      cpu->prog_timer_data--;
 
-  /* Lookup the OP code */
-  for (i = 0; pgm_read_byte_near(&ops0[i].cycles) != 0; i++) {
-    if ((op & pgm_read_word_near(&ops0[i].mask)) == pgm_read_word_near(&ops0[i].code)) {
-      break;
-    }
+      if (cpu->prog_timer_data == 0) {
+        cpu->prog_timer_data = cpu->prog_timer_rld;
+        generate_interrupt(cpu, INT_PROG_TIMER_SLOT, 0);
+      }
+    } while (cpu->tick_counter - cpu->prog_timer_timestamp >= TIMER_256HZ_PERIOD);
+  }
+
+  schedule_timers(cpu);
+}
+
+/* After every instruction, the deadlines are less than 2^31 ticks ahead */
+static ALWAYS_INLINE void handle_timers(cpu_t *cpu)
+{
+  if ((int32_t) (cpu->tick_counter - cpu->next_timer_tick) >= 0) {
+    run_timers(cpu);
   }
+}
+
+static int exec_op(cpu_t *cpu)
+{
+  u8_t i;
+  decoded_op_t d;
+  //breakpoint_t *bp = g_breakpoints;
+
+  /* Fetch and lookup the OP code */
+  fetch_op(cpu->pc, &d);
+  i = d.op;
 
  //sprintf(logMsg, "op-code 0x%X (pc = 0x%04X)", op, pc); g_hal->log(LOG_ERROR, logMsg);
 
-  if (pgm_read_byte_near(&ops0[i].cycles) == 0) {
+  if (i == OP_UNKNOWN) {
     //printf(logMsg, "Unknown op-code 0x%X (pc = 0x%04X)\n", op, pc); g_hal->log(LOG_ERROR, logMsg);
     return 1;
   }
 
-  op_t0 ops;
-  ops.code=pgm_read_word_near(&ops0[i].code);
-  ops.mask=pgm_read_word_near(&ops0[i].mask);
-  ops.cycles=pgm_read_byte_near(&ops0[i].cycles);
-
-  next_pc = (pc + 1) & 0x1FFF;
+  cpu->next_pc = (cpu->pc + 1) & 0x1FFF;
+  cpu->op_count++;
+#ifdef ENABLE_OP_STATS
+  cpu->op_stats[i]++;
+#endif
 
   /* Display the operation along with the current state of the processor */
-  print_state(i, op, pc);
+  print_state(i, cpu->pc);
 
   /* Match the speed of the real processor
    * NOTE: For better accuracy, the final wait should happen here, however
    * the downside is that all interrupts will likely be delayed by one OP
    */
-  ref_ts = wait_for_cycles(ref_ts, previous_cycles);
+  count_cycles(cpu, cpu->previous_cycles);
 
   op_t1 ops11;
   ops11.cb1 = pgm_read_ptr_near(&ops1[i].cb1);
 
   /* Process the OP code */
   if (ops11.cb1 != NULL) {
-    u12_t shiftArg0 = getShiftArg0(ops.code,ops.mask);
-    u12_t maskArg0 = getMaskArg0(shiftArg0,ops.mask);
-    if (maskArg0 != 0) {
-      /* Two arguments */
-      //ops[i].cb((op & ops[i].mask_arg0) >> ops[i].shift_arg0, op & ~(ops[i].mask | ops[i].mask_arg0));
-      ops11.cb1((op & maskArg0) >> shiftArg0, op & ~(ops.mask | maskArg0));
-    } else {
-      /* One arguments */
-      //ops[i].cb((op & ~ops[i].mask) >> ops[i].shift_arg0, 0);
-      ops11.cb1((op & ~ops.mask) >> shiftArg0, 0);
-    }
+    ops11.cb1(cpu, d.arg0, d.arg1);
   }
 
   /* Prepare for the next instruction */
-  pc = next_pc;
-  previous_cycles = ops.cycles;
+  cpu->pc = cpu->next_pc;
+  cpu->previous_cycles = d.cycles;
 
   if (i > 0) {
     /* OP code is not PSET, reset NP */
-    np = (pc >> 8) & 0x1F;
+    cpu->np = (cpu->pc >> 8) & 0x1F;
   }
 
-  /* Handle timers using the internal tick counter */
-  if (tick_counter - clk_timer_timestamp >= TIMER_1HZ_PERIOD) {
-    do {
-      clk_timer_timestamp += TIMER_1HZ_PERIOD;
-    } while (tick_counter - clk_timer_timestamp >= TIMER_1HZ_PERIOD);
-
-    generate_interrupt(INT_CLOCK_TIMER_SLOT, 3);
-  }
-
-  if (prog_timer_enabled && tick_counter - prog_timer_timestamp >= TIMER_256HZ_PERIOD) {
-    do {
-      prog_timer_timestamp += TIMER_256HZ_PERIOD;
-      prog_timer_data--;
-
-      if (prog_timer_data == 0) {
-        prog_timer_data = prog_timer_rld;
-        generate_interrupt(INT_PROG_TIMER_SLOT, 0);
-      }
-    } while (tick_counter - prog_timer_timestamp >= TIMER_256HZ_PERIOD);
-  }
+  handle_timers(cpu);
 
   /* Check if there is any pending interrupt */
   if (I && i > 0) { // Do not process interrupts after a PSET operation
-    process_interrupts();
+    process_interrupts(cpu);
   }
 
   /* Check if we could pause the execution */
@@ -2004,4 +2624,277 @@ int cpu_step(void)
   } */
 
   return 0;
-}
\ No newline at end of file
+}
+
+#ifdef ENABLE_THREADED_DISPATCH
+/* With ENABLE_THREADED_DISPATCH, cpu_run_cycles() runs the ROM with one
+ * handler per instruction (computed goto with GCC, a switch otherwise)
+ * instead of calling exec_op() for each of them. A handler calls its op
+ * callback directly, and the cheaper end of instruction of its class is
+ * resolved at compile time. The order of the steps is the one exec_op()
+ * follows, so both are bit-exact (checked with the bench state hash).
+ * Code outside of the ROM still goes through exec_op().
+ */
+#if defined(__GNUC__) && !defined(THREADED_DISPATCH_SWITCH)
+#define THREADED_GOTO
+#endif
+
+#ifdef THREADED_GOTO
+#define HANDLER(name)       L_##name
+#else
+#define HANDLER(name)       case OP_ID_##name: L_##name
+#endif
+
+#ifdef ENABLE_OP_STATS
+#define COUNT_OP(id)        cpu->op_stats[id]++;
+#else
+#define COUNT_OP(id)
+#endif
+
+#define BEGIN_OP(id) \
+  op_pc = cpu->pc; \
+  cpu->next_pc = (cpu->pc + 1) & 0x1FFF; \
+  cpu->op_count++; \
+  COUNT_OP(id) \
+  count_cycles(cpu, cpu->previous_cycles);
+
+/* NP is not reset and interrupts are not processed after a PSET */
+#define FINISH_OP(id) \
+  cpu->pc = cpu->next_pc; \
+  cpu->previous_cycles = d.cycles; \
+  if ((id) != OP_ID_PSET) { \
+    cpu->np = (cpu->pc >> 8) & 0x1F; \
+  } \
+  handle_timers(cpu); \
+  if ((id) != OP_ID_PSET && I) { \
+    process_interrupts(cpu); \
+  }
+
+#define END_OP(id) \
+  if ((id) == OP_ID_PSET) { \
+    goto end_pset; \
+  } \
+  goto end_op;
+
+static int run_threaded(cpu_t *cpu, u32_t start, u32_t cycles)
+{
+#ifdef THREADED_GOTO
+  static const void *const dispatch[OP_DISPATCH_NUM] = {
+#define X(name, cb) &&L_##name,
+    OP_LIST(X)
+#undef X
+#define X(first, cb, second) &&L_##first##_##second,
+    FUSED_LIST(X)
+#undef X
+  };
+#endif
+  decoded_op_t d;
+  u13_t op_pc;
+
+next:
+  if (cpu->tick_counter - start >= cycles) {
+    return 0;
+  }
+  if (cpu->pc >= ROM_OP_NUM) {
+    goto slow;
+  }
+
+  d = rom_cache[cpu->pc];
+  if (d.op == OP_UNKNOWN) {
+    return 1;
+  }
+
+#ifdef THREADED_GOTO
+  goto *dispatch[d.op];
+  {
+#else
+  switch (d.op) {
+#endif
+
+#define X(name, cb) \
+  HANDLER(name): \
+    BEGIN_OP(OP_ID_##name) \
+    op_##cb##_cb(cpu, d.arg0, d.arg1); \
+    END_OP(OP_ID_##name)
+    OP_LIST(X)
+#undef X
+
+  /* The second instruction starts like after a dispatch, unless the first one
+   * was interrupted or used up the cycles
+   */
+#define X(first, cb, second) \
+  HANDLER(first##_##second): \
+    BEGIN_OP(OP_ID_##first) \
+    op_##cb##_cb(cpu, d.arg0, d.arg1); \
+    FINISH_OP(OP_ID_##first) \
+    if (cpu->pc != ((op_pc + 1) & 0x1FFF) || cpu->tick_counter - start >= cycles) { \
+      goto next; \
+    } \
+    d = rom_cache[cpu->pc]; \
+    goto L_##second;
+    FUSED_LIST(X)
+#undef X
+
+#ifndef THREADED_GOTO
+  default:
+    return 1;
+#endif
+  }
+
+end_pset:
+  FINISH_OP(OP_ID_PSET)
+  goto next;
+
+end_op:
+  FINISH_OP(OP_ID_NOP5)
+  goto next;
+
+slow:
+  if (exec_op(cpu)) {
+    return 1;
+  }
+  goto next;
+}
+#endif
+
+int cpu_step_ctx(cpu_t *cpu)
+{
+  u32_t start = cpu->tick_counter;
+  int res;
+
+  res = exec_op(cpu);
+  pace_execution(cpu, cpu->tick_counter - start);
+
+  return res;
+}
+
+int cpu_run_cycles_ctx(cpu_t *cpu, u32_t cycles)
+{
+  u32_t start = cpu->tick_counter;
+  int res = 0;
+
+#ifdef ENABLE_THREADED_DISPATCH
+  res = run_threaded(cpu, start, cycles);
+#else
+  while (cpu->tick_counter - start < cycles) {
+    if (exec_op(cpu)) {
+      res = 1;
+      break;
+    }
+  }
+#endif
+
+  pace_execution(cpu, cpu->tick_counter - start);
+
+  return res;
+}
+
+/* The same without a context, on the CPU of g_tamalib */
+#define DEFAULT_CPU       (&g_tamalib.cpu)
+
+void cpu_set_speed(u8_t speed)
+{
+  cpu_set_speed_ctx(DEFAULT_CPU, speed);
+}
+
+u32_t cpu_get_op_count(void)
+{
+  return cpu_get_op_count_ctx(DEFAULT_CPU);
+}
+
+u32_t cpu_get_tick_count(void)
+{
+  return cpu_get_tick_count_ctx(DEFAULT_CPU);
+}
+
+#ifdef ENABLE_OP_STATS
+u32_t cpu_get_op_stat(u8_t op)
+{
+  return cpu_get_op_stat_ctx(DEFAULT_CPU, op);
+}
+
+void cpu_reset_op_stats(void)
+{
+  cpu_reset_op_stats_ctx(DEFAULT_CPU);
+}
+#endif
+
+void cpu_get_state(cpu_state_t *cpustate)
+{
+  cpu_get_state_ctx(DEFAULT_CPU, cpustate);
+}
+
+void cpu_set_state(cpu_state_t *cpustate)
+{
+  cpu_set_state_ctx(DEFAULT_CPU, cpustate);
+}
+
+void cpu_pack_state(u8_t *buf)
+{
+  cpu_pack_state_ctx(DEFAULT_CPU, buf);
+}
+
+void cpu_unpack_state(const u8_t *buf)
+{
+  cpu_unpack_state_ctx(DEFAULT_CPU, buf);
+}
+
+void cpu_pack_regs(u8_t *buf)
+{
+  cpu_pack_regs_ctx(DEFAULT_CPU, buf);
+}
+
+void cpu_unpack_regs(const u8_t *buf)
+{
+  cpu_unpack_regs_ctx(DEFAULT_CPU, buf);
+}
+
+u8_t cpu_get_packed_ram(u13_t i)
+{
+  return cpu_get_packed_ram_ctx(DEFAULT_CPU, i);
+}
+
+void cpu_set_packed_ram(u13_t i, u8_t v)
+{
+  cpu_set_packed_ram_ctx(DEFAULT_CPU, i, v);
+}
+
+u32_t cpu_get_depth(void)
+{
+  return cpu_get_depth_ctx(DEFAULT_CPU);
+}
+
+void cpu_set_input_pin(pin_t pin, pin_state_t state)
+{
+  cpu_set_input_pin_ctx(DEFAULT_CPU, pin, state);
+}
+
+void cpu_sync_ref_timestamp(void)
+{
+  cpu_sync_ref_timestamp_ctx(DEFAULT_CPU);
+}
+
+void cpu_reset(void)
+{
+  cpu_reset_ctx(DEFAULT_CPU);
+}
+
+bool_t cpu_init(u32_t freq)
+{
+  return cpu_init_ctx(DEFAULT_CPU, freq);
+}
+
+void cpu_release(void)
+{
+  cpu_release_ctx(DEFAULT_CPU);
+}
+
+int cpu_step(void)
+{
+  return cpu_step_ctx(DEFAULT_CPU);
+}
+
+int cpu_run_cycles(u32_t cycles)
+{
+  return cpu_run_cycles_ctx(DEFAULT_CPU, cycles);
+}
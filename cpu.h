@@ -73,6 +73,12 @@ typedef struct {
   interrupt_t interrupts[6];  
  } cpu_state_t;
 
+typedef struct {
+  u32_t decode_table_size; // in bytes
+  u32_t rom_cache_size; // in bytes, 0 without ENABLE_ROM_CACHE
+  timestamp_t init_time; // time spent building both in cpu_init()
+} cpu_decode_info_t;
+
 /* Pins (TODO: add other pins) */
 typedef enum {
   PIN_K00 = 0x0,
@@ -101,6 +107,67 @@ typedef enum {
 } int_slot_t;
 
 
+#define INPUT_PORT_NUM        2
+
+#define CPU_OP_NUM        108 // Entries of ops0[]
+
+typedef struct {
+  u4_t states;
+} input_port_t;
+
+struct hw;
+
+/* Everything one emulated CPU owns, so that several can run side by side.
+ * The functions without a context use the one in g_tamalib (tamalib.h).
+ * The small fields come first, for the short load offsets of some targets.
+ */
+typedef struct cpu {
+  /* Registers */
+  u13_t pc, next_pc;
+  u12_t x, y;
+  u4_t a, b;
+  u5_t np;
+  u8_t sp;
+
+  /* Flags */
+  u4_t flags;
+
+  u8_t previous_cycles; // of the last OP, counted when the next one starts
+  u8_t speed_ratio; // 0 means as fast as possible
+  bool_t prog_timer_enabled;
+  u8_t prog_timer_data;
+  u8_t prog_timer_rld;
+
+  u32_t call_depth;
+  u32_t clk_timer_timestamp; // in ticks
+  u32_t prog_timer_timestamp; // in ticks
+  u32_t tick_counter;
+  u32_t next_timer_tick; // Nothing for handle_timers() to do before, not saved
+  u32_t op_count;
+  u32_t ts_freq;
+  timestamp_t ref_ts;
+  u32_t pending_ticks; // executed since ref_ts, not yet waited for
+
+  input_port_t inputs[INPUT_PORT_NUM];
+
+  /* Interrupts (in priority order) */
+  interrupt_t interrupts[INT_SLOT_NUM];
+
+  hal_t *hal;
+  struct hw *hw;
+
+#ifdef ENABLE_UNPACKED_RAM
+  u4_t memory[MEM_RAM_SIZE];
+  u4_t packed_memory[MEMORY_SIZE]; // Filled by cpu_get_state()
+#else
+  u4_t memory[MEMORY_SIZE]; // Even address in the high nibble
+#endif
+
+#ifdef ENABLE_OP_STATS
+  u32_t op_stats[CPU_OP_NUM];
+#endif
+} cpu_t;
+
 /*
 typedef struct {
   u13_t *pc;
@@ -130,32 +197,97 @@ typedef struct {
  extern "C" {
 #endif
 
+/* Each function with a state also has a _ctx variant taking the CPU */
+
 void cpu_add_bp(breakpoint_t **list, u13_t addr);
 void cpu_free_bp(breakpoint_t **list);
 
-//void cpu_set_speed(u8_t speed);
+/* 0 runs as fast as possible, N paces the emulation at N times the real speed */
+void cpu_set_speed(u8_t speed);
+void cpu_set_speed_ctx(cpu_t *cpu, u8_t speed);
+
+/* Instructions executed since boot (wraps), for speed reports */
+u32_t cpu_get_op_count(void);
+u32_t cpu_get_op_count_ctx(cpu_t *cpu);
+
+/* Emulated 32768 Hz ticks since boot (wraps) */
+u32_t cpu_get_tick_count(void);
+u32_t cpu_get_tick_count_ctx(cpu_t *cpu);
+
+#ifdef ENABLE_OP_STATS
+/* Instruction mix: op goes from 0 to cpu_get_op_num() - 1 (ops0[] order) */
+u8_t cpu_get_op_num(void);
+const char *cpu_get_op_name(u8_t op);
+u32_t cpu_get_op_stat(u8_t op);
+u32_t cpu_get_op_stat_ctx(cpu_t *cpu, u8_t op);
+void cpu_reset_op_stats(void);
+void cpu_reset_op_stats_ctx(cpu_t *cpu);
+#endif
 
 void cpu_get_state(cpu_state_t *cpustate);
+void cpu_get_state_ctx(cpu_t *cpu, cpu_state_t *cpustate);
 void cpu_set_state(cpu_state_t *cpustate);
+void cpu_set_state_ctx(cpu_t *cpu, cpu_state_t *cpustate);
+
+/* Whole state for saves, packed and little-endian (no pointer, no padding),
+ * including what cpu_state_t leaves out. The version changes with the layout
+ */
+#define CPU_PACKED_STATE_VERSION  1
+#define CPU_PACKED_REGS_SIZE      37
+#define CPU_PACKED_STATE_SIZE     (CPU_PACKED_REGS_SIZE + MEMORY_SIZE)
+
+void cpu_pack_state(u8_t *buf);
+void cpu_pack_state_ctx(cpu_t *cpu, u8_t *buf);
+void cpu_unpack_state(const u8_t *buf);
+void cpu_unpack_state_ctx(cpu_t *cpu, const u8_t *buf);
+
+/* The same state in two parts, for saves streamed without a whole buffer:
+ * the first CPU_PACKED_REGS_SIZE bytes, then the MEMORY_SIZE RAM bytes one
+ * at a time. The registers go in first when unpacking.
+ */
+void cpu_pack_regs(u8_t *buf);
+void cpu_pack_regs_ctx(cpu_t *cpu, u8_t *buf);
+void cpu_unpack_regs(const u8_t *buf);
+void cpu_unpack_regs_ctx(cpu_t *cpu, const u8_t *buf);
+u8_t cpu_get_packed_ram(u13_t i);
+u8_t cpu_get_packed_ram_ctx(cpu_t *cpu, u13_t i);
+void cpu_set_packed_ram(u13_t i, u8_t v);
+void cpu_set_packed_ram_ctx(cpu_t *cpu, u13_t i, u8_t v);
 
 u32_t cpu_get_depth(void);
+u32_t cpu_get_depth_ctx(cpu_t *cpu);
+
+void cpu_get_decode_info(cpu_decode_info_t *info);
 
 void cpu_set_input_pin(pin_t pin, pin_state_t state);
+void cpu_set_input_pin_ctx(cpu_t *cpu, pin_t pin, pin_state_t state);
 
 void cpu_sync_ref_timestamp(void);
+void cpu_sync_ref_timestamp_ctx(cpu_t *cpu);
 
 void cpu_refresh_hw(void);
 
 void cpu_reset(void);
+void cpu_reset_ctx(cpu_t *cpu);
 
 //u8_t cpu_get_max_number(void);
 
 //bool_t cpu_init(breakpoint_t *breakpoints, u32_t freq);
 
 bool_t cpu_init(u32_t freq);
+/* cpu->hal and cpu->hw must be set before, tamalib_init_ctx() does it */
+bool_t cpu_init_ctx(cpu_t *cpu, u32_t freq);
 void cpu_release(void);
+void cpu_release_ctx(cpu_t *cpu);
 
 int cpu_step(void);
+int cpu_step_ctx(cpu_t *cpu);
+
+/* Runs instructions until at least the given number of CPU cycles (32768 Hz
+ * ticks) have elapsed, the HAL clock is only used once at the end of the burst
+ */
+int cpu_run_cycles(u32_t cycles);
+int cpu_run_cycles_ctx(cpu_t *cpu, u32_t cycles);
 
 #ifdef __cplusplus
 }
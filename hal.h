@@ -35,7 +35,7 @@ typedef enum {
 
 /* The Hardware Abstraction Layer
  * NOTE: This structure acts as an abstraction layer between TamaLIB and the OS/SDK.
- * All pointers MUST be implemented, but some implementations can be left empty.
+ * All pointers MUST be implemented (except where noted), but some implementations can be left empty.
  */
 typedef struct {
 	/* Memory allocation functions
@@ -66,6 +66,10 @@ typedef struct {
 	 * (called for each pixel/icon update) can directly drive them, otherwise they
 	 * should just store the data in a buffer and let update_screen() do the actual
 	 * rendering (at 30 fps).
+	 * With LCD_FRAMEBUFFER, the core keeps its own copy of the LCD that
+	 * update_screen() can read with tamalib_get_frame(). set_lcd_matrix() and
+	 * set_lcd_icon() can then be NULL, which lets the core update its copy a
+	 * whole display memory nibble at a time.
 	 */
 	void (*update_screen)(void);
 	void (*set_lcd_matrix)(u8_t x, u8_t y, bool_t val);
@@ -84,6 +88,4 @@ typedef struct {
 	int (*handler)(void);
 } hal_t;
 
-extern hal_t *g_hal;
-
 #endif /* _HAL_H_ */
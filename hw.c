@@ -18,31 +18,93 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
 //#include <avr/pgmspace.h>
+#include <string.h>
 #include "hw.h"
 #include "cpu.h"
 #include "hal.h"
+#include "tamalib.h"
 
 /* SEG -> LCD mapping */
 const static u8_t seg_pos[40] = {0, 1, 2, 3, 4, 5, 6, 7, 32, 8, 9, 10, 11, 12 ,13 ,14, 15, 33, 34, 35, 31, 30, 29, 28, 27, 26, 25, 24, 36, 23, 22, 21, 20, 19, 18, 17, 16, 37, 38, 39};
 
+#ifdef LCD_FRAMEBUFFER
+#if defined(__GNUC__)
+#define FRAME_NUM_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define FRAME_NUM_STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define FRAME_FENCE()			__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#else
+#define FRAME_NUM_LOAD(p)		(*(volatile u32_t *) (p))
+#define FRAME_NUM_STORE(p, v)		(*(volatile u32_t *) (p) = (v))
+#define FRAME_FENCE()
+#endif
 
-bool_t hw_init(void)
+/*
+ * The CPU draws into lcd_columns (one 16-bit word per LCD column, bit n
+ * is row n, so a display memory nibble is a single masked store).
+ * hw_publish_frame() packs it into the older of the two slots and then
+ * bumps lcd_frame_num, whose parity tells which slot is the latest.
+ * A reader copies that slot and retries if the number changed meanwhile,
+ * so the writer never waits.
+ */
+static void set_frame_column(hw_t *hw, u8_t x, uint16_t mask, uint16_t bits)
+{
+	uint16_t col = (hw->lcd_columns[x] & ~mask) | bits;
+
+	if (col != hw->lcd_columns[x]) {
+		hw->lcd_columns[x] = col;
+		hw->lcd_work_changed = 1;
+	}
+}
+
+static void set_frame_icons(hw_t *hw, u8_t mask, u8_t bits)
+{
+	u8_t icons = (hw->lcd_icons & ~mask) | bits;
+
+	if (icons != hw->lcd_icons) {
+		hw->lcd_icons = icons;
+		hw->lcd_work_changed = 1;
+	}
+}
+#endif
+
+
+/* hw->hal and hw->cpu must be set, the rest is cleared */
+bool_t hw_init_ctx(hw_t *hw)
 {
+#ifdef LCD_FRAMEBUFFER
+	memset(hw->lcd_columns, 0, sizeof(hw->lcd_columns));
+	hw->lcd_icons = 0;
+	hw->lcd_work_changed = 0;
+	memset(hw->lcd_slots, 0, sizeof(hw->lcd_slots));
+	hw->lcd_frame_num = 0;
+#endif
+#ifdef ENABLE_INPUT_RECORD
+	hw->input_log = NULL;
+	hw->input_log_size = 0;
+	hw->input_log_num = 0;
+#endif
+
 	/* Buttons are active LOW */
-	cpu_set_input_pin(PIN_K00, PIN_STATE_HIGH);
-	cpu_set_input_pin(PIN_K01, PIN_STATE_HIGH);
-	cpu_set_input_pin(PIN_K02, PIN_STATE_HIGH);
+	cpu_set_input_pin_ctx(hw->cpu, PIN_K00, PIN_STATE_HIGH);
+	cpu_set_input_pin_ctx(hw->cpu, PIN_K01, PIN_STATE_HIGH);
+	cpu_set_input_pin_ctx(hw->cpu, PIN_K02, PIN_STATE_HIGH);
 	return 0;
 }
 
-void hw_release(void)
+void hw_release_ctx(hw_t *hw)
 {
 }
 
-void hw_set_lcd_pin(u8_t seg, u8_t com, u8_t val)
+void hw_set_lcd_pin_ctx(hw_t *hw, u8_t seg, u8_t com, u8_t val)
 {
 	if (seg_pos[seg] < LCD_WIDTH) {
-		g_hal->set_lcd_matrix(seg_pos[seg], com, val);
+#ifdef LCD_FRAMEBUFFER
+		set_frame_column(hw, seg_pos[seg], 1 << com, (uint16_t) (val ? 1 : 0) << com);
+		if (hw->hal->set_lcd_matrix == NULL) {
+			return;
+		}
+#endif
+		hw->hal->set_lcd_matrix(seg_pos[seg], com, val);
 	} else {
 		/*
 		 * IC n -> seg-com|...
@@ -56,37 +118,150 @@ void hw_set_lcd_pin(u8_t seg, u8_t com, u8_t val)
 		 * IC 7 -> 28-15|38-12|39-13
 		 */
 		if (seg == 8 && com < 4) {
-			g_hal->set_lcd_icon(com, val);
+#ifdef LCD_FRAMEBUFFER
+			set_frame_icons(hw, 1 << com, (val ? 1 : 0) << com);
+			if (hw->hal->set_lcd_icon == NULL) {
+				return;
+			}
+#endif
+			hw->hal->set_lcd_icon(com, val);
 		} else if (seg == 28 && com >= 12) {
-			g_hal->set_lcd_icon(com - 8, val);
+#ifdef LCD_FRAMEBUFFER
+			set_frame_icons(hw, 1 << (com - 8), (val ? 1 : 0) << (com - 8));
+			if (hw->hal->set_lcd_icon == NULL) {
+				return;
+			}
+#endif
+			hw->hal->set_lcd_icon(com - 8, val);
 		}
 	}
 }
 
-void hw_set_button(button_t btn, btn_state_t state)
+void hw_set_lcd_nibble_ctx(hw_t *hw, u8_t seg, u8_t com0, u4_t v)
+{
+	u8_t i;
+
+#ifdef LCD_FRAMEBUFFER
+	/* HALs reading the framebuffer leave the per-pixel callbacks out */
+	if (hw->hal->set_lcd_matrix == NULL) {
+		if (seg_pos[seg] < LCD_WIDTH) {
+			set_frame_column(hw, seg_pos[seg], 0xF << com0, (uint16_t) v << com0);
+		} else if (seg == 8 && com0 == 0) {
+			set_frame_icons(hw, 0x0F, v);
+		} else if (seg == 28 && com0 == 12) {
+			set_frame_icons(hw, 0xF0, v << 4);
+		}
+		return;
+	}
+#endif
+
+	for (i = 0; i < 4; i++) {
+		hw_set_lcd_pin_ctx(hw, seg, com0 + i, (v >> i) & 0x1);
+	}
+}
+
+#ifdef LCD_FRAMEBUFFER
+void hw_publish_frame_ctx(hw_t *hw)
+{
+	lcd_frame_t *slot;
+	u32_t next;
+	u8_t x, y;
+
+	if (!hw->lcd_work_changed) {
+		return;
+	}
+
+	next = hw->lcd_frame_num + 1;
+	slot = &hw->lcd_slots[next & 1];
+
+	/* Readers of the previous frame must see its number before the older slot changes */
+	FRAME_FENCE();
+	memset(slot->matrix, 0, sizeof(slot->matrix));
+	for (x = 0; x < LCD_WIDTH; x++) {
+		for (y = 0; y < LCD_HEIGHT; y++) {
+			if (hw->lcd_columns[x] & (1 << y)) {
+				slot->matrix[y][x >> 3] |= 0x80 >> (x & 7);
+			}
+		}
+	}
+	slot->icons = hw->lcd_icons;
+	FRAME_NUM_STORE(&hw->lcd_frame_num, next);
+	hw->lcd_work_changed = 0;
+}
+
+u32_t hw_get_frame_ctx(hw_t *hw, lcd_frame_t *frame)
+{
+	u32_t num = FRAME_NUM_LOAD(&hw->lcd_frame_num);
+	u32_t check;
+
+	for (;;) {
+		memcpy(frame, &hw->lcd_slots[num & 1], sizeof(lcd_frame_t));
+		FRAME_FENCE();
+
+		check = FRAME_NUM_LOAD(&hw->lcd_frame_num);
+		if (check == num) {
+			return num;
+		}
+		num = check;
+	}
+}
+
+u32_t hw_get_frame_num_ctx(hw_t *hw)
+{
+	return FRAME_NUM_LOAD(&hw->lcd_frame_num);
+}
+#endif
+
+void hw_set_button_ctx(hw_t *hw, button_t btn, btn_state_t state)
 {
 	pin_state_t pin_state = (state == BTN_STATE_PRESSED) ? PIN_STATE_LOW : PIN_STATE_HIGH;
 
 	switch (btn) {
 		case BTN_LEFT:
-			cpu_set_input_pin(PIN_K02, pin_state);
+			cpu_set_input_pin_ctx(hw->cpu, PIN_K02, pin_state);
 			break;
 
 		case BTN_MIDDLE:
-			cpu_set_input_pin(PIN_K01, pin_state);
+			cpu_set_input_pin_ctx(hw->cpu, PIN_K01, pin_state);
 			break;
 
 		case BTN_RIGHT:
-			cpu_set_input_pin(PIN_K00, pin_state);
+			cpu_set_input_pin_ctx(hw->cpu, PIN_K00, pin_state);
 			break;
 	}
+
+#ifdef ENABLE_INPUT_RECORD
+	if (hw->input_log != NULL) {
+		if (hw->input_log_num < hw->input_log_size) {
+			input_event_t *ev = &hw->input_log[hw->input_log_num];
+
+			ev->tick = cpu_get_tick_count_ctx(hw->cpu);
+			ev->btn = btn;
+			ev->state = state;
+		}
+		hw->input_log_num++;
+	}
+#endif
+}
+
+#ifdef ENABLE_INPUT_RECORD
+u32_t hw_record_inputs_ctx(hw_t *hw, input_event_t *events, u32_t size)
+{
+	u32_t num = hw->input_log_num;
+
+	hw->input_log = events;
+	hw->input_log_size = size;
+	hw->input_log_num = 0;
+
+	return num;
 }
+#endif
 
 const static uint16_t snd_freq[]= {4096,3279,2731,2341,2048,1638,1365,1170};
-void hw_set_buzzer_freq(u4_t freq)
+void hw_set_buzzer_freq_ctx(hw_t *hw, u4_t freq)
 {
   if (freq>7) return;
-  g_hal->set_frequency(snd_freq[freq]);
+  hw->hal->set_frequency(snd_freq[freq]);
 	/*u32_t snd_freq = 0;
 
 	switch (freq) {
@@ -136,7 +311,69 @@ void hw_set_buzzer_freq(u4_t freq)
 	}*/
 }
 
+void hw_enable_buzzer_ctx(hw_t *hw, bool_t en)
+{
+	hw->hal->play_frequency(en);
+}
+
+/* The same without a context, on the hardware of g_tamalib */
+#define DEFAULT_HW			(&g_tamalib.hw)
+
+bool_t hw_init(void)
+{
+	return hw_init_ctx(DEFAULT_HW);
+}
+
+void hw_release(void)
+{
+	hw_release_ctx(DEFAULT_HW);
+}
+
+void hw_set_lcd_pin(u8_t seg, u8_t com, u8_t val)
+{
+	hw_set_lcd_pin_ctx(DEFAULT_HW, seg, com, val);
+}
+
+void hw_set_lcd_nibble(u8_t seg, u8_t com0, u4_t v)
+{
+	hw_set_lcd_nibble_ctx(DEFAULT_HW, seg, com0, v);
+}
+
+void hw_set_button(button_t btn, btn_state_t state)
+{
+	hw_set_button_ctx(DEFAULT_HW, btn, state);
+}
+
+#ifdef ENABLE_INPUT_RECORD
+u32_t hw_record_inputs(input_event_t *events, u32_t size)
+{
+	return hw_record_inputs_ctx(DEFAULT_HW, events, size);
+}
+#endif
+
+void hw_set_buzzer_freq(u4_t freq)
+{
+	hw_set_buzzer_freq_ctx(DEFAULT_HW, freq);
+}
+
 void hw_enable_buzzer(bool_t en)
 {
-	g_hal->play_frequency(en);
+	hw_enable_buzzer_ctx(DEFAULT_HW, en);
+}
+
+#ifdef LCD_FRAMEBUFFER
+void hw_publish_frame(void)
+{
+	hw_publish_frame_ctx(DEFAULT_HW);
+}
+
+u32_t hw_get_frame(lcd_frame_t *frame)
+{
+	return hw_get_frame_ctx(DEFAULT_HW, frame);
+}
+
+u32_t hw_get_frame_num(void)
+{
+	return hw_get_frame_num_ctx(DEFAULT_HW);
 }
+#endif
@@ -27,6 +27,51 @@
 
 #define ICON_NUM			8
 
+/* Core-owned copy of the LCD, published at each screen update.
+ * Left out on AVR, where the RAM is too short for it.
+ */
+#if !defined(__AVR__) && !defined(NO_LCD_FRAMEBUFFER)
+#define LCD_FRAMEBUFFER
+#endif
+
+#ifdef LCD_FRAMEBUFFER
+typedef struct {
+	u8_t matrix[LCD_HEIGHT][LCD_WIDTH / 8];	/* One bit per pixel, MSB is the leftmost one */
+	u8_t icons;				/* Bit n is icon n */
+} lcd_frame_t;
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+/* Button change at an emulated tick, see hw_record_inputs() */
+typedef struct {
+	u32_t tick;				/* cpu_get_tick_count() when it was applied */
+	u8_t btn;				/* button_t */
+	u8_t state;				/* btn_state_t */
+} input_event_t;
+#endif
+
+struct cpu;
+
+/* Everything the hardware around one CPU owns, see cpu_t */
+typedef struct hw {
+#ifdef LCD_FRAMEBUFFER
+	uint16_t lcd_columns[LCD_WIDTH];
+	u8_t lcd_icons;
+	bool_t lcd_work_changed;
+	lcd_frame_t lcd_slots[2];
+	u32_t lcd_frame_num;
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+	input_event_t *input_log;		/* NULL when not recording */
+	u32_t input_log_size;
+	u32_t input_log_num;			/* Goes on counting once the log is full */
+#endif
+
+	hal_t *hal;
+	struct cpu *cpu;
+} hw_t;
+
 typedef enum {
 	BTN_STATE_RELEASED = 0,
 	BTN_STATE_PRESSED,
@@ -44,13 +89,43 @@ typedef enum {
 #endif
 
 bool_t hw_init(void);
+bool_t hw_init_ctx(hw_t *hw);
 void hw_release(void);
+void hw_release_ctx(hw_t *hw);
 
 void hw_set_lcd_pin(u8_t seg, u8_t com, u8_t val);
+void hw_set_lcd_pin_ctx(hw_t *hw, u8_t seg, u8_t com, u8_t val);
+void hw_set_lcd_nibble(u8_t seg, u8_t com0, u4_t v); /* Pins com0 to com0 + 3 of seg, bit 0 is com0 */
+void hw_set_lcd_nibble_ctx(hw_t *hw, u8_t seg, u8_t com0, u4_t v);
 void hw_set_button(button_t btn, btn_state_t state);
+void hw_set_button_ctx(hw_t *hw, button_t btn, btn_state_t state);
+
+#ifdef ENABLE_INPUT_RECORD
+/* Log each hw_set_button() from now on in events, up to size of them, NULL
+ * stops. Returns the calls seen since the previous start, dropped ones included.
+ */
+u32_t hw_record_inputs(input_event_t *events, u32_t size);
+u32_t hw_record_inputs_ctx(hw_t *hw, input_event_t *events, u32_t size);
+#endif
 
 void hw_set_buzzer_freq(u4_t freq);
+void hw_set_buzzer_freq_ctx(hw_t *hw, u4_t freq);
 void hw_enable_buzzer(bool_t en);
+void hw_enable_buzzer_ctx(hw_t *hw, bool_t en);
+
+#ifdef LCD_FRAMEBUFFER
+/* Publish the LCD if it changed since the last call, from the emulation thread */
+void hw_publish_frame(void);
+void hw_publish_frame_ctx(hw_t *hw);
+
+/* Copy the last published frame, safe from another thread or core.
+ * Returns the frame number, incremented at each publication (0 = nothing yet).
+ */
+u32_t hw_get_frame(lcd_frame_t *frame);
+u32_t hw_get_frame_ctx(hw_t *hw, lcd_frame_t *frame);
+u32_t hw_get_frame_num(void);
+u32_t hw_get_frame_num_ctx(hw_t *hw);
+#endif
 
 #ifdef __cplusplus
 }
@@ -17,11 +17,18 @@
 #include <WebServer.h>
 #include <DNSServer.h>
 #include <HTTPClient.h>
+#ifdef ENABLE_LIVE_VIEW
+#include <WebSocketsServer.h>
+#endif
 #else
 #include <U8g2lib.h>
 #include <Wire.h>
 #endif
 
+#if defined(ESP32) && defined(ENABLE_US_TIMEBASE)
+#include <esp_timer.h>
+#endif
+
 #include "tamalib.h"
 #include "hw.h"
 #include "bitmaps.h"
@@ -30,12 +37,29 @@
 #include "savestate.h"
 #endif
 
+#ifdef ENABLE_INPUT_RECORD
+#include <LittleFS.h>
+#endif
+
+#ifdef ENABLE_REWIND
+#include "rewind_ring.h"
+#endif
+
 /***** M5StickCPlus2 Configuration *****/
 #ifdef M5STICKC_PLUS2
 #define DISPLAY_SCALE 2  // Scale factor for 128x64 -> 240x135
 #define DISPLAY_OFFSET_X 8  // Center horizontally
 #define DISPLAY_OFFSET_Y 8  // Center vertically
 
+// displayTama() renderer: redraw every frame, only push what changed,
+// or compose the frame off-screen and send it with one DMA transfer
+#define TAMA_RENDER_FULL  0
+#define TAMA_RENDER_DIRTY 1
+#define TAMA_RENDER_SPRITE 2
+#ifndef TAMA_RENDER_MODE
+#define TAMA_RENDER_MODE TAMA_RENDER_DIRTY
+#endif
+
 // Button mapping for M5StickC Plus2
 #define BTN_LEFT_PIN   37  // BtnA (side button)
 #define BTN_MIDDLE_PIN 39  // BtnB (front button)  
@@ -60,10 +84,19 @@ static bool waiting_for_portal_second_tap = false;
 static bool tamaportal_active = false;
 static unsigned long last_portal_scan = 0;
 static const unsigned long PORTAL_SCAN_INTERVAL = 30000; // 30 seconds
+static const unsigned long PORTAL_CONNECT_TIMEOUT = 5000;
+static const unsigned long PORTAL_TARGET_PAUSE = 1000; // Don't spam too fast
+static const unsigned long PORTAL_BANNER_DURATION = 1500;
+static const unsigned long SOUND_BANNER_DURATION = 1000;
+static unsigned long banner_time = 0; // Of the banner drawn over the screen, 0 once it is gone
+static unsigned long banner_duration = 0;
 static String received_message = "";
 static unsigned long message_display_time = 0;
 static const unsigned long MESSAGE_DISPLAY_DURATION = 5000; // 5 seconds
 
+// Target of the displayTama() drawing helpers, the LCD or an off-screen canvas
+static lgfx::LovyanGFX* tama_gfx = &M5.Lcd;
+
 // Matrix rain effect variables
 static unsigned long last_matrix_update = 0;
 static int matrix_drops[30]; // 30 columns of rain
@@ -73,6 +106,10 @@ static bool matrix_initialized = false;
 // TamaPortal web server globals (forward declarations)
 static WebServer* tamaPortalServer = nullptr;
 static DNSServer* tamaDnsServer = nullptr;
+#ifdef ENABLE_LIVE_VIEW
+static WebSocketsServer* liveViewSocket = nullptr;
+static bool live_view_pressed[3] = {false, false, false}; // Held from the browser, merged into the physical buttons
+#endif
 
 // 90s Retro Colors
 #define NEON_CYAN     0x07FF
@@ -94,202 +131,1720 @@ U8G2_SSD1306_128X64_NONAME_2_HW_I2C display(U8G2_R0);
 U8G2_SSD1306_128X64_NONAME_2_HW_I2C display(U8G2_R2);
 #endif
 
-#ifdef U8G2_LAYOUT_MIRROR
-U8G2_SSD1306_128X64_NONAME_2_HW_I2C display(U8G2_MIRROR);
-#endif
+#ifdef U8G2_LAYOUT_MIRROR
+U8G2_SSD1306_128X64_NONAME_2_HW_I2C display(U8G2_MIRROR);
+#endif
+
+#define PIN_BTN_L 18
+#define PIN_BTN_M 19
+#define PIN_BTN_R 23
+#define PIN_BUZZER 15
+#define BUZZER_CHANNEL 0
+#define TONE_CHANNEL 15
+#endif
+
+#if defined(ESP32) && !defined(M5STICKC_PLUS2)
+void esp32_noTone(uint8_t pin, uint8_t channel)
+{
+  ledcDetachPin(pin);
+  ledcWrite(channel, 0);
+}
+
+void esp32_tone(uint8_t pin, unsigned int frequency, unsigned long duration, uint8_t channel)
+{
+  if (!ledcRead(channel))
+  {
+    ledcAttachPin(pin, channel);
+  }
+  ledcWriteTone(channel, frequency);
+}
+#endif
+
+void displayTama();
+void enter_deepsleep(int _ms);
+void pixelatedArtExplosion();
+void draw90sBorder();
+void showSoundToggleFeedback(bool sound_on);
+void invalidateDisplay();
+
+// Matrix rain effect
+void drawMatrixRain();
+
+// TamaPortal functions
+void initTamaPortal();
+void handleTamaPortal();
+void createTamaPortalHotspot();
+void handleTamaPortalWeb();
+
+// Banners (portal, sound) stay up without blocking, displayTama() waits for them to expire
+#ifdef M5STICKC_PLUS2
+static void holdBanner(unsigned long duration)
+{
+  banner_time = millis() | 1; // 0 means no banner
+  banner_duration = duration;
+}
+
+static bool bannerShown()
+{
+  if (banner_time == 0) {
+    return false;
+  }
+  if (millis() - banner_time < banner_duration) {
+    return true;
+  }
+  banner_time = 0;
+  invalidateDisplay();
+  return false;
+}
+#else
+#define bannerShown() false
+#endif
+
+/***** Emulation burst length, handler/clock/screen are polled once per burst *****/
+#ifndef TAMA_BURST_CYCLES
+#define TAMA_BURST_CYCLES 328 // ~10 ms of emulated time (32768 Hz ticks)
+#endif
+
+/**** TamaLib Specific Variables ****/
+static uint16_t current_freq = 0;
+static bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH / 8] = {{0}};
+static bool_t icon_buffer[ICON_NUM] = {0};
+static cpu_state_t cpuState;
+static unsigned long lastSaveTimestamp = 0;
+static unsigned long last_interaction = 0; // millis() of the last button press
+/************************************/
+
+/***** Profiling: CPU cycles spent in the hot paths, dumped from the serial console ('p') *****/
+#ifdef ENABLE_PROFILING
+#if !defined(ESP32) && !defined(ESP8266)
+#error "ENABLE_PROFILING requires ESP.getCycleCount() (ESP32 or ESP8266)"
+#endif
+#ifndef ENABLE_SERIAL_DEBUG_INPUT
+#error "ENABLE_PROFILING requires ENABLE_SERIAL_DEBUG_INPUT"
+#endif
+
+typedef enum {
+  PROF_BURST = 0, // Includes displayTama() without ENABLE_DUAL_CORE
+  PROF_DISPLAY,
+  PROF_SAVE,
+  PROF_PORTAL,
+  PROF_SLOT_NUM,
+} prof_slot_t;
+
+typedef struct {
+  uint32_t calls;
+  uint64_t cycles;
+  uint32_t max_cycles;
+} prof_counter_t;
+
+static const char *const prof_names[PROF_SLOT_NUM] = {"burst", "display", "save", "portal"};
+
+// Each slot has a single writer, the console only reads them and keeps its own copy for the deltas
+static prof_counter_t prof_counters[PROF_SLOT_NUM];
+static prof_counter_t prof_last[PROF_SLOT_NUM];
+static unsigned long prof_last_ms = 0;
+static u32_t prof_last_ticks = 0;
+static u32_t prof_last_ops = 0;
+
+static void prof_add(prof_slot_t slot, uint32_t cycles)
+{
+  prof_counter_t *c = &prof_counters[slot];
+
+  c->calls++;
+  c->cycles += cycles;
+  if (cycles > c->max_cycles)
+  {
+    c->max_cycles = cycles;
+  }
+}
+
+#define PROF_BEGIN(slot) uint32_t prof_start_##slot = ESP.getCycleCount()
+#define PROF_END(slot) prof_add(slot, ESP.getCycleCount() - prof_start_##slot)
+
+// Everything since the previous dump, except the maximums and the instruction mix (since boot)
+static void prof_dump(void)
+{
+  unsigned long now = millis();
+  uint32_t elapsed_ms = now - prof_last_ms;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  u32_t ticks = tamalib_get_tick_count();
+  u32_t ops = tamalib_get_op_count();
+
+  Serial.printf("Profile over %u ms:\n", elapsed_ms);
+  for (uint8_t i = 0; i < PROF_SLOT_NUM; i++)
+  {
+    prof_counter_t c = prof_counters[i];
+    uint32_t calls = c.calls - prof_last[i].calls;
+    uint64_t cycles = c.cycles - prof_last[i].cycles;
+
+    Serial.printf("  %-8s %7u calls  avg %6u us  max %6u us  %5.1f%%\n", prof_names[i], calls,
+                  calls ? (uint32_t)(cycles / calls / mhz) : 0, c.max_cycles / mhz,
+                  elapsed_ms ? cycles / (10.0 * mhz * elapsed_ms) : 0.0);
+    prof_last[i] = c;
+  }
+
+  // In wall clock units, SPEED_DIVIDER slows the emulation down on purpose
+  float emulated_ms = (float)(ticks - prof_last_ticks) * SPEED_DIVIDER * 1000 / 32768;
+  Serial.printf("Emulated %.0f ms (drift %+.2f%%), %u instructions/s\n", emulated_ms,
+                elapsed_ms ? (emulated_ms - elapsed_ms) * 100 / elapsed_ms : 0.0,
+                elapsed_ms ? (uint32_t)((uint64_t)(ops - prof_last_ops) * 1000 / elapsed_ms) : 0);
+  prof_last_ms = now;
+  prof_last_ticks = ticks;
+  prof_last_ops = ops;
+
+#ifdef ENABLE_OP_STATS
+  uint64_t total = 0;
+  for (uint8_t i = 0; i < cpu_get_op_num(); i++)
+  {
+    total += cpu_get_op_stat(i);
+  }
+  Serial.println(F("Instruction mix:"));
+  for (uint8_t i = 0; i < cpu_get_op_num(); i++)
+  {
+    u32_t n = cpu_get_op_stat(i);
+    if (n != 0)
+    {
+      Serial.printf("  %-10s %10u  %5.1f%%\n", cpu_get_op_name(i), n, n * 100.0 / total);
+    }
+  }
+#endif
+}
+#else
+#define PROF_BEGIN(slot)
+#define PROF_END(slot)
+#endif
+
+#if defined(ENABLE_DUAL_CORE) || defined(ENABLE_BUTTON_INTERRUPTS) || defined(ENABLE_AUDIO_ENGINE)
+/*
+ * Single producer/single consumer ring, each index is only written by
+ * one side so no lock is needed
+ */
+#define SPSC_QUEUE_SIZE 16 // Power of two
+
+typedef struct {
+  uint32_t buf[SPSC_QUEUE_SIZE];
+  uint32_t head; // Written by the producer
+  uint32_t tail; // Written by the consumer
+} spsc_queue_t;
+
+// In IRAM, button_isr() pushes while a flash write may have the cache disabled
+static bool IRAM_ATTR spsc_push(spsc_queue_t *q, uint32_t v)
+{
+  uint32_t head = q->head;
+
+  if (head - __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE) >= SPSC_QUEUE_SIZE)
+  {
+    return false;
+  }
+  q->buf[head % SPSC_QUEUE_SIZE] = v;
+  __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+static bool spsc_pop(spsc_queue_t *q, uint32_t *v)
+{
+  uint32_t tail = q->tail;
+
+  if (tail == __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+  {
+    return false;
+  }
+  *v = q->buf[tail % SPSC_QUEUE_SIZE];
+  __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+  return true;
+}
+#endif
+
+/***** Dual-core layout: emulation task on one core, display/input/saves/network in loop() on the other *****/
+#ifdef ENABLE_DUAL_CORE
+#if !defined(ESP32) || !defined(ENABLE_REAL_TIME_PACING) || !defined(LCD_FRAMEBUFFER)
+#error "ENABLE_DUAL_CORE needs an ESP32, ENABLE_REAL_TIME_PACING and LCD_FRAMEBUFFER"
+#endif
+
+#ifndef TAMA_EMU_CORE
+#define TAMA_EMU_CORE 0 // Arduino loop() runs on core 1
+#endif
+#ifndef TAMA_EMU_PRIORITY
+#define TAMA_EMU_PRIORITY 2 // Above loop(), below the WiFi stack
+#endif
+#ifndef TAMA_EMU_STACK_SIZE
+#define TAMA_EMU_STACK_SIZE 4096
+#endif
+#ifndef TAMA_UI_POLL_MS
+#define TAMA_UI_POLL_MS 10
+#endif
+
+static spsc_queue_t button_queue; // UI -> emulation, (button << 1) | state
+static spsc_queue_t tone_queue;   // Emulation -> UI, (enabled << 31) | frequency
+static int8_t posted_button_state[3] = {-1, -1, -1};
+
+// Save snapshots are taken by the emulation task between two bursts
+static u8_t snapshot_state[CPU_PACKED_STATE_SIZE];
+static uint32_t snapshot_requested = 0;
+static uint32_t snapshot_taken = 0;
+
+#if defined(ENABLE_SAVE_SLOTS) || defined(ENABLE_REWIND)
+// State read from a save slot or the rewind ring, applied by the emulation task between two bursts
+static u8_t restore_state[CPU_PACKED_STATE_SIZE];
+static uint32_t restore_requested = 0; // RESTORE_*
+#define RESTORE_NONE 0
+#define RESTORE_READY 1
+#define RESTORE_FILLING 2 // restore_state is being written by whoever claimed it
+
+// The console and the rewind task both fill restore_state, only one of them at a time
+static bool claim_restore_state(void)
+{
+  uint32_t expected = RESTORE_NONE;
+
+  return __atomic_compare_exchange_n(&restore_requested, &expected, RESTORE_FILLING, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED);
+}
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+#define INPUT_SESSION_PATH "/tama_input.rec"
+#ifndef INPUT_RECORD_MAX_EVENTS
+#define INPUT_RECORD_MAX_EVENTS 2048 // 16 KB while recording
+#endif
+
+// A recording starts and stops between two bursts, the UI asks and writes the session once done
+typedef enum {
+  RECORD_IDLE = 0,
+  RECORD_START,   // Asked by the UI
+  RECORD_RUNNING,
+  RECORD_STOP,    // Asked by the UI
+  RECORD_DONE,    // Stopped, not written yet
+} record_state_t;
+
+static uint32_t record_state = RECORD_IDLE;
+static input_event_t *record_events = NULL;
+static u8_t record_start_state[CPU_PACKED_STATE_SIZE];
+static u32_t record_start_tick;
+static u32_t record_end_tick;
+static u32_t record_num;
+#endif
+
+#ifdef ENABLE_REWIND
+#ifndef REWIND_EVERY_SECONDS
+#define REWIND_EVERY_SECONDS 10 // Emulated
+#endif
+#define REWIND_EVERY_TICKS ((u32_t)REWIND_EVERY_SECONDS * 32768)
+
+// Packed by the emulation task, compressed into the ring by rewind_task
+static u8_t rewind_stage[CPU_PACKED_STATE_SIZE];
+static u32_t rewind_stage_tick;
+static uint32_t rewind_staged = 0;
+static u32_t rewind_next_tick = 0;
+static TaskHandle_t rewind_task = NULL;
+#endif
+
+#endif
+
+/***** Button interrupts: the GPIO ISR queues timestamped edges, poll_input() debounces them *****/
+#ifdef ENABLE_BUTTON_INTERRUPTS
+#ifndef ESP32
+#error "ENABLE_BUTTON_INTERRUPTS needs an ESP32"
+#endif
+
+#ifndef BUTTON_DEBOUNCE_MS
+#define BUTTON_DEBOUNCE_MS 20
+#endif
+
+// Edges are (time << 3) | (button << 1) | pressed, with the time in ms wrapping at 2^29
+#define EDGE_TIME_MASK 0x1FFFFFFF
+#define EDGE_TIME(t) ((t) & EDGE_TIME_MASK)
+
+#ifdef M5STICKC_PLUS2
+static const uint8_t button_pins[3] = {BTN_LEFT_PIN, BTN_MIDDLE_PIN, BTN_RIGHT_PIN};
+#else
+static const uint8_t button_pins[3] = {PIN_BTN_L, PIN_BTN_M, PIN_BTN_R};
+#endif
+
+static spsc_queue_t edge_queue; // GPIO ISR -> poll_input()
+static volatile bool edge_overflow = false;
+static bool button_pressed[3];
+static uint32_t button_edge_time[3]; // Of the last accepted edge
+static bool button_unsure[3];        // An edge was dropped, read the pin back once the bounce is over
+
+static void IRAM_ATTR button_isr(void *arg)
+{
+  uint32_t btn = (uintptr_t)arg;
+  uint32_t pressed = digitalRead(button_pins[btn]) == BUTTON_VOLTAGE_LEVEL_PRESSED;
+
+  if (!spsc_push(&edge_queue, (EDGE_TIME(millis()) << 3) | (btn << 1) | pressed))
+  {
+    edge_overflow = true;
+  }
+}
+
+static void init_button_interrupts(void)
+{
+  for (uint32_t btn = 0; btn < 3; btn++)
+  {
+    pinMode(button_pins[btn], INPUT);
+    button_pressed[btn] = digitalRead(button_pins[btn]) == BUTTON_VOLTAGE_LEVEL_PRESSED;
+    button_edge_time[btn] = EDGE_TIME(millis());
+    attachInterruptArg(button_pins[btn], button_isr, (void *)(uintptr_t)btn, CHANGE);
+  }
+}
+
+/*
+ * The first edge of a bounce is taken right away, the next ones are dropped
+ * for BUTTON_DEBOUNCE_MS. The pin is then read back in case the bounce
+ * ended on the other level (a tap shorter than the window, or a glitch).
+ */
+static void drain_button_edges(void)
+{
+  uint32_t ev;
+  uint32_t now;
+
+  while (spsc_pop(&edge_queue, &ev))
+  {
+    uint8_t btn = (ev >> 1) & 3;
+    bool pressed = ev & 1;
+    uint32_t time = ev >> 3;
+
+    if (EDGE_TIME(time - button_edge_time[btn]) < BUTTON_DEBOUNCE_MS)
+    {
+      button_unsure[btn] = true;
+    }
+    else if (pressed != button_pressed[btn])
+    {
+      button_pressed[btn] = pressed;
+      button_edge_time[btn] = time;
+    }
+  }
+  if (edge_overflow)
+  {
+    edge_overflow = false;
+    memset(button_unsure, true, sizeof(button_unsure));
+  }
+
+  now = EDGE_TIME(millis());
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    if (button_unsure[btn] && EDGE_TIME(now - button_edge_time[btn]) >= BUTTON_DEBOUNCE_MS)
+    {
+      bool pressed = digitalRead(button_pins[btn]) == BUTTON_VOLTAGE_LEVEL_PRESSED;
+
+      button_unsure[btn] = false;
+      if (pressed != button_pressed[btn])
+      {
+        button_pressed[btn] = pressed;
+        button_edge_time[btn] = now;
+      }
+    }
+  }
+}
+
+static bool button_pressed_for(button_t btn, uint32_t ms)
+{
+  return button_pressed[btn] && EDGE_TIME(millis() - button_edge_time[btn]) >= ms;
+}
+#endif
+
+#ifdef LCD_FRAMEBUFFER
+static u32_t fetched_frame_num = 0;
+
+// Copy the last frame published by the core into matrix_buffer/icon_buffer
+static bool fetch_frame(void)
+{
+  lcd_frame_t frame;
+  u32_t num;
+
+  if (tamalib_get_frame_num() == fetched_frame_num)
+  {
+    return false;
+  }
+
+  num = tamalib_get_frame(&frame);
+  memcpy(matrix_buffer, frame.matrix, sizeof(frame.matrix));
+  for (uint8_t i = 0; i < ICON_NUM; i++)
+  {
+    icon_buffer[i] = (frame.icons >> i) & 1;
+  }
+  fetched_frame_num = num;
+  return true;
+}
+#endif
+
+static void set_button(button_t btn, btn_state_t state)
+{
+#ifdef ENABLE_LIVE_VIEW
+  if (live_view_pressed[btn])
+  {
+    state = BTN_STATE_PRESSED;
+  }
+#endif
+  if (state == BTN_STATE_PRESSED)
+  {
+    last_interaction = millis();
+  }
+#ifdef ENABLE_DUAL_CORE
+  // poll_input() repeats the current state on every call, only queue changes
+  if (posted_button_state[btn] == state)
+  {
+    return;
+  }
+  if (spsc_push(&button_queue, (btn << 1) | state))
+  {
+    posted_button_state[btn] = state;
+  }
+#else
+  hw_set_button(btn, state);
+#endif
+}
+
+#ifdef ENABLE_DUAL_CORE
+static void apply_button_events(void)
+{
+  uint32_t ev;
+
+  while (spsc_pop(&button_queue, &ev))
+  {
+    hw_set_button((button_t)(ev >> 1), (btn_state_t)(ev & 1));
+  }
+}
+
+static void take_requested_snapshot(void)
+{
+  uint32_t req = __atomic_load_n(&snapshot_requested, __ATOMIC_ACQUIRE);
+
+  if (req == snapshot_taken)
+  {
+    return;
+  }
+  cpu_pack_state(snapshot_state);
+  __atomic_store_n(&snapshot_taken, req, __ATOMIC_RELEASE);
+}
+
+// Ask the emulation task for a consistent copy of the state, waits for at most one burst
+static bool take_snapshot(void)
+{
+  uint32_t req = snapshot_requested + 1;
+  unsigned long start = millis();
+
+  __atomic_store_n(&snapshot_requested, req, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&snapshot_taken, __ATOMIC_ACQUIRE) != req)
+  {
+    if (millis() - start > 1000)
+    {
+      Serial.println(F("Emulation task did not answer, state not saved"));
+      return false;
+    }
+    delay(1);
+  }
+  return true;
+}
+
+#if defined(ENABLE_SAVE_SLOTS) || defined(ENABLE_REWIND)
+static void apply_requested_restore(void)
+{
+  if (__atomic_load_n(&restore_requested, __ATOMIC_ACQUIRE) == RESTORE_READY)
+  {
+    cpu_unpack_state(restore_state);
+#ifdef ENABLE_REWIND
+    // The tick went back, the next snapshot is a whole period after the restored one
+    rewind_next_tick = tamalib_get_tick_count() + REWIND_EVERY_TICKS;
+#endif
+    __atomic_store_n(&restore_requested, RESTORE_NONE, __ATOMIC_RELEASE);
+  }
+}
+#endif
+
+#ifdef ENABLE_INPUT_RECORD
+static void apply_record_request(void)
+{
+  switch (__atomic_load_n(&record_state, __ATOMIC_ACQUIRE))
+  {
+  case RECORD_START:
+    cpu_pack_state(record_start_state);
+    record_start_tick = tamalib_get_tick_count();
+    hw_record_inputs(record_events, INPUT_RECORD_MAX_EVENTS);
+    __atomic_store_n(&record_state, RECORD_RUNNING, __ATOMIC_RELEASE);
+    break;
+
+  case RECORD_STOP:
+    record_end_tick = tamalib_get_tick_count();
+    record_num = hw_record_inputs(NULL, 0);
+    __atomic_store_n(&record_state, RECORD_DONE, __ATOMIC_RELEASE);
+    break;
+
+  default:
+    break;
+  }
+}
+#endif
+
+#ifdef ENABLE_REWIND
+// Only packs the state, a snapshot still waiting for rewind_task is not replaced
+static void take_rewind_snapshot(void)
+{
+  u32_t tick = tamalib_get_tick_count();
+
+  if (rewind_task == NULL || (int32_t)(tick - rewind_next_tick) < 0)
+  {
+    return;
+  }
+  rewind_next_tick = tick + REWIND_EVERY_TICKS;
+  if (__atomic_load_n(&rewind_staged, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+  cpu_pack_state(rewind_stage);
+  rewind_stage_tick = tick;
+  __atomic_store_n(&rewind_staged, 1, __ATOMIC_RELEASE);
+  xTaskNotifyGive(rewind_task);
+}
+#endif
+
+static void emulation_task(void *arg)
+{
+  for (;;)
+  {
+    PROF_BEGIN(PROF_BURST);
+    tamalib_mainloop_burst(TAMA_BURST_CYCLES);
+    PROF_END(PROF_BURST);
+    take_requested_snapshot();
+#if defined(ENABLE_SAVE_SLOTS) || defined(ENABLE_REWIND)
+    apply_requested_restore();
+#endif
+#ifdef ENABLE_INPUT_RECORD
+    apply_record_request();
+#endif
+#ifdef ENABLE_REWIND
+    take_rewind_snapshot();
+#endif
+  }
+}
+#endif
+
+/***** Deep sleep catch-up: replay the time spent in deep sleep on wake *****/
+#ifdef ENABLE_DEEPSLEEP_CATCH_UP
+#if !defined(ESP32) || !defined(ENABLE_DEEPSLEEP)
+#error "ENABLE_DEEPSLEEP_CATCH_UP requires ESP32 and ENABLE_DEEPSLEEP"
+#endif
+
+#ifndef CATCH_UP_MAX_SECONDS
+#define CATCH_UP_MAX_SECONDS 3600 // Longer sleeps only replay the first hour
+#endif
+#define CATCH_UP_CHUNK_CYCLES 32768 // 1 s of emulated time between progress checks
+
+// Wall clock when the state was saved for deep sleep, RTC memory survives the sleep
+RTC_DATA_ATTR static int64_t sleep_started_us = 0;
+#endif
+
+#if defined(ENABLE_DEEPSLEEP_CATCH_UP) || defined(ENABLE_FAST_RESUME)
+#include <sys/time.h>
+
+static int64_t wall_clock_us(void)
+{
+  // The system time keeps running in deep sleep (RTC timer)
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+#endif
+
+/***** Turbo mode: headless emulation faster than real time, switched from the serial console ('t') *****/
+#ifdef ENABLE_TURBO_MODE
+#ifndef ENABLE_REAL_TIME_PACING
+#error "ENABLE_TURBO_MODE requires ENABLE_REAL_TIME_PACING"
+#endif
+
+#ifndef TURBO_REPORT_MS
+#define TURBO_REPORT_MS 5000 // Instructions per second are printed this often
+#endif
+
+static const u8_t turbo_speeds[] = {1, 10, 0}; // x1 is the normal mode, 0 is as fast as possible
+#define TURBO_LEVEL_NUM (sizeof(turbo_speeds) / sizeof(turbo_speeds[0]))
+
+static volatile uint8_t turbo_requested = 0; // Index in turbo_speeds[], set by the serial console
+static uint8_t turbo_level = 0;              // Applied on the emulation side, see apply_turbo_level()
+static unsigned long turbo_report_ms = 0;
+static u32_t turbo_report_ops = 0;
+
+static void apply_turbo_level(void);
+#endif
+
+#if defined(ENABLE_TURBO_MODE) || defined(ENABLE_DEEPSLEEP_CATCH_UP)
+#define ENABLE_HEADLESS_HAL
+
+// Unpaced runs must still let the idle task (task watchdog) and WiFi run now and then
+static void headless_yield(void)
+{
+  static unsigned long last_yield = 0;
+  if (millis() - last_yield >= 100)
+  {
+    last_yield = millis();
+    delay(1);
+  }
+}
+#endif
+
+/***** Power scheduler: CPU clock scaled to the load, slower redraws and a dimmed backlight when idle *****/
+#ifdef ENABLE_POWER_SCHEDULER
+#if !defined(M5STICKC_PLUS2) || !defined(ENABLE_DUAL_CORE)
+#error "ENABLE_POWER_SCHEDULER needs the M5StickC Plus2 and ENABLE_DUAL_CORE"
+#endif
+#include <driver/gpio.h>
+
+#ifndef POWER_WINDOW_MS
+#define POWER_WINDOW_MS 1000 // Loads are measured over this long before the clock is changed
+#endif
+#ifndef POWER_MAX_LOAD
+#define POWER_MAX_LOAD 60 // %, of the busiest core, the clock steps down below 3/4 of it
+#endif
+#ifndef POWER_STATIC_AFTER_MS
+#define POWER_STATIC_AFTER_MS 3000 // Without a new LCD frame
+#endif
+#ifndef POWER_STATIC_FRAMERATE
+#define POWER_STATIC_FRAMERATE 2 // Effects redraws of a static screen
+#endif
+#ifndef POWER_DIM_AFTER_MS
+#define POWER_DIM_AFTER_MS 30000 // Without a button press
+#endif
+#ifndef POWER_DIM_BRIGHTNESS
+#define POWER_DIM_BRIGHTNESS 16
+#endif
+#ifndef POWER_OFF_AFTER_MS
+#define POWER_OFF_AFTER_MS 120000 // Backlight off, light sleep allowed
+#endif
+#ifndef POWER_SLEEP_MAX_LOAD
+#define POWER_SLEEP_MAX_LOAD 20 // %, of the emulation task
+#endif
+#ifndef POWER_SLEEP_MS
+#define POWER_SLEEP_MS 100 // Both cores stop, the emulation catches up on wake
+#endif
+
+// Supply current model (mA), ESP32 with the radio off, to be calibrated against a meter
+#ifndef POWER_MA_80MHZ
+#define POWER_MA_80MHZ 25
+#endif
+#ifndef POWER_MA_160MHZ
+#define POWER_MA_160MHZ 35
+#endif
+#ifndef POWER_MA_240MHZ
+#define POWER_MA_240MHZ 50
+#endif
+#ifndef POWER_MA_LIGHT_SLEEP
+#define POWER_MA_LIGHT_SLEEP 1
+#endif
+#ifndef POWER_MA_BACKLIGHT
+#define POWER_MA_BACKLIGHT 20 // At full brightness
+#endif
+#ifndef POWER_MA_WIFI
+#define POWER_MA_WIFI 100 // While TamaPortal is active
+#endif
+
+// The clocks that keep the APB at 80 MHz, the LCD SPI, the I2S and the UART do not notice the changes
+static const uint16_t power_mhz[] = {80, 160, 240};
+static const uint8_t power_ma[] = {POWER_MA_80MHZ, POWER_MA_160MHZ, POWER_MA_240MHZ};
+#define POWER_LEVEL_NUM (sizeof(power_mhz) / sizeof(power_mhz[0]))
+
+static const uint8_t power_wake_pins[3] = {BTN_LEFT_PIN, BTN_MIDDLE_PIN, BTN_RIGHT_PIN};
+
+static uint32_t power_emu_idle_us = 0; // Slept by the emulation task between bursts, its only writer
+static uint8_t power_level = POWER_LEVEL_NUM - 1;
+static uint8_t power_full_brightness;
+static uint8_t power_brightness;
+static unsigned long power_last_frame_ms = 0;
+
+// Current window, see power_end_window()
+static int64_t power_window_start = 0;
+static uint32_t power_window_idle_us = 0; // power_emu_idle_us when it started
+static uint32_t power_window_ui_us = 0;
+static uint32_t power_window_sleep_us = 0;
+static u32_t power_window_ops = 0;
+
+// Last window, for the console
+static uint8_t power_emu_load = 100;
+static uint8_t power_ui_load = 0;
+static uint8_t power_sleep_share = 0;
+static uint32_t power_ips = 0;
+
+static void init_power_scheduler(void)
+{
+  power_full_brightness = M5.Lcd.getBrightness();
+  power_brightness = power_full_brightness;
+  last_interaction = millis();
+  power_window_start = esp_timer_get_time();
+  power_window_ops = tamalib_get_op_count();
+}
+
+// Lowest clock running load (% at the current clock) under limit %
+static uint8_t power_fit_level(uint32_t load, uint32_t limit)
+{
+  uint8_t level = 0;
+
+  while (level < POWER_LEVEL_NUM - 1 && load * power_mhz[power_level] > limit * power_mhz[level])
+  {
+    level++;
+  }
+  return level;
+}
+
+static void power_end_window(void)
+{
+  int64_t now = esp_timer_get_time();
+  uint32_t window_us = now - power_window_start;
+  uint32_t idle_us = __atomic_load_n(&power_emu_idle_us, __ATOMIC_RELAXED);
+  u32_t ops = tamalib_get_op_count();
+
+  if (window_us < POWER_WINDOW_MS * 1000)
+  {
+    return;
+  }
+
+  // Loads are shares of the time awake, the emulation task does not run during light sleeps
+  uint32_t sleep_us = power_window_sleep_us < window_us ? power_window_sleep_us : window_us - 1;
+  uint32_t awake_us = window_us - sleep_us;
+  uint32_t emu_idle_us = idle_us - power_window_idle_us;
+  uint32_t ui_us = power_window_ui_us;
+
+  power_emu_load = emu_idle_us < awake_us ? (uint64_t)(awake_us - emu_idle_us) * 100 / awake_us : 0;
+  power_ui_load = ui_us < awake_us ? (uint64_t)ui_us * 100 / awake_us : 100;
+  power_sleep_share = (uint64_t)sleep_us * 100 / window_us;
+  power_ips = (uint64_t)(ops - power_window_ops) * 1000000 / window_us;
+
+  power_window_start = now;
+  power_window_idle_us = idle_us;
+  power_window_ui_us = 0;
+  power_window_sleep_us = 0;
+  power_window_ops = ops;
+
+  uint32_t load = power_emu_load > power_ui_load ? power_emu_load : power_ui_load;
+  uint8_t level = power_fit_level(load, POWER_MAX_LOAD);
+
+  if (level < power_level)
+  {
+    // Stepping down needs some margin, or the clock would flip at every window
+    level = power_fit_level(load, POWER_MAX_LOAD * 3 / 4);
+    if (level > power_level)
+    {
+      level = power_level;
+    }
+  }
+#ifdef ENABLE_TURBO_MODE
+  if (turbo_requested != 0)
+  {
+    level = POWER_LEVEL_NUM - 1;
+  }
+#endif
+  if (level != power_level)
+  {
+    power_level = level;
+    setCpuFrequencyMhz(power_mhz[level]);
+  }
+}
+
+// Effects redraws slow down once the core stops publishing new frames
+static uint32_t power_redraw_ms(bool new_frame)
+{
+  if (new_frame)
+  {
+    power_last_frame_ms = millis();
+  }
+  if (millis() - power_last_frame_ms >= POWER_STATIC_AFTER_MS)
+  {
+    return 1000 / POWER_STATIC_FRAMERATE;
+  }
+  return 1000 / TAMA_DISPLAY_FRAMERATE;
+}
+
+static void power_update_backlight(void)
+{
+  unsigned long stale = millis() - last_interaction;
+  uint8_t brightness = power_full_brightness;
+
+  if (stale >= POWER_OFF_AFTER_MS)
+  {
+    brightness = 0;
+  }
+  else if (stale >= POWER_DIM_AFTER_MS)
+  {
+    brightness = power_full_brightness < POWER_DIM_BRIGHTNESS ? power_full_brightness : POWER_DIM_BRIGHTNESS;
+  }
+  if (brightness != power_brightness)
+  {
+    power_brightness = brightness;
+    M5.Lcd.setBrightness(brightness);
+  }
+}
+
+/*
+ * A button press or the timer wakes both cores up. The backlight PWM stops
+ * in light sleep, which is why it is only used with the backlight off, and
+ * the serial input received meanwhile is lost.
+ */
+static void power_light_sleep(uint32_t ms)
+{
+  int gpio_level = BUTTON_VOLTAGE_LEVEL_PRESSED == LOW ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    gpio_wakeup_enable((gpio_num_t)power_wake_pins[btn], (gpio_int_type_t)gpio_level);
+  }
+  esp_sleep_enable_gpio_wakeup();
+  esp_sleep_enable_timer_wakeup(ms * 1000);
+
+  int64_t start = esp_timer_get_time();
+  esp_light_sleep_start();
+  power_window_sleep_us += esp_timer_get_time() - start;
+
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    gpio_wakeup_disable((gpio_num_t)power_wake_pins[btn]);
+#ifdef ENABLE_BUTTON_INTERRUPTS
+    // gpio_wakeup_disable() also disabled the CHANGE interrupt
+    gpio_set_intr_type((gpio_num_t)power_wake_pins[btn], GPIO_INTR_ANYEDGE);
+#endif
+  }
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  // The edges of a press that woke us up were missed, read the pins back
+  edge_overflow = true;
+#endif
+}
+
+static bool power_button_down(void)
+{
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    if (digitalRead(power_wake_pins[btn]) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Replaces the poll delay of ui_step(), busy_us is the time it took
+static void power_step(uint32_t busy_us, bool may_sleep)
+{
+  power_window_ui_us += busy_us;
+  power_update_backlight();
+  power_end_window();
+
+  if (may_sleep && power_brightness == 0 && power_emu_load < POWER_SLEEP_MAX_LOAD && !power_button_down())
+  {
+    power_light_sleep(POWER_SLEEP_MS);
+  }
+  else
+  {
+    delay(TAMA_UI_POLL_MS);
+  }
+}
+
+static void power_report(void)
+{
+  uint32_t ma = (power_ma[power_level] * (100 - power_sleep_share) + POWER_MA_LIGHT_SLEEP * power_sleep_share) / 100 +
+                POWER_MA_BACKLIGHT * power_brightness / 255;
+
+  if (tamaportal_active)
+  {
+    ma += POWER_MA_WIFI;
+  }
+  Serial.printf("Power: %u MHz, load emu %u%% ui %u%%, light sleep %u%%, backlight %u/255, ~%u mA, %u instructions/s\n",
+                power_mhz[power_level], power_emu_load, power_ui_load, power_sleep_share, power_brightness, ma,
+                power_ips);
+}
+#endif
+
+static void hal_halt(void)
+{
+  // Serial.println("Halt!");
+}
+
+static void hal_log(log_level_t level, char *buff, ...)
+{
+  Serial.println(buff);
+}
+
+static timestamp_t hal_get_timestamp(void)
+{
+#if defined(ENABLE_US_TIMEBASE) && defined(ESP32)
+  // 64-bit counter, truncating after the division keeps the u32 wrap consistent
+  return (timestamp_t)(esp_timer_get_time() / SPEED_DIVIDER);
+#elif defined(ENABLE_US_TIMEBASE)
+  // Extend micros() to 64 bits for the same reason
+  static uint32_t last_us = 0;
+  static uint64_t wrapped_us = 0;
+  uint32_t now = micros();
+  if (now < last_us)
+  {
+    wrapped_us += 0x100000000ULL;
+  }
+  last_us = now;
+  return (timestamp_t)((wrapped_us + now) / SPEED_DIVIDER);
+#else
+  return millis() * (1000 / SPEED_DIVIDER);
+#endif
+}
+
+static void hal_sleep_until(timestamp_t ts)
+{
+  int32_t remaining = (int32_t)(ts - hal_get_timestamp());
+  if (remaining > 0)
+  {
+#ifdef ENABLE_REAL_TIME_PACING
+    // Timestamps are in us / SPEED_DIVIDER, delay() yields to the other tasks
+    uint32_t remaining_us = (uint32_t)remaining * SPEED_DIVIDER;
+    if (remaining_us >= 1000)
+    {
+      delay(remaining_us / 1000);
+#ifdef ENABLE_POWER_SCHEDULER
+      power_emu_idle_us += remaining_us / 1000 * 1000; // delayMicroseconds() spins
+#endif
+    }
+    else
+    {
+      delayMicroseconds(remaining_us);
+    }
+#elif defined(ENABLE_DEEPSLEEP)
+    enter_deepsleep(remaining);
+#endif
+  }
+}
+
+static void hal_update_screen(void)
+{
+#ifdef ENABLE_DUAL_CORE
+  // Drawn by the UI in loop(), from the frame published by the core
+#else
+#ifdef LCD_FRAMEBUFFER
+  fetch_frame();
+#endif
+  if (!bannerShown())
+  {
+    PROF_BEGIN(PROF_DISPLAY);
+    displayTama();
+    PROF_END(PROF_DISPLAY);
+  }
+#endif
+}
+
+#ifndef LCD_FRAMEBUFFER // Otherwise the screen is read back with tamalib_get_frame()
+static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+{
+  uint8_t mask = 0b10000000 >> (x % 8);
+  if (val)
+  {
+    matrix_buffer[y][x / 8] |= mask;
+  }
+  else
+  {
+    matrix_buffer[y][x / 8] &= ~mask;
+  }
+}
+
+static void hal_set_lcd_icon(u8_t icon, bool_t val)
+{
+  icon_buffer[icon] = val;
+}
+#endif
+
+/***** Audio engine: buzzer events stamped with the emulated tick, rendered for the speaker by a task *****/
+#ifdef ENABLE_AUDIO_ENGINE
+#if !defined(M5STICKC_PLUS2) || !defined(ENABLE_TAMA_SOUND) || !defined(ESP32)
+#error "ENABLE_AUDIO_ENGINE needs the M5StickC Plus2 speaker and ENABLE_TAMA_SOUND"
+#endif
+
+/*
+ * One sample per emulated tick: every event lands on its exact sample, and
+ * the buzzer periods (32768 Hz divided by 8 to 28) are whole numbers of
+ * samples. M5.Speaker resamples the blocks to its output rate and plays
+ * them from DMA. The task trails the emulation by AUDIO_LATENCY ticks, so
+ * that the events of a block have been queued before it is rendered.
+ */
+#define AUDIO_SAMPLE_RATE (32768 / SPEED_DIVIDER)
+#define AUDIO_BLOCK_SAMPLES 256
+#define AUDIO_BLOCK_NUM 3 // Playing, queued in the speaker, being rendered
+#define AUDIO_LATENCY (4 * AUDIO_BLOCK_SAMPLES) // More than a burst
+#define AUDIO_CHANNEL 0
+#define AUDIO_AMPLITUDE 8192
+#define AUDIO_TASK_CORE 1
+#define AUDIO_TASK_PRIORITY 2 // Above loop()
+#define AUDIO_TASK_STACK_SIZE 2048
+
+// Events are (tick << 14) | (on << 13) | frequency, with the tick wrapping at 2^18 (8 s)
+#define AUDIO_EV(tick, on, freq) (((uint32_t)(tick) << 14) | ((uint32_t)(on) << 13) | ((freq) & 0x1FFF))
+#define AUDIO_EV_DUE(ev, tick) ((int32_t)((((ev) >> 14) - (uint32_t)(tick)) << 14) <= 0)
+
+static spsc_queue_t audio_queue; // Emulation -> audio task
+static bool_t audio_on = 0;      // As last queued by the emulation
+static int16_t audio_blocks[AUDIO_BLOCK_NUM][AUDIO_BLOCK_SAMPLES];
+
+// A full queue drops the event
+static void audio_post(void)
+{
+  spsc_push(&audio_queue, AUDIO_EV(tamalib_get_tick_count(), audio_on, current_freq));
+}
+
+static void audio_task(void *arg)
+{
+  u32_t tick = tamalib_get_tick_count() - AUDIO_LATENCY; // Of the next sample
+  uint32_t ev = 0;
+  bool has_ev = false;
+  bool on = false;
+  uint32_t phase = 0;
+  uint32_t step = 0;
+  uint8_t block = 0;
+
+  for (;;)
+  {
+    int32_t lag = tamalib_get_tick_count() - tick;
+
+    if (lag < 0 || lag > 4 * AUDIO_LATENCY)
+    {
+      // After a stall, a state load or the turbo mode, late events are played right away
+      tick = tamalib_get_tick_count() - AUDIO_LATENCY;
+    }
+    else if (lag < AUDIO_LATENCY)
+    {
+      vTaskDelay(1);
+      continue;
+    }
+
+    int16_t *buf = audio_blocks[block];
+    bool audible = false;
+
+    for (uint16_t i = 0; i < AUDIO_BLOCK_SAMPLES; i++, tick++)
+    {
+      while ((has_ev || (has_ev = spsc_pop(&audio_queue, &ev))) && AUDIO_EV_DUE(ev, tick))
+      {
+        on = (ev >> 13) & 1;
+        step = (ev & 0x1FFF) << 17; // 2^32 / 32768 per Hz, one sample per tick
+        has_ev = false;
+      }
+      if (on && sound_enabled)
+      {
+        phase += step;
+        buf[i] = (phase & 0x80000000) ? AUDIO_AMPLITUDE : -AUDIO_AMPLITUDE;
+        audible = true;
+      }
+      else
+      {
+        buf[i] = 0;
+      }
+    }
+
+    // Silent blocks are skipped, the speaker only runs while there is a tone
+    if (audible)
+    {
+      while (M5.Speaker.isPlaying(AUDIO_CHANNEL) > 1)
+      {
+        vTaskDelay(1);
+      }
+      M5.Speaker.playRaw(buf, AUDIO_BLOCK_SAMPLES, AUDIO_SAMPLE_RATE, false, 1, AUDIO_CHANNEL, false);
+      block = (block + 1) % AUDIO_BLOCK_NUM;
+    }
+  }
+}
+
+static void init_audio_engine(void)
+{
+  xTaskCreatePinnedToCore(audio_task, "tama_audio", AUDIO_TASK_STACK_SIZE, NULL, AUDIO_TASK_PRIORITY, NULL,
+                          AUDIO_TASK_CORE);
+}
+#endif
+
+static void hal_set_frequency(u32_t freq)
+{
+  current_freq = freq;
+#ifdef ENABLE_AUDIO_ENGINE
+  if (audio_on)
+  {
+    audio_post();
+  }
+#endif
+}
+
+#ifndef ENABLE_AUDIO_ENGINE
+static void play_frequency(bool_t en, u32_t freq)
+{
+#ifdef ENABLE_TAMA_SOUND
+  // Check if sound is enabled by user toggle
+  if (!sound_enabled) {
+    return; // Silently ignore sound requests when sound is disabled
+  }
+  
+  if (en)
+  {
+#ifdef M5STICKC_PLUS2
+    M5.Speaker.tone(freq, 500);
+#elif defined(ESP32)
+    esp32_tone(PIN_BUZZER, freq, 500, BUZZER_CHANNEL);
+#else
+    tone(PIN_BUZZER, freq);
+#endif
+  }
+  else
+  {
+#ifdef M5STICKC_PLUS2
+    M5.Speaker.stop();
+#elif defined(ESP32)
+    esp32_noTone(PIN_BUZZER, BUZZER_CHANNEL);
+#else
+    noTone(PIN_BUZZER);
+#ifdef ENABLE_TAMA_SOUND_ACTIVE_LOW
+    digitalWrite(PIN_BUZZER, HIGH);
+#endif
+#endif
+  }
+#endif
+}
+
+#endif
+
+static void hal_play_frequency(bool_t en)
+{
+#ifdef ENABLE_AUDIO_ENGINE
+  audio_on = en;
+  audio_post();
+#elif defined(ENABLE_DUAL_CORE)
+  // The speaker is driven from loop(), a full queue drops the tone
+  spsc_push(&tone_queue, ((uint32_t)(en ? 1 : 0) << 31) | current_freq);
+#else
+  play_frequency(en, current_freq);
+#endif
+}
+
+/***** Input record/replay: 'e' records the buttons from the serial console, 'y' replays the session *****/
+#ifdef ENABLE_INPUT_RECORD
+#if !defined(ENABLE_DUAL_CORE) || !defined(ENABLE_SERIAL_DEBUG_INPUT) || !defined(ENABLE_SAVE_LOG)
+#error "ENABLE_INPUT_RECORD needs ENABLE_DUAL_CORE, ENABLE_SERIAL_DEBUG_INPUT and the LittleFS of ENABLE_SAVE_LOG"
+#endif
+
+#define REPLAY_TASK_STACK_SIZE 4096
+#define REPLAY_TASK_PRIORITY 0 // Below loop(), the wall time printed includes what loop() took
+#define REPLAY_TASK_CORE 1     // Away from the emulation task
+
+static volatile bool replay_running = false; // Cleared by the task when it is done
+
+static void session_put_le32(uint8_t *p, uint32_t v)
+{
+  for (uint8_t i = 0; i < 4; i++)
+  {
+    p[i] = v >> (i * 8);
+  }
+}
+
+static uint32_t session_get_le32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// See INPUT_SESSION_MAGIC for the layout
+static void write_input_session(void)
+{
+  uint8_t header[INPUT_SESSION_HEADER_SIZE - CPU_PACKED_STATE_SIZE];
+  uint8_t ev[INPUT_SESSION_EVENT_SIZE];
+  u32_t num = record_num;
+  u32_t end = record_end_tick;
+
+  if (num > INPUT_RECORD_MAX_EVENTS)
+  {
+    // The session stops at the last event kept
+    Serial.printf("Input record: %u events dropped\n", num - INPUT_RECORD_MAX_EVENTS);
+    num = INPUT_RECORD_MAX_EVENTS;
+    end = record_events[num - 1].tick;
+  }
+
+  memcpy(header, INPUT_SESSION_MAGIC, 4);
+  session_put_le32(header + 4, end);
+  session_put_le32(header + 8, num);
+
+  File f = LittleFS.open(INPUT_SESSION_PATH, "w");
+  bool ok = f && f.write(header, sizeof(header)) == sizeof(header) &&
+            f.write(record_start_state, CPU_PACKED_STATE_SIZE) == CPU_PACKED_STATE_SIZE;
+  for (u32_t i = 0; ok && i < num; i++)
+  {
+    session_put_le32(ev, record_events[i].tick);
+    ev[4] = record_events[i].btn;
+    ev[5] = record_events[i].state;
+    ok = f.write(ev, INPUT_SESSION_EVENT_SIZE) == INPUT_SESSION_EVENT_SIZE;
+  }
+  if (f)
+  {
+    f.close();
+  }
+
+  if (ok)
+  {
+    Serial.printf("Input record: %u events over %u s written to " INPUT_SESSION_PATH "\n", num,
+                  (end - record_start_tick) / 32768);
+  }
+  else
+  {
+    Serial.println(F("Input record: cannot write " INPUT_SESSION_PATH));
+  }
+}
+
+// From poll_serial_input(), once the emulation task has stopped the recording
+static void finish_input_record(void)
+{
+  if (__atomic_load_n(&record_state, __ATOMIC_ACQUIRE) != RECORD_DONE)
+  {
+    return;
+  }
+  write_input_session();
+  free(record_events);
+  record_events = NULL;
+  __atomic_store_n(&record_state, RECORD_IDLE, __ATOMIC_RELEASE);
+}
+
+static void toggle_input_record(void)
+{
+  switch (__atomic_load_n(&record_state, __ATOMIC_ACQUIRE))
+  {
+  case RECORD_IDLE:
+    record_events = (input_event_t *)malloc(INPUT_RECORD_MAX_EVENTS * sizeof(input_event_t));
+    if (record_events == NULL)
+    {
+      Serial.println(F("Input record: out of memory"));
+      return;
+    }
+    __atomic_store_n(&record_state, RECORD_START, __ATOMIC_RELEASE);
+    Serial.println(F("Input record: started, 'e' again to stop"));
+    break;
+
+  case RECORD_RUNNING:
+    __atomic_store_n(&record_state, RECORD_STOP, __ATOMIC_RELEASE);
+    break;
+
+  default:
+    break; // The emulation task has not answered the previous request yet
+  }
+}
+
+// The replayed pet has no screen, sound or buttons of its own
+static void replay_update_screen(void)
+{
+}
+
+static void replay_set_frequency(u32_t freq)
+{
+}
+
+static void replay_play_frequency(bool_t en)
+{
+}
+
+static int replay_handler(void)
+{
+  return 0;
+}
+
+static hal_t replay_hal = {
+    .halt = &hal_halt,
+    .log = &hal_log,
+    .sleep_until = &hal_sleep_until,
+    .get_timestamp = &hal_get_timestamp,
+    .update_screen = &replay_update_screen,
+    .set_lcd_matrix = NULL,
+    .set_lcd_icon = NULL,
+    .set_frequency = &replay_set_frequency,
+    .play_frequency = &replay_play_frequency,
+    .handler = &replay_handler,
+};
+
+// Runs the session on a tamalib_t of its own, the live pet goes on meanwhile
+static bool replay_input_session(void)
+{
+  uint8_t header[INPUT_SESSION_HEADER_SIZE];
+  uint8_t ev[INPUT_SESSION_EVENT_SIZE];
+  input_event_t *events = NULL;
+  tamalib_t *t = NULL;
+  bool ok = false;
+
+  File f = LittleFS.open(INPUT_SESSION_PATH, "r");
+  if (!f || f.read(header, sizeof(header)) != sizeof(header) || memcmp(header, INPUT_SESSION_MAGIC, 4) != 0)
+  {
+    Serial.println(F("Replay: no session in " INPUT_SESSION_PATH));
+    if (f)
+    {
+      f.close();
+    }
+    return false;
+  }
+
+  u32_t end = session_get_le32(header + 4);
+  u32_t num = session_get_le32(header + 8);
+  // Bounded by the file before the allocation, num * INPUT_SESSION_EVENT_SIZE could wrap around
+  uint32_t events_size = f.size() - INPUT_SESSION_HEADER_SIZE;
+  if (f.size() < INPUT_SESSION_HEADER_SIZE || num != events_size / INPUT_SESSION_EVENT_SIZE ||
+      events_size % INPUT_SESSION_EVENT_SIZE != 0)
+  {
+    Serial.println(F("Replay: session truncated"));
+    f.close();
+    return false;
+  }
+  events = (input_event_t *)malloc((num + 1) * sizeof(input_event_t));
+  t = (tamalib_t *)malloc(sizeof(tamalib_t));
+  if (events != NULL && t != NULL)
+  {
+    ok = true;
+    for (u32_t i = 0; ok && i < num; i++)
+    {
+      ok = f.read(ev, INPUT_SESSION_EVENT_SIZE) == INPUT_SESSION_EVENT_SIZE;
+      events[i].tick = session_get_le32(ev);
+      events[i].btn = ev[4];
+      events[i].state = ev[5];
+    }
+  }
+  f.close();
+
+  if (ok)
+  {
+    tamalib_init_ctx(t, &replay_hal, 1000000);
+    cpu_unpack_state_ctx(&t->cpu, header + INPUT_SESSION_HEADER_SIZE - CPU_PACKED_STATE_SIZE);
+    tamalib_set_speed_ctx(t, 0);
+
+    u32_t start = tamalib_get_tick_count_ctx(t);
+    u32_t ops = tamalib_get_op_count_ctx(t);
+    unsigned long us = micros();
+    ok = tamalib_replay_ctx(t, events, num, end) == 0;
+    us = micros() - us;
+    ops = tamalib_get_op_count_ctx(t) - ops;
+
+    if (!ok)
+    {
+      Serial.printf("Replay: stopped on an unknown opcode at pc 0x%04X\n", t->cpu.pc);
+    }
+    else
+    {
+      Serial.printf("Replay: %u s, %u events in %lu ms, %u instructions/s\n", (end - start) / 32768, num, us / 1000,
+                    us ? (uint32_t)((uint64_t)ops * 1000000 / us) : 0);
+      Serial.printf("Replay: state hash %016llx\n", (unsigned long long)tamalib_get_state_hash_ctx(t));
+    }
+  }
+  else
+  {
+    Serial.println(F("Replay: session truncated or out of memory"));
+  }
 
-#define PIN_BTN_L 18
-#define PIN_BTN_M 19
-#define PIN_BTN_R 23
-#define PIN_BUZZER 15
-#define BUZZER_CHANNEL 0
-#define TONE_CHANNEL 15
-#endif
+  free(t);
+  free(events);
+  return ok;
+}
 
-#if defined(ESP32) && !defined(M5STICKC_PLUS2)
-void esp32_noTone(uint8_t pin, uint8_t channel)
+static void replay_task(void *arg)
 {
-  ledcDetachPin(pin);
-  ledcWrite(channel, 0);
+  replay_input_session();
+  replay_running = false;
+  vTaskDelete(NULL);
 }
 
-void esp32_tone(uint8_t pin, unsigned int frequency, unsigned long duration, uint8_t channel)
+static void start_input_replay(void)
 {
-  if (!ledcRead(channel))
+  if (replay_running)
   {
-    ledcAttachPin(pin, channel);
+    return;
+  }
+  replay_running = true;
+  if (xTaskCreatePinnedToCore(replay_task, "tama_replay", REPLAY_TASK_STACK_SIZE, NULL, REPLAY_TASK_PRIORITY, NULL,
+                              REPLAY_TASK_CORE) != pdPASS)
+  {
+    replay_running = false;
   }
-  ledcWriteTone(channel, frequency);
 }
 #endif
 
-void displayTama();
-void enter_deepsleep(int _ms);
-void pixelatedArtExplosion();
-void draw90sBorder();
-void showSoundToggleFeedback(bool sound_on);
-
-// Matrix rain effect
-void drawMatrixRain();
+/***** Rewind: snapshots every REWIND_EVERY_SECONDS in a PSRAM ring, 'b' steps back, 'h' prints the history *****/
+#ifdef ENABLE_REWIND
+#if !defined(ENABLE_DUAL_CORE) || !defined(ENABLE_SERIAL_DEBUG_INPUT)
+#error "ENABLE_REWIND needs ENABLE_DUAL_CORE and ENABLE_SERIAL_DEBUG_INPUT"
+#endif
 
-// TamaPortal functions
-void initTamaPortal();
-void handleTamaPortal();
-void scanAndAttackPortals();
-void sendFriendlyMessage(String ssid);
-void createTamaPortalHotspot();
-void handleTamaPortalWeb();
+#ifndef REWIND_RING_SIZE
+#define REWIND_RING_SIZE (1024 * 1024) // ~140 bytes per delta, about 18 hours
+#endif
+#ifndef REWIND_MAX_SNAPSHOTS
+#define REWIND_MAX_SNAPSHOTS 8192 // 22 hours at one every 10 s
+#endif
+#ifndef REWIND_KEYFRAME_EVERY
+#define REWIND_KEYFRAME_EVERY 64 // Longest chain of deltas to apply on a rewind
+#endif
+#define REWIND_TASK_STACK_SIZE 4096
+#define REWIND_TASK_PRIORITY 1
+#define REWIND_TASK_CORE 1 // Away from the emulation task
 
-/**** TamaLib Specific Variables ****/
-static uint16_t current_freq = 0;
-static bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH / 8] = {{0}};
-static bool_t icon_buffer[ICON_NUM] = {0};
-static cpu_state_t cpuState;
-static unsigned long lastSaveTimestamp = 0;
-static long last_interaction = 0;
-/************************************/
+// Both rings of rewind_ring.c live in PSRAM and only rewind_task touches them
+static rewind_ring_t rewind_ring;
+static bool rewind_restored = false; // The newest entry is the state the last rewind went back to
+static uint32_t rewind_back_requested = 0; // Steps asked by the console
 
-static void hal_halt(void)
+// One snapshot back per request, starting with the newest one
+static void rewind_step_back(void)
 {
-  // Serial.println("Halt!");
-}
+  uint32_t back = rewind_restored ? 1 : 0;
 
-static void hal_log(log_level_t level, char *buff, ...)
-{
-  Serial.println(buff);
-}
+  if (rewind_ring.num <= back)
+  {
+    Serial.println(F("Rewind: no older snapshot"));
+    return;
+  }
 
-static timestamp_t hal_get_timestamp(void)
-{
-  return millis() * (1000 / SPEED_DIVIDER);
-}
+  int64_t start = esp_timer_get_time();
+  uint32_t i = rewind_ring.num - 1 - back;
+  rewind_ring_decode(&rewind_ring, i);
+  uint32_t decode_us = esp_timer_get_time() - start;
 
-static void hal_sleep_until(timestamp_t ts)
-{
-  int32_t remaining = (int32_t)(ts - hal_get_timestamp());
-  if (remaining > 0)
+  // A save slot restore may still be pending
+  while (!claim_restore_state())
   {
-#ifdef ENABLE_DEEPSLEEP
-    enter_deepsleep(remaining);
-#endif
+    delay(1);
+  }
+  memcpy(restore_state, rewind_ring.prev, CPU_PACKED_STATE_SIZE);
+  __atomic_store_n(&restore_requested, RESTORE_READY, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&restore_requested, __ATOMIC_ACQUIRE) == RESTORE_READY)
+  {
+    delay(1);
   }
+  // Packed before the restore was applied, it belongs to the dropped timeline
+  __atomic_store_n(&rewind_staged, 0, __ATOMIC_RELEASE);
+  rewind_restored = true;
+
+  Serial.printf("Rewind: back to tick %u, %u snapshots left, rebuilt in %u us\n",
+                rewind_ring_entry(&rewind_ring, i)->tick, rewind_ring.num, decode_us);
 }
 
-static void hal_update_screen(void)
+static void rewind_task_main(void *arg)
 {
-  displayTama();
+  for (;;)
+  {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+    if (__atomic_load_n(&rewind_staged, __ATOMIC_ACQUIRE))
+    {
+      rewind_ring_append(&rewind_ring, rewind_stage, rewind_stage_tick);
+      rewind_restored = false;
+      __atomic_store_n(&rewind_staged, 0, __ATOMIC_RELEASE);
+    }
+    for (uint32_t n = __atomic_exchange_n(&rewind_back_requested, 0, __ATOMIC_ACQ_REL); n != 0; n--)
+    {
+      rewind_step_back();
+    }
+  }
 }
 
-static void hal_set_lcd_matrix(u8_t x, u8_t y, bool_t val)
+static void init_rewind(void)
 {
-  uint8_t mask;
-  if (val)
+  uint8_t *data = (uint8_t *)heap_caps_malloc(REWIND_RING_SIZE, MALLOC_CAP_SPIRAM);
+  rewind_entry_t *entries =
+      (rewind_entry_t *)heap_caps_malloc(REWIND_MAX_SNAPSHOTS * sizeof(rewind_entry_t), MALLOC_CAP_SPIRAM);
+  if (data == NULL || entries == NULL)
   {
-    mask = 0b10000000 >> (x % 8);
-    matrix_buffer[y][x / 8] = matrix_buffer[y][x / 8] | mask;
+    free(data);
+    free(entries);
+    Serial.println(F("Rewind: no PSRAM, snapshots disabled"));
+    return;
   }
-  else
+  rewind_ring_init(&rewind_ring, data, REWIND_RING_SIZE, entries, REWIND_MAX_SNAPSHOTS, REWIND_KEYFRAME_EVERY);
+  rewind_next_tick = tamalib_get_tick_count();
+  xTaskCreatePinnedToCore(rewind_task_main, "tama_rewind", REWIND_TASK_STACK_SIZE, NULL, REWIND_TASK_PRIORITY,
+                          &rewind_task, REWIND_TASK_CORE);
+}
+
+static void request_rewind(void)
+{
+  if (rewind_task != NULL)
   {
-    mask = 0b01111111;
-    for (byte i = 0; i < (x % 8); i++)
-    {
-      mask = (mask >> 1) | 0b10000000;
-    }
-    matrix_buffer[y][x / 8] = matrix_buffer[y][x / 8] & mask;
+    __atomic_fetch_add(&rewind_back_requested, 1, __ATOMIC_ACQ_REL);
+    xTaskNotifyGive(rewind_task);
   }
 }
 
-static void hal_set_lcd_icon(u8_t icon, bool_t val)
+static void print_rewind_history(void)
 {
-  icon_buffer[icon] = val;
+  // Read while rewind_task may update them, good enough for a report
+  uint32_t num = rewind_ring.num;
+  u32_t span = num != 0 ? rewind_ring_entry(&rewind_ring, num - 1)->tick - rewind_ring_entry(&rewind_ring, 0)->tick : 0;
+
+  Serial.printf("Rewind: %u snapshots over %u emulated s, %u of %u KB used\n", num, span / 32768,
+                rewind_ring.bytes / 1024, REWIND_RING_SIZE / 1024);
 }
+#endif
 
-static void hal_set_frequency(u32_t freq)
+static bool_t button4state = 0;
+
+#if defined(ENABLE_SAVE_SLOTS) && defined(ENABLE_SERIAL_DEBUG_INPUT)
+static void list_save_slots(void)
 {
-  current_freq = freq;
+  save_slot_info_t info;
+
+  for (uint8_t i = 0; i < SAVE_SLOT_NUM; i++)
+  {
+    Serial.print(F("Slot "));
+    Serial.print(i);
+    if (getSaveSlotInfo(i, &info))
+    {
+      Serial.print(F(": #"));
+      Serial.print(info.seq);
+      Serial.print(F(", saved at "));
+      Serial.print(info.time);
+      Serial.println(F(" s"));
+    }
+    else
+    {
+      Serial.println(F(": empty"));
+    }
+  }
 }
 
-static void hal_play_frequency(bool_t en)
+// Replaces the running state, the next autosave makes it the saved one
+static void restore_save_slot(uint8_t slot)
 {
-#ifdef ENABLE_TAMA_SOUND
-  // Check if sound is enabled by user toggle
-  if (!sound_enabled) {
-    return; // Silently ignore sound requests when sound is disabled
-  }
-  
-  if (en)
+#ifdef ENABLE_DUAL_CORE
+  if (!claim_restore_state())
   {
-#ifdef M5STICKC_PLUS2
-    M5.Speaker.tone(current_freq, 500);
-#elif defined(ESP32)
-    esp32_tone(PIN_BUZZER, current_freq, 500, BUZZER_CHANNEL);
-#else
-    tone(PIN_BUZZER, current_freq);
-#endif
+    return; // The previous restore is not applied yet
   }
-  else
+  if (!loadStateFromSlot(slot, restore_state))
   {
-#ifdef M5STICKC_PLUS2
-    M5.Speaker.stop();
-#elif defined(ESP32)
-    esp32_noTone(PIN_BUZZER, BUZZER_CHANNEL);
+    __atomic_store_n(&restore_requested, RESTORE_NONE, __ATOMIC_RELEASE);
+    Serial.println(F("No valid state in this slot"));
+    return;
+  }
+  __atomic_store_n(&restore_requested, RESTORE_READY, __ATOMIC_RELEASE);
 #else
-    noTone(PIN_BUZZER);
-#ifdef ENABLE_TAMA_SOUND_ACTIVE_LOW
-    digitalWrite(PIN_BUZZER, HIGH);
-#endif
-#endif
+  // Called from the HAL handler, between two bursts
+  static u8_t state[CPU_PACKED_STATE_SIZE];
+  if (!loadStateFromSlot(slot, state))
+  {
+    Serial.println(F("No valid state in this slot"));
+    return;
   }
+  cpu_unpack_state(state);
 #endif
+  Serial.print(F("Restored slot "));
+  Serial.println(slot);
 }
+#endif
 
-static bool_t button4state = 0;
-
-static int hal_handler(void)
+static void poll_serial_input(void)
 {
 #ifdef ENABLE_SERIAL_DEBUG_INPUT
+#ifdef ENABLE_INPUT_RECORD
+  finish_input_record();
+#endif
   if (Serial.available() > 0)
   {
     int incomingByte = Serial.read();
     Serial.println(incomingByte, DEC);
+#ifdef ENABLE_SAVE_SLOTS
+    static bool slot_key_expected = false;
+    if (slot_key_expected)
+    {
+      // 'r' then the slot number
+      slot_key_expected = false;
+      if (incomingByte >= '0' && incomingByte < '0' + SAVE_SLOT_NUM)
+      {
+        restore_save_slot(incomingByte - '0');
+      }
+      return;
+    }
+#endif
     if (incomingByte == 49)
     {
-      hw_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+      set_button(BTN_LEFT, BTN_STATE_PRESSED);
     }
     else if (incomingByte == 50)
     {
-      hw_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+      set_button(BTN_LEFT, BTN_STATE_RELEASED);
     }
     else if (incomingByte == 51)
     {
-      hw_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+      set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
     }
     else if (incomingByte == 52)
     {
-      hw_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+      set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
     }
     else if (incomingByte == 53)
     {
-      hw_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+      set_button(BTN_RIGHT, BTN_STATE_PRESSED);
     }
     else if (incomingByte == 54)
     {
-      hw_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+      set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+    }
+#ifdef ENABLE_TURBO_MODE
+    else if (incomingByte == 't')
+    {
+      turbo_requested = (turbo_requested + 1) % TURBO_LEVEL_NUM;
+    }
+#endif
+#ifdef ENABLE_PROFILING
+    else if (incomingByte == 'p')
+    {
+      prof_dump();
+    }
+#endif
+#ifdef ENABLE_POWER_SCHEDULER
+    else if (incomingByte == 'w')
+    {
+      power_report();
+    }
+#endif
+#ifdef ENABLE_SAVE_SLOTS
+    else if (incomingByte == 'l')
+    {
+      list_save_slots();
+    }
+    else if (incomingByte == 'r')
+    {
+      slot_key_expected = true;
+    }
+#endif
+#ifdef ENABLE_REWIND
+    else if (incomingByte == 'b')
+    {
+      request_rewind();
+    }
+    else if (incomingByte == 'h')
+    {
+      print_rewind_history();
     }
+#endif
+#ifdef ENABLE_INPUT_RECORD
+    else if (incomingByte == 'e')
+    {
+      toggle_input_record();
+    }
+    else if (incomingByte == 'y')
+    {
+      start_input_replay();
+    }
+#endif
   }
 #endif
+}
+
+static int poll_input(void)
+{
+  poll_serial_input();
+
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  drain_button_edges();
+#endif
 
 #ifdef M5STICKC_PLUS2
-  M5.update();
-  
   static bool btn_a_was_pressed = false;
   static bool btn_b_was_pressed = false;
   static bool btn_pwr_was_pressed = false;
   
   // Enhanced button handling with menu scrolling and special features
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  bool btn_a_pressed = button_pressed[BTN_LEFT];
+  bool btn_b_pressed = button_pressed[BTN_MIDDLE];
+  bool btn_pwr_pressed = button_pressed[BTN_RIGHT];
+#else
+  M5.update();
   bool btn_a_pressed = M5.BtnA.isPressed();
   bool btn_b_pressed = M5.BtnB.isPressed();
   bool btn_pwr_pressed = M5.BtnPWR.isPressed();
+#endif
   
   // AUTO-BYPASS TIME SETUP: Send automatic button sequence to get past time setup
   static bool time_bypass_complete = false;
@@ -307,23 +1862,23 @@ static int hal_handler(void)
     if (elapsed < 1000) {
       // First second: press and release A a few times (set hours)
       if ((elapsed % 200) < 100) {
-        hw_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+        set_button(BTN_LEFT, BTN_STATE_PRESSED);
       } else {
-        hw_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+        set_button(BTN_LEFT, BTN_STATE_RELEASED);
       }
     } else if (elapsed < 2000) {
       // Second second: press and release B a few times (set minutes)  
       if ((elapsed % 200) < 100) {
-        hw_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+        set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
       } else {
-        hw_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+        set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
       }
     } else if (elapsed < 3000) {
       // Third second: press and hold right button (confirm time)
-      hw_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+      set_button(BTN_RIGHT, BTN_STATE_PRESSED);
     } else if (elapsed < 3500) {
       // Release right button
-      hw_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+      set_button(BTN_RIGHT, BTN_STATE_RELEASED);
     } else {
       // Time bypass complete, enable normal button handling
       time_bypass_complete = true;
@@ -336,7 +1891,6 @@ static int hal_handler(void)
   if (btn_a_pressed && btn_pwr_pressed && !btn_a_was_pressed) {
     // Toggle between menu pages
     current_menu_page = (current_menu_page + 1) % max_menu_pages;
-    delay(200); // Debounce
     Serial.println(String("Switched to menu page: ") + String(current_menu_page));
   }
   
@@ -399,34 +1953,34 @@ static int hal_handler(void)
   
   // Handle ART box activation (position 5 in original layout)
   // This is a bit tricky - we need to detect when the user selects the "Art" box
-  // For now, let's trigger it with a special combination: A + B + PWR
+  // For now, let's trigger it with a special combination: A + B + PWR,
+  // when the last of the three goes down so that holding them does not retrigger
   if (btn_a_pressed && btn_b_pressed && btn_pwr_pressed && 
-      !btn_a_was_pressed && !btn_b_was_pressed && !btn_pwr_was_pressed) {
+      (!btn_a_was_pressed || !btn_b_was_pressed || !btn_pwr_was_pressed)) {
     Serial.println("ART EXPLOSION!");
     pixelatedArtExplosion();
-    delay(500); // Prevent immediate retrigger
   }
   
   // Regular Tamagotchi button mapping (only if not doing special functions)
   if (!btn_a_pressed || !btn_pwr_pressed) { // Not scrolling menus
     if (btn_a_pressed)
     {
-      hw_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+      set_button(BTN_LEFT, BTN_STATE_PRESSED);
     }
     else
     {
-      hw_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+      set_button(BTN_LEFT, BTN_STATE_RELEASED);
     }
   }
 
   if (!btn_b_pressed || (millis() - btn_b_hold_start < 2000)) { // Not toggling effects
     if (btn_b_pressed)
     {
-      hw_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+      set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
     }
     else
     {
-      hw_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+      set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
     }
   }
 
@@ -435,11 +1989,11 @@ static int hal_handler(void)
     if (!waiting_for_portal_second_tap || (millis() - last_btn_pwr_press > 500)) {
       if (btn_pwr_pressed)
       {
-        hw_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+        set_button(BTN_RIGHT, BTN_STATE_PRESSED);
       }
       else
       {
-        hw_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+        set_button(BTN_RIGHT, BTN_STATE_RELEASED);
       }
     }
   }
@@ -449,14 +2003,10 @@ static int hal_handler(void)
   btn_b_was_pressed = btn_b_pressed;
   btn_pwr_was_pressed = btn_pwr_pressed;
   
-  // Handle TamaPortal background tasks
+  // Handle TamaPortal background tasks, one step at a time
+  PROF_BEGIN(PROF_PORTAL);
   handleTamaPortal();
-  
-  // Handle web server if TamaPortal hotspot is active
-  if (tamaportal_active && tamaPortalServer != nullptr) {
-    tamaDnsServer->processNextRequest();
-    tamaPortalServer->handleClient();
-  }
+  PROF_END(PROF_PORTAL);
   
   // Clear messages when Clean function is selected (icon_buffer[4] is Clean)
   static bool prev_clean_selected = false;
@@ -465,51 +2015,205 @@ static int hal_handler(void)
     Serial.println("Message cleared with Clean function");
   }
   prev_clean_selected = icon_buffer[4];
+#elif defined(ENABLE_BUTTON_INTERRUPTS)
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    set_button((button_t)btn, button_pressed[btn] ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+  }
 #else
   if (digitalRead(PIN_BTN_L) == BUTTON_VOLTAGE_LEVEL_PRESSED)
   {
-    hw_set_button(BTN_LEFT, BTN_STATE_PRESSED);
+    set_button(BTN_LEFT, BTN_STATE_PRESSED);
+  }
+  else
+  {
+    set_button(BTN_LEFT, BTN_STATE_RELEASED);
+  }
+
+  if (digitalRead(PIN_BTN_M) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+  {
+    set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+  }
+  else
+  {
+    set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+  }
+
+  if (digitalRead(PIN_BTN_R) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+  {
+    set_button(BTN_RIGHT, BTN_STATE_PRESSED);
   }
   else
   {
-    hw_set_button(BTN_LEFT, BTN_STATE_RELEASED);
+    set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+  }
+#endif
+
+  return 0;
+}
+
+static int hal_handler(void)
+{
+#ifdef ENABLE_TURBO_MODE
+  apply_turbo_level();
+#endif
+#ifdef ENABLE_DUAL_CORE
+  // Input is polled in loop(), only apply what it queued
+  apply_button_events();
+  return 0;
+#else
+  return poll_input();
+#endif
+}
+
+static hal_t hal = {
+    .halt = &hal_halt,
+    .log = &hal_log,
+    .sleep_until = &hal_sleep_until,
+    .get_timestamp = &hal_get_timestamp,
+    .update_screen = &hal_update_screen,
+#ifdef LCD_FRAMEBUFFER
+    .set_lcd_matrix = NULL,
+    .set_lcd_icon = NULL,
+#else
+    .set_lcd_matrix = &hal_set_lcd_matrix,
+    .set_lcd_icon = &hal_set_lcd_icon,
+#endif
+    .set_frequency = &hal_set_frequency,
+    .play_frequency = &hal_play_frequency,
+    .handler = &hal_handler,
+};
+
+#ifdef ENABLE_HEADLESS_HAL
+// Same core services, but nothing is drawn or played and the buttons are not polled
+static void headless_update_screen(void)
+{
+}
+
+static void headless_play_frequency(bool_t en)
+{
+}
+
+static int headless_handler(void)
+{
+  headless_yield();
+#ifdef ENABLE_TURBO_MODE
+  apply_turbo_level();
+#endif
+#ifdef ENABLE_DUAL_CORE
+  // Only the serial console is polled by loop() meanwhile
+  apply_button_events();
+#else
+  poll_serial_input();
+#endif
+  return 0;
+}
+
+static hal_t headless_hal = {
+    .halt = &hal_halt,
+    .log = &hal_log,
+    .sleep_until = &hal_sleep_until,
+    .get_timestamp = &hal_get_timestamp,
+    .update_screen = &headless_update_screen,
+#ifdef LCD_FRAMEBUFFER
+    .set_lcd_matrix = NULL,
+    .set_lcd_icon = NULL,
+#else
+    .set_lcd_matrix = &hal_set_lcd_matrix,
+    .set_lcd_icon = &hal_set_lcd_icon,
+#endif
+    .set_frequency = &hal_set_frequency,
+    .play_frequency = &headless_play_frequency,
+    .handler = &headless_handler,
+};
+#endif
+
+#ifdef ENABLE_TURBO_MODE
+// Called from the HAL handler, so the speed and the HAL only change between bursts
+static void apply_turbo_level(void)
+{
+  unsigned long now = millis();
+  uint8_t requested = turbo_requested;
+
+  if (turbo_level != 0 && (requested != turbo_level || now - turbo_report_ms >= TURBO_REPORT_MS))
+  {
+    u32_t ops = tamalib_get_op_count();
+    Serial.print(F("Turbo: "));
+    Serial.print((uint32_t)((uint64_t)(ops - turbo_report_ops) * 1000 / (now - turbo_report_ms + 1)));
+    Serial.println(F(" instructions/s"));
+    turbo_report_ms = now;
+    turbo_report_ops = ops;
   }
 
-  if (digitalRead(PIN_BTN_M) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+  if (requested == turbo_level)
   {
-    hw_set_button(BTN_MIDDLE, BTN_STATE_PRESSED);
+    return;
   }
-  else
+
+  if (turbo_level == 0)
   {
-    hw_set_button(BTN_MIDDLE, BTN_STATE_RELEASED);
+    // Tones are dropped from now on, do not leave one playing
+    hal_play_frequency(0);
   }
+  turbo_level = requested;
+  tamalib_register_hal(turbo_level != 0 ? &headless_hal : &hal);
+  tamalib_set_speed(turbo_speeds[turbo_level]);
+  turbo_report_ms = now;
+  turbo_report_ops = tamalib_get_op_count();
 
-  if (digitalRead(PIN_BTN_R) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+  Serial.print(F("Turbo speed: "));
+  if (turbo_speeds[turbo_level] == 0)
   {
-    hw_set_button(BTN_RIGHT, BTN_STATE_PRESSED);
+    Serial.println(F("max"));
   }
   else
   {
-    hw_set_button(BTN_RIGHT, BTN_STATE_RELEASED);
+    Serial.print(turbo_speeds[turbo_level]);
+    Serial.println(F("x"));
   }
+}
 #endif
 
-  return 0;
+/***** Row spans: the Tama LCD is drawn by runs of lit cells, not one cell at a time *****/
+// Leftmost run of set bits of a row byte, MSB first like the cells, as (start << 4) | length
+static constexpr uint8_t spanStart(uint8_t b, uint8_t k)
+{
+  return (k < 8 && !(b & (0x80 >> k))) ? spanStart(b, k + 1) : k;
 }
 
-static hal_t hal = {
-    .halt = &hal_halt,
-    .log = &hal_log,
-    .sleep_until = &hal_sleep_until,
-    .get_timestamp = &hal_get_timestamp,
-    .update_screen = &hal_update_screen,
-    .set_lcd_matrix = &hal_set_lcd_matrix,
-    .set_lcd_icon = &hal_set_lcd_icon,
-    .set_frequency = &hal_set_frequency,
-    .play_frequency = &hal_play_frequency,
-    .handler = &hal_handler,
+static constexpr uint8_t spanEnd(uint8_t b, uint8_t k)
+{
+  return (k < 8 && (b & (0x80 >> k))) ? spanEnd(b, k + 1) : k;
+}
+
+static constexpr uint8_t firstSpan(uint8_t b)
+{
+  return b ? (spanStart(b, 0) << 4) | (spanEnd(b, spanStart(b, 0)) - spanStart(b, 0)) : 0;
+}
+
+#define ROW_SPANS_4(b) firstSpan(b), firstSpan(b + 1), firstSpan(b + 2), firstSpan(b + 3)
+#define ROW_SPANS_16(b) ROW_SPANS_4(b), ROW_SPANS_4(b + 4), ROW_SPANS_4(b + 8), ROW_SPANS_4(b + 12)
+#define ROW_SPANS_64(b) ROW_SPANS_16(b), ROW_SPANS_16(b + 16), ROW_SPANS_16(b + 32), ROW_SPANS_16(b + 48)
+
+static const uint8_t row_spans[256] PROGMEM = {
+  ROW_SPANS_64(0), ROW_SPANS_64(64), ROW_SPANS_64(128), ROW_SPANS_64(192),
 };
 
+// draw(start, length) for each run of set bits of b, from the left
+template <typename F>
+static inline void forEachSpan(uint8_t b, F draw)
+{
+  while (b)
+  {
+    uint8_t span = pgm_read_byte(&row_spans[b]);
+    uint8_t start = span >> 4;
+    uint8_t end = start + (span & 0xF);
+
+    draw(start, end - start);
+    b &= 0xFF >> end;
+  }
+}
+
 #ifdef M5STICKC_PLUS2
 
 // 90s Retro Border Effect
@@ -524,21 +2228,21 @@ void draw90sBorder()
   
   // Top/Bottom borders with gradient effect
   for (int i = 0; i < 3; i++) {
-    M5.Lcd.drawLine(0, i, 239, i, color1);
-    M5.Lcd.drawLine(0, 134-i, 239, 134-i, color1);
+    tama_gfx->drawLine(0, i, 239, i, color1);
+    tama_gfx->drawLine(0, 134-i, 239, 134-i, color1);
   }
   
   // Left/Right borders
   for (int i = 0; i < 3; i++) {
-    M5.Lcd.drawLine(i, 0, i, 134, color2);
-    M5.Lcd.drawLine(239-i, 0, 239-i, 134, color2);
+    tama_gfx->drawLine(i, 0, i, 134, color2);
+    tama_gfx->drawLine(239-i, 0, 239-i, 134, color2);
   }
   
   // Corner accents
-  M5.Lcd.fillRect(0, 0, 8, 8, NEON_ORANGE);
-  M5.Lcd.fillRect(232, 0, 8, 8, NEON_ORANGE);
-  M5.Lcd.fillRect(0, 127, 8, 8, NEON_ORANGE);
-  M5.Lcd.fillRect(232, 127, 8, 8, NEON_ORANGE);
+  tama_gfx->fillRect(0, 0, 8, 8, NEON_ORANGE);
+  tama_gfx->fillRect(232, 0, 8, 8, NEON_ORANGE);
+  tama_gfx->fillRect(0, 127, 8, 8, NEON_ORANGE);
+  tama_gfx->fillRect(232, 127, 8, 8, NEON_ORANGE);
 }
 
 // Sound Toggle Visual Feedback
@@ -547,37 +2251,24 @@ void showSoundToggleFeedback(bool sound_on)
   // Flash the entire border with appropriate color
   uint16_t feedback_color = sound_on ? NEON_GREEN : TFT_RED;
   
-  // Brief flash effect
-  for (int flash = 0; flash < 2; flash++) {
-    // Top/Bottom borders
-    for (int i = 0; i < 5; i++) {
-      M5.Lcd.drawLine(0, i, 239, i, feedback_color);
-      M5.Lcd.drawLine(0, 134-i, 239, 134-i, feedback_color);
-    }
-    
-    // Left/Right borders  
-    for (int i = 0; i < 5; i++) {
-      M5.Lcd.drawLine(i, 0, i, 134, feedback_color);
-      M5.Lcd.drawLine(239-i, 0, 239-i, 134, feedback_color);
-    }
-    
-    // Corner emphasis
-    M5.Lcd.fillRect(0, 0, 12, 12, feedback_color);
-    M5.Lcd.fillRect(228, 0, 12, 12, feedback_color);
-    M5.Lcd.fillRect(0, 123, 12, 12, feedback_color);
-    M5.Lcd.fillRect(228, 123, 12, 12, feedback_color);
-    
-    delay(100);
-    
-    // Clear flash
-    M5.Lcd.fillRect(0, 0, 240, 5, TFT_BLACK);
-    M5.Lcd.fillRect(0, 130, 240, 5, TFT_BLACK);
-    M5.Lcd.fillRect(0, 0, 5, 135, TFT_BLACK);
-    M5.Lcd.fillRect(235, 0, 5, 135, TFT_BLACK);
-    
-    delay(50);
+  // Top/Bottom borders
+  for (int i = 0; i < 5; i++) {
+    M5.Lcd.drawLine(0, i, 239, i, feedback_color);
+    M5.Lcd.drawLine(0, 134-i, 239, 134-i, feedback_color);
+  }
+  
+  // Left/Right borders  
+  for (int i = 0; i < 5; i++) {
+    M5.Lcd.drawLine(i, 0, i, 134, feedback_color);
+    M5.Lcd.drawLine(239-i, 0, 239-i, 134, feedback_color);
   }
   
+  // Corner emphasis
+  M5.Lcd.fillRect(0, 0, 12, 12, feedback_color);
+  M5.Lcd.fillRect(228, 0, 12, 12, feedback_color);
+  M5.Lcd.fillRect(0, 123, 12, 12, feedback_color);
+  M5.Lcd.fillRect(228, 123, 12, 12, feedback_color);
+  
   // Show text feedback briefly
   M5.Lcd.setTextColor(feedback_color);
   M5.Lcd.setTextSize(2);
@@ -586,7 +2277,7 @@ void showSoundToggleFeedback(bool sound_on)
   M5.Lcd.fillRect(text_x - 5, 60, message.length() * 12 + 10, 20, TFT_BLACK);
   M5.Lcd.drawString(message, text_x, 65);
   
-  delay(1000); // Show message for 1 second
+  holdBanner(SOUND_BANNER_DURATION); // Show message for 1 second
 }
 
 // Enhanced Triangle with 90s glow
@@ -598,18 +2289,18 @@ void drawTriangle(uint16_t x, uint16_t y)
   
   if (effects_enabled) {
     // Glowing effect
-    M5.Lcd.drawLine(x + 2, y + 2, x + 10, y + 2, NEON_CYAN);
-    M5.Lcd.drawLine(x + 4, y + 4, x + 8, y + 4, NEON_CYAN);
-    M5.Lcd.drawLine(x + 6, y + 6, x + 6, y + 6, NEON_CYAN);
+    tama_gfx->drawLine(x + 2, y + 2, x + 10, y + 2, NEON_CYAN);
+    tama_gfx->drawLine(x + 4, y + 4, x + 8, y + 4, NEON_CYAN);
+    tama_gfx->drawLine(x + 6, y + 6, x + 6, y + 6, NEON_CYAN);
     
     // Glow halo
-    M5.Lcd.drawLine(x + 1, y + 1, x + 11, y + 1, NEON_PURPLE);
-    M5.Lcd.drawLine(x + 3, y + 5, x + 9, y + 5, NEON_PURPLE);
+    tama_gfx->drawLine(x + 1, y + 1, x + 11, y + 1, NEON_PURPLE);
+    tama_gfx->drawLine(x + 3, y + 5, x + 9, y + 5, NEON_PURPLE);
   } else {
     // Original white triangle
-    M5.Lcd.drawLine(x + 2, y + 2, x + 10, y + 2, TFT_WHITE);
-    M5.Lcd.drawLine(x + 4, y + 4, x + 8, y + 4, TFT_WHITE);
-    M5.Lcd.drawLine(x + 6, y + 6, x + 6, y + 6, TFT_WHITE);
+    tama_gfx->drawLine(x + 2, y + 2, x + 10, y + 2, TFT_WHITE);
+    tama_gfx->drawLine(x + 4, y + 4, x + 8, y + 4, TFT_WHITE);
+    tama_gfx->drawLine(x + 6, y + 6, x + 6, y + 6, TFT_WHITE);
   }
 }
 
@@ -635,24 +2326,24 @@ void drawEnhancedSelection(uint16_t y)
     if (effects_enabled) {
       // Colorful boxes
       uint16_t box_color = (current_menu_page == 0) ? colors[i] : NEON_CYAN;
-      M5.Lcd.drawRect(x, icon_y, 16 * DISPLAY_SCALE, 9 * DISPLAY_SCALE, box_color);
-      M5.Lcd.drawRect(x+1, icon_y+1, 14 * DISPLAY_SCALE, 7 * DISPLAY_SCALE, box_color);
+      tama_gfx->drawRect(x, icon_y, 16 * DISPLAY_SCALE, 9 * DISPLAY_SCALE, box_color);
+      tama_gfx->drawRect(x+1, icon_y+1, 14 * DISPLAY_SCALE, 7 * DISPLAY_SCALE, box_color);
       
       // Add letter label
-      M5.Lcd.setTextColor(box_color);
-      M5.Lcd.setTextSize(2);
+      tama_gfx->setTextColor(box_color);
+      tama_gfx->setTextSize(2);
       
       if (current_menu_page == 0) {
         // Original Tamagotchi functions
-        M5.Lcd.drawString(labels[i], x + 12, icon_y + 8);
+        tama_gfx->drawString(labels[i], x + 12, icon_y + 8);
       } else {
         // Enhanced functions page 2
         const char* enhanced_labels[] = {"<", "T", "E", "M", "W", "N", ">", "O"};  // <Prev, Theme, Effects, Music, WiFi, New, Next>, Options
-        M5.Lcd.drawString(enhanced_labels[i], x + 12, icon_y + 8);
+        tama_gfx->drawString(enhanced_labels[i], x + 12, icon_y + 8);
       }
     } else {
       // Original simple boxes
-      M5.Lcd.drawRect(x, icon_y, 16 * DISPLAY_SCALE, 9 * DISPLAY_SCALE, TFT_WHITE);
+      tama_gfx->drawRect(x, icon_y, 16 * DISPLAY_SCALE, 9 * DISPLAY_SCALE, TFT_WHITE);
     }
   }
 }
@@ -707,143 +2398,412 @@ void pixelatedArtExplosion()
   }
   
   delay(1000);  // Hold final pattern
+  invalidateDisplay();
 }
 
 // TamaPortal System Implementation
+
+/*
+ * The portal runs as a state machine advanced by handleTamaPortal() at each
+ * poll_input(), so that the emulation and the UI never wait for the WiFi:
+ * the scan is asynchronous, the association is polled with WiFi.status(),
+ * and the HTTP requests, which HTTPClient can only make blocking, are sent
+ * by a short-lived task of their own.
+ */
+typedef enum {
+  PORTAL_IDLE,       // Waiting for the next scan
+  PORTAL_SCANNING,   // WiFi.scanNetworks(true) running
+  PORTAL_CONNECTING, // Joining portal_targets[portal_target]
+  PORTAL_POSTING,    // portalPostTask() running
+  PORTAL_PAUSE,      // Between two targets
+  PORTAL_HOSTING,    // Serving our own hotspot
+} portal_state_t;
+
+#define PORTAL_MAX_TARGETS 8
+#define PORTAL_POST_TASK_STACK_SIZE 6144
+#define PORTAL_POST_TASK_PRIORITY 1
+
+static portal_state_t portal_state = PORTAL_IDLE;
+static unsigned long portal_state_time = 0; // When portal_state was entered
+static String portal_targets[PORTAL_MAX_TARGETS];
+static uint8_t portal_target_num = 0;
+static uint8_t portal_target = 0;
+static String portal_gateway;
+static volatile TaskHandle_t portal_post_task = NULL; // Cleared by the task when it is done
+
+static void setPortalState(portal_state_t state)
+{
+  portal_state = state;
+  portal_state_time = millis();
+}
+
+static void showPortalBanner(uint16_t color, const char *status, int x)
+{
+  M5.Lcd.fillRect(60, 60, 120, 40, TFT_BLACK);
+  M5.Lcd.setTextColor(color);
+  M5.Lcd.setTextSize(2);
+  M5.Lcd.drawString("PORTAL", 80, 65);
+  M5.Lcd.drawString(status, x, 85);
+  holdBanner(PORTAL_BANNER_DURATION);
+}
+
 void initTamaPortal() {
   if (tamaportal_active) {
-    // Deactivate portal
+    // Deactivate portal, a posting task still running just fails its requests
     tamaportal_active = false;
+    if (portal_state == PORTAL_SCANNING) {
+      WiFi.scanDelete();
+    }
+    setPortalState(PORTAL_IDLE);
     WiFi.mode(WIFI_STA);
     WiFi.disconnect();
     Serial.println("TamaPortal deactivated");
     
-    // Show deactivation message
-    M5.Lcd.fillRect(60, 60, 120, 40, TFT_BLACK);
-    M5.Lcd.setTextColor(TFT_RED);
-    M5.Lcd.setTextSize(2);
-    M5.Lcd.drawString("PORTAL", 80, 65);
-    M5.Lcd.drawString("INACTIVE", 70, 85);
-    delay(1500);
+    showPortalBanner(TFT_RED, "INACTIVE", 70);
   } else {
     // Activate portal
     tamaportal_active = true;
     last_portal_scan = 0; // Force immediate scan
+    setPortalState(PORTAL_IDLE);
     Serial.println("TamaPortal activated");
     
-    // Show activation message
-    M5.Lcd.fillRect(60, 60, 120, 40, TFT_BLACK);
-    M5.Lcd.setTextColor(NEON_GREEN);
-    M5.Lcd.setTextSize(2);
-    M5.Lcd.drawString("PORTAL", 80, 65);
-    M5.Lcd.drawString("ACTIVE", 75, 85);
-    delay(1500);
-    
-    // Start immediate background scan
-    scanAndAttackPortals();
+    showPortalBanner(NEON_GREEN, "ACTIVE", 75);
   }
 }
 
-void handleTamaPortal() {
-  if (!tamaportal_active) return;
-  
-  unsigned long now = millis();
-  
-  // Periodic scanning
-  if (now - last_portal_scan > PORTAL_SCAN_INTERVAL) {
-    scanAndAttackPortals();
-    last_portal_scan = now;
-  }
-  
-  // Handle incoming web requests if we're hosting
-  // This would be called from a web server handler
+static void connectToPortalTarget()
+{
+  Serial.printf("Sending friendly message to: %s\n", portal_targets[portal_target].c_str());
+  WiFi.begin(portal_targets[portal_target].c_str());
+  setPortalState(PORTAL_CONNECTING);
 }
 
-void scanAndAttackPortals() {
-  Serial.println("TamaPortal: Scanning for networks...");
-  
-  // Scan for networks
-  int n = WiFi.scanNetworks();
-  
-  if (n == 0) {
-    Serial.println("No networks found, creating TamaPortal hotspot");
-    createTamaPortalHotspot();
-    return;
-  }
-  
-  bool foundOpenNetwork = false;
-  
-  // Look for open networks to send friendly messages
-  for (int i = 0; i < n; i++) {
+// Collect the open networks found by the scan, or host our own hotspot if there are none
+static void portalScanDone(int n)
+{
+  portal_target_num = 0;
+  for (int i = 0; i < n && portal_target_num < PORTAL_MAX_TARGETS; i++) {
     if (WiFi.encryptionType(i) == WIFI_AUTH_OPEN) {
-      String ssid = WiFi.SSID(i);
-      Serial.printf("Found open network: %s\n", ssid.c_str());
-      sendFriendlyMessage(ssid);
-      foundOpenNetwork = true;
-      delay(1000); // Don't spam too fast
+      portal_targets[portal_target_num] = WiFi.SSID(i);
+      Serial.printf("Found open network: %s\n", portal_targets[portal_target_num].c_str());
+      portal_target_num++;
     }
   }
-  
-  // If no open networks found, create our own hotspot
-  if (!foundOpenNetwork) {
-    Serial.println("No open networks found, creating TamaPortal hotspot");
+  WiFi.scanDelete(); // Clean up
+
+  if (portal_target_num == 0) {
+    Serial.println(n <= 0 ? "No networks found, creating TamaPortal hotspot" :
+                            "No open networks found, creating TamaPortal hotspot");
     createTamaPortalHotspot();
+    setPortalState(PORTAL_HOSTING);
+    return;
   }
-  
-  WiFi.scanDelete(); // Clean up
+
+  portal_target = 0;
+  connectToPortalTarget();
 }
 
-void sendFriendlyMessage(String ssid) {
-  Serial.printf("Sending friendly message to: %s\n", ssid.c_str());
-  
-  // Try to connect
-  WiFi.begin(ssid.c_str());
-  
-  unsigned long startTime = millis();
-  while (WiFi.status() != WL_CONNECTED && millis() - startTime < 5000) {
-    delay(100);
-  }
-  
-  if (WiFi.status() == WL_CONNECTED) {
-    // Get gateway IP
-    IPAddress gateway = WiFi.gatewayIP();
-    String gatewayIP = gateway.toString();
-    
-    // Friendly Tamagotchi messages
-    String friendlyMessages[] = {
-      "Hello from my Tamagotchi! 🐣",
-      "Virtual pet owner nearby! ✨", 
-      "My Tamagotchi says hi! 👋",
-      "Remember to feed your pets! 💖",
-      "90s nostalgia activated! 🎮",
-      "Pixel pets forever! 🎨"
-    };
+static void sendFriendlyMessage(const String &gatewayIP) {
+  // Friendly Tamagotchi messages
+  String friendlyMessages[] = {
+    "Hello from my Tamagotchi! 🐣",
+    "Virtual pet owner nearby! ✨", 
+    "My Tamagotchi says hi! 👋",
+    "Remember to feed your pets! 💖",
+    "90s nostalgia activated! 🎮",
+    "Pixel pets forever! 🎨"
+  };
+  
+  int messageIndex = random(0, 6);
+  String message1 = friendlyMessages[messageIndex];
+  String message2 = friendlyMessages[(messageIndex + 1) % 6];
+  
+  // Try common portal endpoints
+  String endpoints[] = {"/post", "/", "/login", "/auth"};
+  
+  for (String endpoint : endpoints) {
+    HTTPClient http;
+    String url = "http://" + gatewayIP + endpoint;
+    http.begin(url);
+    http.setTimeout(2000);
+    http.addHeader("Content-Type", "application/x-www-form-urlencoded");
     
-    int messageIndex = random(0, 6);
-    String message1 = friendlyMessages[messageIndex];
-    String message2 = friendlyMessages[(messageIndex + 1) % 6];
+    // Send friendly data
+    String friendlyData = "email=" + message1 + "&password=" + message2 + "&username=" + message1;
     
-    // Try common portal endpoints
-    String endpoints[] = {"/post", "/", "/login", "/auth"};
+    int responseCode = http.POST(friendlyData);
+    Serial.printf("Sent friendly message to %s - Response: %d\n", url.c_str(), responseCode);
     
-    for (String endpoint : endpoints) {
-      HTTPClient http;
-      String url = "http://" + gatewayIP + endpoint;
-      http.begin(url);
-      http.setTimeout(2000);
-      http.addHeader("Content-Type", "application/x-www-form-urlencoded");
-      
-      // Send friendly data
-      String friendlyData = "email=" + message1 + "&password=" + message2 + "&username=" + message1;
-      
-      int responseCode = http.POST(friendlyData);
-      Serial.printf("Sent friendly message to %s - Response: %d\n", url.c_str(), responseCode);
-      
-      http.end();
-      delay(500);
+    http.end();
+    delay(500);
+  }
+}
+
+static void portalPostTask(void *arg)
+{
+  sendFriendlyMessage(portal_gateway);
+  portal_post_task = NULL;
+  vTaskDelete(NULL);
+}
+
+/*
+ * Live view: http://192.168.4.1/live draws the Tama LCD from a WebSocket on
+ * LIVE_VIEW_PORT. Each time the core publishes a new frame (matrix and icons,
+ * 65 bytes), it is sent to every client as a keyframe (type 0, the raw bytes)
+ * or, when shorter, as a delta (type 1) against the previous frame: runs of
+ * (unchanged bytes to skip, changed byte count, XOR of each changed byte).
+ * A new client gets a keyframe of the previous frame, so that the next delta
+ * applies to it too. The browser sends back 2-byte button events: button
+ * (0 left, 1 middle, 2 right) and 1 pressed / 0 released.
+ */
+#ifdef ENABLE_LIVE_VIEW
+#if !defined(M5STICKC_PLUS2) || !defined(LCD_FRAMEBUFFER)
+#error "ENABLE_LIVE_VIEW needs the M5StickC Plus2 TamaPortal and LCD_FRAMEBUFFER"
+#endif
+
+#ifndef LIVE_VIEW_PORT
+#define LIVE_VIEW_PORT 81
+#endif
+#define LIVE_FRAME_SIZE sizeof(lcd_frame_t)
+#define LIVE_MSG_KEY 0
+#define LIVE_MSG_DELTA 1
+#define LIVE_STR(x) #x
+#define LIVE_XSTR(x) LIVE_STR(x)
+
+static uint8_t live_frame[LIVE_FRAME_SIZE]; // Last frame sent
+static u32_t live_frame_num = 0;
+static uint8_t live_msg[LIVE_FRAME_SIZE + 1];
+
+static const char live_view_html[] PROGMEM =
+  "<!DOCTYPE html><html><head><title>TamaPortal Live</title>"
+  "<meta name='viewport' content='width=device-width'>"
+  "<style>body{background:#000080;color:#00FFFF;font-family:Arial;text-align:center;margin:20px;}"
+  "canvas{border:2px solid #FF00FF;}button{background:#FF00FF;color:white;width:80px;height:50px;"
+  "font-size:20px;border:none;margin:10px;touch-action:none;}</style></head><body>"
+  "<h1>TamaPortal Live</h1><canvas id='c' width='320' height='185'></canvas><br>"
+  "<button id='b0'>A</button><button id='b1'>B</button><button id='b2'>C</button>"
+  "<p id='s'>Connecting...</p><script>"
+  "var f=new Uint8Array(65),g=document.getElementById('c').getContext('2d'),"
+  "s=document.getElementById('s'),w=new WebSocket('ws://'+location.hostname+':" LIVE_XSTR(LIVE_VIEW_PORT) "/');"
+  "w.binaryType='arraybuffer';w.onopen=function(){s.textContent='Live';};"
+  "w.onclose=function(){s.textContent='Disconnected';};"
+  "w.onmessage=function(e){var m=new Uint8Array(e.data),i=1,p=0,n;"
+  "if(m[0]==0){f.set(m.subarray(1));}else{while(i<m.length){p+=m[i++];n=m[i++];while(n--){f[p++]^=m[i++];}}}"
+  "for(var y=0;y<16;y++)for(var x=0;x<32;x++){g.fillStyle=(f[y*4+(x>>3)]>>(7-(x&7)))&1?'#00FFFF':'#000040';"
+  "g.fillRect(x*10,y*10,9,9);}"
+  "for(var k=0;k<8;k++){g.fillStyle=(f[64]>>k)&1?'#FFFF00':'#000040';g.fillRect(k*40+5,168,30,12);}};"
+  "[0,1,2].forEach(function(n){var b=document.getElementById('b'+n),"
+  "t=function(v){return function(e){e.preventDefault();if(w.readyState==1)w.send(new Uint8Array([n,v]));};};"
+  "b.onpointerdown=t(1);b.onpointerup=b.onpointerleave=t(0);});"
+  "</script></body></html>";
+
+// Bytes of the delta against live_frame in live_msg, or 0 when a keyframe is not longer
+static size_t encodeLiveDelta(const uint8_t *frame)
+{
+  size_t len = 1;
+  uint8_t i = 0, run_end = 0;
+
+  live_msg[0] = LIVE_MSG_DELTA;
+  while (i < LIVE_FRAME_SIZE)
+  {
+    if (frame[i] == live_frame[i])
+    {
+      i++;
+      continue;
     }
-    
-    WiFi.disconnect();
+
+    // A gap of up to 2 unchanged bytes costs less inside the run than as a new run header
+    uint8_t start = i;
+    uint8_t end = i + 1;
+    for (uint8_t k = end; k < LIVE_FRAME_SIZE && k <= end + 2; k++)
+    {
+      if (frame[k] != live_frame[k])
+      {
+        end = k + 1;
+      }
+    }
+
+    if (len + 2 + (end - start) > LIVE_FRAME_SIZE)
+    {
+      return 0;
+    }
+    live_msg[len++] = start - run_end;
+    live_msg[len++] = end - start;
+    for (i = start; i < end; i++)
+    {
+      live_msg[len++] = frame[i] ^ live_frame[i];
+    }
+    run_end = end;
+  }
+
+  return len;
+}
+
+static size_t encodeLiveKeyframe()
+{
+  live_msg[0] = LIVE_MSG_KEY;
+  memcpy(live_msg + 1, live_frame, LIVE_FRAME_SIZE);
+  return LIVE_FRAME_SIZE + 1;
+}
+
+static void releaseLiveViewButtons()
+{
+  for (uint8_t btn = 0; btn < 3; btn++)
+  {
+    if (live_view_pressed[btn])
+    {
+      live_view_pressed[btn] = false;
+      set_button((button_t)btn, BTN_STATE_RELEASED); // poll_input() posts the physical state again
+    }
+  }
+}
+
+static void onLiveViewEvent(uint8_t client, WStype_t type, uint8_t *payload, size_t length)
+{
+  switch (type)
+  {
+  case WStype_CONNECTED:
+    liveViewSocket->sendBIN(client, live_msg, encodeLiveKeyframe());
+    break;
+
+  case WStype_DISCONNECTED:
+    // A button held from a browser that went away would stay down
+    releaseLiveViewButtons();
+    break;
+
+  case WStype_BIN:
+    if (length == 2 && payload[0] < 3)
+    {
+      live_view_pressed[payload[0]] = payload[1] != 0;
+      set_button((button_t)payload[0], payload[1] ? BTN_STATE_PRESSED : BTN_STATE_RELEASED);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+static void startLiveView()
+{
+  liveViewSocket = new WebSocketsServer(LIVE_VIEW_PORT);
+  liveViewSocket->onEvent(onLiveViewEvent);
+  liveViewSocket->begin();
+
+  tamaPortalServer->on("/live", []() {
+    tamaPortalServer->send_P(200, "text/html", live_view_html);
+  });
+}
+
+// Serve the socket, then send the frame published since the last call, if it changed
+static void stepLiveView()
+{
+  lcd_frame_t frame;
+  uint8_t bytes[LIVE_FRAME_SIZE];
+  size_t len;
+
+  liveViewSocket->loop();
+  if (tamalib_get_frame_num() == live_frame_num)
+  {
+    return;
+  }
+
+  live_frame_num = tamalib_get_frame(&frame);
+  memcpy(bytes, &frame, LIVE_FRAME_SIZE);
+  if (liveViewSocket->connectedClients() == 0)
+  {
+    // Still tracked, for the keyframe of the next client
+    memcpy(live_frame, bytes, LIVE_FRAME_SIZE);
+    return;
+  }
+
+  len = encodeLiveDelta(bytes);
+  memcpy(live_frame, bytes, LIVE_FRAME_SIZE);
+  if (len == 1)
+  {
+    return; // Same pixels and icons
+  }
+  if (len == 0)
+  {
+    len = encodeLiveKeyframe();
+  }
+  liveViewSocket->broadcastBIN(live_msg, len);
+}
+#endif
+
+void handleTamaPortal() {
+  if (!tamaportal_active) return;
+  
+  unsigned long now = millis();
+  
+  switch (portal_state) {
+    case PORTAL_IDLE:
+      // Periodic scanning
+      if (last_portal_scan == 0 || now - last_portal_scan > PORTAL_SCAN_INTERVAL) {
+        Serial.println("TamaPortal: Scanning for networks...");
+        last_portal_scan = now;
+        WiFi.scanNetworks(true);
+        setPortalState(PORTAL_SCANNING);
+      }
+      break;
+
+    case PORTAL_SCANNING: {
+      int n = WiFi.scanComplete();
+      if (n != WIFI_SCAN_RUNNING) {
+        portalScanDone(n);
+      }
+      break;
+    }
+
+    case PORTAL_CONNECTING:
+      if (WiFi.status() == WL_CONNECTED) {
+        // The task of a portal deactivated meanwhile may still be around
+        if (portal_post_task != NULL) {
+          break;
+        }
+        portal_gateway = WiFi.gatewayIP().toString();
+        TaskHandle_t task;
+        if (xTaskCreate(portalPostTask, "tama_portal", PORTAL_POST_TASK_STACK_SIZE, NULL,
+                        PORTAL_POST_TASK_PRIORITY, &task) == pdPASS) {
+          portal_post_task = task;
+          setPortalState(PORTAL_POSTING);
+          break;
+        }
+        WiFi.disconnect();
+        setPortalState(PORTAL_PAUSE);
+      } else if (now - portal_state_time >= PORTAL_CONNECT_TIMEOUT) {
+        WiFi.disconnect();
+        setPortalState(PORTAL_PAUSE);
+      }
+      break;
+
+    case PORTAL_POSTING:
+      if (portal_post_task == NULL) {
+        WiFi.disconnect();
+        setPortalState(PORTAL_PAUSE);
+      }
+      break;
+
+    case PORTAL_PAUSE:
+      if (now - portal_state_time >= PORTAL_TARGET_PAUSE) {
+        if (++portal_target < portal_target_num) {
+          connectToPortalTarget();
+        } else {
+          setPortalState(PORTAL_IDLE);
+        }
+      }
+      break;
+
+    case PORTAL_HOSTING:
+      // At most one DNS and one HTTP request per call
+      if (tamaPortalServer != nullptr) {
+        tamaDnsServer->processNextRequest();
+        tamaPortalServer->handleClient();
+#ifdef ENABLE_LIVE_VIEW
+        stepLiveView();
+#endif
+      }
+      break;
   }
 }
 
@@ -880,7 +2840,11 @@ void createTamaPortalHotspot() {
     html += "<form action='/message' method='post'>";
     html += "<textarea name='msg' placeholder='Type your friendly message here (2 lines max)...'></textarea><br><br>";
     html += "<input type='submit' value='SEND TO TAMAGOTCHI'>";
-    html += "</form></body></html>";
+    html += "</form>";
+#ifdef ENABLE_LIVE_VIEW
+    html += "<p><a href='/live' style='color:#FFFF00;'>Watch it live</a></p>";
+#endif
+    html += "</body></html>";
     
     tamaPortalServer->send(200, "text/html", html);
   });
@@ -916,66 +2880,393 @@ void createTamaPortalHotspot() {
     tamaPortalServer->send(302, "text/plain", "");
   });
   
+#ifdef ENABLE_LIVE_VIEW
+  startLiveView();
+#endif
   tamaPortalServer->begin();
   hotspotCreated = true;
   
   Serial.println("TamaPortal hotspot created successfully!");
 }
 
-void drawTamaRow(uint8_t tamaLCD_y, uint16_t ActualLCD_y, uint8_t thick)
+/*
+ * Tama LCD cells on the screen: 2 lit lines out of every 3, times Scale,
+ * moved by the offsets. Only the cell index changes at run time, the rest
+ * of the coordinate math folds. A run of lit cells goes out as a single
+ * window holding the cells and the black gaps between them, so the dot
+ * grid stays while there is one draw per run instead of one per cell. A
+ * run of dark cells is a single fillRect, its gaps are black anyway.
+ */
+template <int Scale, int OffsetX, int OffsetY>
+class TamaBlitter
+{
+public:
+  static constexpr int cellX(int i) { return (i * 3 + 16) * Scale + OffsetX; }
+  static constexpr int lineY(int line) { return line * Scale + OffsetY; }
+  static constexpr int spanWidth(int cells) { return (cells * 3 - 1) * Scale; }
+
+  // Once per frame, before drawing the lit cells
+  void setColor(uint16_t color)
+  {
+    if (line_valid && color == line_color)
+      return;
+    for (int x = 0; x < spanWidth(8); x++)
+      line[x] = ((x / Scale) % 3 == 2) ? TFT_BLACK : color;
+    line_color = color;
+    line_valid = true;
+  }
+
+  // Cells first to first + 7 with a bit set in bits, h lines from screen line y
+  void drawCells(lgfx::LovyanGFX *gfx, uint8_t first, uint8_t bits, int y, int h)
+  {
+    forEachSpan(bits, [&](uint8_t start, uint8_t cells) {
+      int w = spanWidth(cells);
+
+      gfx->startWrite();
+      gfx->setAddrWindow(cellX(first + start), y, w, h);
+      for (int r = 0; r < h; r++)
+        gfx->writePixels(line, w, true);
+      gfx->endWrite();
+    });
+  }
+
+  static void eraseCells(lgfx::LovyanGFX *gfx, uint8_t first, uint8_t bits, int y, int h)
+  {
+    forEachSpan(bits, [&](uint8_t start, uint8_t cells) {
+      gfx->fillRect(cellX(first + start), y, spanWidth(cells), h, TFT_BLACK);
+    });
+  }
+
+private:
+  uint16_t line[spanWidth(8)]; // Lit cells and gaps of the longest run
+  uint16_t line_color = 0;
+  bool line_valid = false;
+};
+
+typedef TamaBlitter<DISPLAY_SCALE, DISPLAY_OFFSET_X, DISPLAY_OFFSET_Y> TamaGrid;
+static TamaGrid tama_blitter;
+
+// Screen position of Tama LCD cell (i, j); row 5 keeps its 2-line height
+#define TAMA_CELL_X(i) TamaGrid::cellX(i)
+#define TAMA_CELL_Y(j) TamaGrid::lineY((j) * 3)
+#define TAMA_CELL_SIZE (2 * DISPLAY_SCALE)
+#define TAMA_ICON_Y 49
+
+static uint16_t tamaPixelColor(unsigned long time)
+{
+  // Enhanced pixels with subtle glow if effects enabled
+  return (effects_enabled && ((time / 200) % 3 == 0)) ? NEON_GREEN : TFT_WHITE;
+}
+
+static void starPosition(int i, unsigned long time, int *x, int *y)
+{
+  *x = ((time / 100 + i * 31) % 240); // Moving across screen
+  *y = ((time / 150 + i * 17) % 135); // Different speeds
+}
+
+static void drawStar(int i, int x, int y, uint16_t star_color)
+{
+  tama_gfx->drawPixel(x, y, star_color);
+  // Make some stars bigger
+  if (i % 5 == 0) {
+    tama_gfx->drawPixel(x+1, y, star_color);
+    tama_gfx->drawPixel(x, y+1, star_color);
+  }
+}
+
+static uint16_t starColor(int i)
+{
+  return (i % 3 == 0) ? NEON_CYAN : (i % 3 == 1) ? NEON_GREEN : TFT_WHITE;
+}
+
+// Page indicator and sound status
+static void drawStatusLabels()
+{
+  if (!effects_enabled) return;
+
+  tama_gfx->setTextColor(NEON_YELLOW);
+  tama_gfx->setTextSize(1);
+  tama_gfx->drawString(String("Page ") + String(current_menu_page + 1) + "/" + String(max_menu_pages), 10, 120);
+
+  // Sound status indicator
+  tama_gfx->setTextColor(sound_enabled ? NEON_GREEN : TFT_RED);
+  String sound_status = sound_enabled ? "♪" : "♪";
+  tama_gfx->drawString(sound_status, 200, 120);
+
+  // Add sound text for clarity
+  tama_gfx->setTextSize(1);
+  tama_gfx->drawString(sound_enabled ? "ON" : "OFF", 210, 120);
+}
+
+// True while a received TamaPortal message should be shown, clears it once expired
+static bool messageOverlayActive()
+{
+  if (received_message.length() > 0 && (millis() - message_display_time < MESSAGE_DISPLAY_DURATION)) {
+    return true;
+  } else if (received_message.length() > 0) {
+    // Message expired, clear it
+    received_message = "";
+  }
+  return false;
+}
+
+static void drawMessageOverlay()
+{
+  // Message overlay
+  tama_gfx->fillRect(20, 40, 200, 50, TFT_BLACK);
+  tama_gfx->drawRect(18, 38, 204, 54, NEON_CYAN);
+  tama_gfx->drawRect(19, 39, 202, 52, NEON_CYAN);
+
+  tama_gfx->setTextColor(NEON_GREEN);
+  tama_gfx->setTextSize(1);
+  tama_gfx->drawString("Message received:", 25, 45);
+
+  tama_gfx->setTextColor(TFT_WHITE);
+  // Split message into two lines if too long
+  String line1 = received_message.substring(0, 30);
+  String line2 = received_message.substring(30, 60);
+
+  tama_gfx->drawString(line1, 25, 60);
+  if (line2.length() > 0) {
+    tama_gfx->drawString(line2, 25, 75);
+  }
+
+  // Show hint to clear message
+  tama_gfx->setTextColor(NEON_YELLOW);
+  tama_gfx->setTextSize(1);
+  tama_gfx->drawString("Use Clean to clear", 100, 85);
+}
+
+// In the color given to tama_blitter.setColor() for the frame
+void drawTamaRow(uint8_t tamaLCD_y, uint16_t ActualLCD_y, uint8_t thick)
+{
+  for (uint8_t b = 0; b < LCD_WIDTH / 8; b++)
+  {
+    tama_blitter.drawCells(tama_gfx, b * 8, matrix_buffer[tamaLCD_y][b], TamaGrid::lineY(ActualLCD_y),
+                           thick * DISPLAY_SCALE);
+  }
+}
+
+void drawTamaSelection(uint16_t y)
+{
+  drawEnhancedSelection(y);
+}
+
+#if TAMA_RENDER_MODE == TAMA_RENDER_DIRTY
+/*
+ * Dirty-rectangle renderer: remembers what is on the LCD and only pushes
+ * the cells, icons, stars and border colors that differ from it.
+ * Anything drawing over the screen outside displayTama() must call
+ * invalidateDisplay() so that the next frame is redrawn from scratch.
+ */
+#define STAR_NUM 20
+
+static bool screen_valid = false;
+static bool_t shown_matrix[LCD_HEIGHT][LCD_WIDTH / 8];
+static bool_t shown_icons[ICON_NUM];
+static uint16_t shown_pixel_color;
+static uint8_t shown_border_phase;
+static int16_t shown_stars[STAR_NUM][2];
+static int shown_menu_page;
+static bool shown_effects;
+static bool shown_sound;
+static bool shown_message;
+static unsigned long shown_message_time;
+
+void invalidateDisplay()
+{
+  screen_valid = false;
+}
+
+static uint8_t borderPhase(unsigned long time)
 {
-  uint8_t i;
-  for (i = 0; i < LCD_WIDTH; i++)
+  // Same color selection as draw90sBorder()
+  return ((time / 100) % 2) | (((time / 150) % 2) << 1);
+}
+
+// Rectangle intersects the frame drawn by drawMessageOverlay()
+static bool underMessageOverlay(int x, int y, int w, int h)
+{
+  return x + w > 18 && x < 18 + 204 && y + h > 38 && y < 38 + 54;
+}
+
+// Stars are only drawn where erasing them cannot damage another layer
+static bool starInFreeArea(int x, int y)
+{
+  if (!((x < 50 || x > 190) || (y < 15 || y > 110))) return false; // Center Tamagotchi area
+  if (x < 3 || x > 235 || y < 3 || y > 104) return false; // Border and selection strip
+  if (y < 8 && (x < 8 || x >= 231)) return false; // Corner accents
+  if (underMessageOverlay(x, y, 2, 2)) return false;
+  if (x + 1 >= TAMA_CELL_X(0) && x <= TAMA_CELL_X(LCD_WIDTH - 1) + TAMA_CELL_SIZE - 1 &&
+      y + 1 >= TAMA_CELL_Y(0) && y <= TAMA_CELL_Y(LCD_HEIGHT - 1) + TAMA_CELL_SIZE - 1) return false;
+  return true;
+}
+
+static void eraseTriangle(uint16_t x, uint16_t y)
+{
+  // Bounding box of drawTriangle()
+  tama_gfx->fillRect((x * DISPLAY_SCALE) + DISPLAY_OFFSET_X, (y * DISPLAY_SCALE) + DISPLAY_OFFSET_Y, 12, 7, TFT_BLACK);
+}
+
+static void updateStars(unsigned long time, bool redraw)
+{
+  int pos[STAR_NUM][2];
+  bool redraw_all = redraw;
+  int i;
+
+  for (i = 0; i < STAR_NUM; i++) {
+    starPosition(i, time, &pos[i][0], &pos[i][1]);
+    if (!starInFreeArea(pos[i][0], pos[i][1]))
+      pos[i][0] = pos[i][1] = -1;
+  }
+
+  // Erase every moved star first, overlapping stars that did not move are then redrawn too
+  for (i = 0; i < STAR_NUM; i++) {
+    if (!redraw && shown_stars[i][0] >= 0 &&
+        (shown_stars[i][0] != pos[i][0] || shown_stars[i][1] != pos[i][1])) {
+      drawStar(i, shown_stars[i][0], shown_stars[i][1], TFT_BLACK);
+      redraw_all = true;
+    }
+  }
+
+  for (i = 0; i < STAR_NUM; i++) {
+    if (pos[i][0] >= 0 && (redraw_all || shown_stars[i][0] != pos[i][0] || shown_stars[i][1] != pos[i][1]))
+      drawStar(i, pos[i][0], pos[i][1], starColor(i));
+    shown_stars[i][0] = pos[i][0];
+    shown_stars[i][1] = pos[i][1];
+  }
+}
+
+static void redrawTamaDisplay(unsigned long time, bool message_active)
+{
+  uint16_t pixel_color = tamaPixelColor(time);
+
+  tama_gfx->fillScreen(TFT_BLACK);
+  if (effects_enabled)
+    updateStars(time, true);
+  draw90sBorder();
+
+  tama_blitter.setColor(pixel_color);
+  for (uint8_t j = 0; j < LCD_HEIGHT; j++)
+  {
+    for (uint8_t b = 0; b < LCD_WIDTH / 8; b++)
+      tama_blitter.drawCells(tama_gfx, b * 8, matrix_buffer[j][b], TAMA_CELL_Y(j), TAMA_CELL_SIZE);
+  }
+
+  drawTamaSelection(TAMA_ICON_Y);
+  drawStatusLabels();
+  if (message_active)
+    drawMessageOverlay();
+
+  memcpy(shown_matrix, matrix_buffer, sizeof(shown_matrix));
+  memcpy(shown_icons, icon_buffer, sizeof(shown_icons));
+  shown_pixel_color = pixel_color;
+  shown_border_phase = borderPhase(time);
+  shown_menu_page = current_menu_page;
+  shown_effects = effects_enabled;
+  shown_sound = sound_enabled;
+  shown_message = message_active;
+  shown_message_time = message_display_time;
+  screen_valid = true;
+}
+
+void displayTama()
+{
+  unsigned long time = millis();
+  bool message_active = messageOverlayActive();
+
+  // Chrome changes or a dismissed overlay need the whole frame
+  if (shown_menu_page != current_menu_page || shown_effects != effects_enabled ||
+      shown_sound != sound_enabled || (shown_message && !message_active))
+    screen_valid = false;
+
+  if (!screen_valid) {
+    redrawTamaDisplay(time, message_active);
+    return;
+  }
+
+  if (effects_enabled) {
+    updateStars(time, false);
+
+    uint8_t border_phase = borderPhase(time);
+    if (border_phase != shown_border_phase) {
+      // The selection boxes overlap the bottom and right border
+      draw90sBorder();
+      drawTamaSelection(TAMA_ICON_Y);
+      shown_border_phase = border_phase;
+    }
+  }
+
+  uint16_t pixel_color = tamaPixelColor(time);
+  bool recolor = (pixel_color != shown_pixel_color);
+  bool overlay_damaged = false;
+
+  tama_blitter.setColor(pixel_color);
+  for (uint8_t j = 0; j < LCD_HEIGHT; j++)
   {
-    uint8_t mask = 0b10000000;
-    mask = mask >> (i % 8);
-    if ((matrix_buffer[tamaLCD_y][i / 8] & mask) != 0)
+    for (uint8_t b = 0; b < LCD_WIDTH / 8; b++)
     {
-      uint16_t x = (i * 3 + 16) * DISPLAY_SCALE + DISPLAY_OFFSET_X;
-      uint16_t y = ActualLCD_y * DISPLAY_SCALE + DISPLAY_OFFSET_Y;
-      
-      // Enhanced pixels with subtle glow if effects enabled
-      if (effects_enabled && ((millis() / 200) % 3 == 0)) {
-        M5.Lcd.fillRect(x, y, 2 * DISPLAY_SCALE, thick * DISPLAY_SCALE, NEON_GREEN);
-      } else {
-        M5.Lcd.fillRect(x, y, 2 * DISPLAY_SCALE, thick * DISPLAY_SCALE, TFT_WHITE);
-      }
+      uint8_t now = matrix_buffer[j][b];
+      uint8_t changed = now ^ shown_matrix[j][b];
+      if (recolor)
+        changed |= now;
+      if (!changed)
+        continue;
+
+      tama_blitter.drawCells(tama_gfx, b * 8, changed & now, TAMA_CELL_Y(j), TAMA_CELL_SIZE);
+      TamaGrid::eraseCells(tama_gfx, b * 8, changed & ~now, TAMA_CELL_Y(j), TAMA_CELL_SIZE);
+      // The 8 cells of the byte, a little wider than what changed
+      if (message_active && underMessageOverlay(TAMA_CELL_X(b * 8), TAMA_CELL_Y(j), TamaGrid::spanWidth(8), TAMA_CELL_SIZE))
+        overlay_damaged = true;
+      shown_matrix[j][b] = now;
     }
   }
+  shown_pixel_color = pixel_color;
+
+  // The overlay stays on top of the matrix, as in a full redraw
+  if (message_active && (overlay_damaged || !shown_message || shown_message_time != message_display_time)) {
+    drawMessageOverlay();
+    shown_message = true;
+    shown_message_time = message_display_time;
+  }
+
+  for (uint8_t i = 0; i < ICON_NUM; i++)
+  {
+    if (icon_buffer[i] == shown_icons[i])
+      continue;
+
+    if (icon_buffer[i])
+      drawTriangle(i * 16 + 5, TAMA_ICON_Y);
+    else
+      eraseTriangle(i * 16 + 5, TAMA_ICON_Y);
+    shown_icons[i] = icon_buffer[i];
+  }
 }
 
-void drawTamaSelection(uint16_t y)
+#else
+// Every frame is composed from scratch, nothing to invalidate
+void invalidateDisplay()
 {
-  drawEnhancedSelection(y);
 }
 
-void displayTama()
+static void composeTamaFrame()
 {
   // Background with cool animated effect or simple black
+  tama_gfx->fillScreen(TFT_BLACK);
   if (effects_enabled) {
     // Simple animated starfield effect instead of Matrix rain
     unsigned long time = millis();
-    M5.Lcd.fillScreen(TFT_BLACK);
     
     // Draw animated "stars" - much simpler than Matrix
     for (int i = 0; i < 20; i++) {
-      int x = ((time / 100 + i * 31) % 240); // Moving across screen
-      int y = ((time / 150 + i * 17) % 135); // Different speeds
+      int x, y;
+      starPosition(i, time, &x, &y);
       
       // Only draw in safe areas (avoid center Tamagotchi area)
       if ((x < 50 || x > 190) || (y < 15 || y > 110)) {
-        uint16_t star_color = (i % 3 == 0) ? NEON_CYAN : 
-                             (i % 3 == 1) ? NEON_GREEN : TFT_WHITE;
-        M5.Lcd.drawPixel(x, y, star_color);
-        // Make some stars bigger
-        if (i % 5 == 0) {
-          M5.Lcd.drawPixel(x+1, y, star_color);
-          M5.Lcd.drawPixel(x, y+1, star_color);
-        }
+        drawStar(i, x, y, starColor(i));
       }
     }
-  } else {
-    M5.Lcd.fillScreen(TFT_BLACK);
   }
   
   // Draw 90s border
@@ -983,6 +3274,7 @@ void displayTama()
   
   // Draw main Tamagotchi display area
   uint8_t j;
+  tama_blitter.setColor(tamaPixelColor(millis()));
   for (j = 0; j < LCD_HEIGHT; j++)
   {
     if (j != 5)
@@ -995,55 +3287,76 @@ void displayTama()
   }
   
   // Draw enhanced selection area
-  drawTamaSelection(49);
+  drawTamaSelection(TAMA_ICON_Y);
   
-  // Page indicator and sound status
-  if (effects_enabled) {
-    M5.Lcd.setTextColor(NEON_YELLOW);
-    M5.Lcd.setTextSize(1);
-    M5.Lcd.drawString(String("Page ") + String(current_menu_page + 1) + "/" + String(max_menu_pages), 10, 120);
-    
-    // Sound status indicator
-    M5.Lcd.setTextColor(sound_enabled ? NEON_GREEN : TFT_RED);
-    String sound_status = sound_enabled ? "♪" : "♪";
-    M5.Lcd.drawString(sound_status, 200, 120);
-    
-    // Add sound text for clarity
-    M5.Lcd.setTextSize(1);
-    M5.Lcd.drawString(sound_enabled ? "ON" : "OFF", 210, 120);
-  }
+  drawStatusLabels();
   
   // Display received TamaPortal message
-  if (received_message.length() > 0 && (millis() - message_display_time < MESSAGE_DISPLAY_DURATION)) {
-    // Message overlay
-    M5.Lcd.fillRect(20, 40, 200, 50, TFT_BLACK);
-    M5.Lcd.drawRect(18, 38, 204, 54, NEON_CYAN);
-    M5.Lcd.drawRect(19, 39, 202, 52, NEON_CYAN);
-    
-    M5.Lcd.setTextColor(NEON_GREEN);
-    M5.Lcd.setTextSize(1);
-    M5.Lcd.drawString("Message received:", 25, 45);
-    
-    M5.Lcd.setTextColor(TFT_WHITE);
-    // Split message into two lines if too long
-    String line1 = received_message.substring(0, 30);
-    String line2 = received_message.substring(30, 60);
-    
-    M5.Lcd.drawString(line1, 25, 60);
-    if (line2.length() > 0) {
-      M5.Lcd.drawString(line2, 25, 75);
-    }
-    
-    // Show hint to clear message
-    M5.Lcd.setTextColor(NEON_YELLOW);
-    M5.Lcd.setTextSize(1);
-    M5.Lcd.drawString("Use Clean to clear", 100, 85);
-  } else if (received_message.length() > 0) {
-    // Message expired, clear it
-    received_message = "";
+  if (messageOverlayActive()) {
+    drawMessageOverlay();
+  }
+}
+
+#if TAMA_RENDER_MODE == TAMA_RENDER_SPRITE
+/*
+ * Sprite renderer: the frame is composed in an off-screen canvas and sent
+ * with a single DMA transfer. The LCD write transaction is kept open so
+ * that pushImageDMA() returns immediately and emulation continues while
+ * the frame is on the bus. With two canvases the next frame is composed
+ * in the other one, with a single canvas we wait for the transfer first.
+ * If no canvas fits in DMA capable memory, frames are drawn directly.
+ */
+static M5Canvas tama_canvas[2];
+static uint8_t canvas_num = 0;
+static uint8_t canvas_back = 0;
+static bool canvas_init_done = false;
+
+static void initTamaCanvas()
+{
+  for (uint8_t i = 0; i < 2; i++) {
+    tama_canvas[i].setColorDepth(16);
+    tama_canvas[i].setPsram(false); // DMA can't read from PSRAM
+    if (tama_canvas[i].createSprite(SCREEN_WIDTH, SCREEN_HEIGHT) == nullptr)
+      break;
+    canvas_num++;
+  }
+
+  M5.Lcd.initDMA();
+  M5.Lcd.startWrite();
+  canvas_init_done = true;
+  Serial.printf("Sprite renderer: %d frame buffer(s)\n", canvas_num);
+}
+
+void displayTama()
+{
+  if (!canvas_init_done)
+    initTamaCanvas();
+
+  if (canvas_num == 0) {
+    composeTamaFrame();
+    return;
   }
+
+  // The single canvas may still be on the bus
+  if (canvas_num == 1)
+    M5.Lcd.waitDMA();
+
+  M5Canvas *canvas = &tama_canvas[canvas_back];
+  tama_gfx = canvas;
+  composeTamaFrame();
+  tama_gfx = &M5.Lcd;
+
+  M5.Lcd.pushImageDMA(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, (lgfx::swap565_t *) canvas->getBuffer());
+  canvas_back = (canvas_back + 1) % canvas_num;
 }
 
+#else
+void displayTama()
+{
+  composeTamaFrame();
+}
+#endif
+#endif
 #else
 void drawTriangle(uint8_t x, uint8_t y)
 {
@@ -1054,15 +3367,17 @@ void drawTriangle(uint8_t x, uint8_t y)
 
 void drawTamaRow(uint8_t tamaLCD_y, uint8_t ActualLCD_y, uint8_t thick)
 {
-  uint8_t i;
-  for (i = 0; i < LCD_WIDTH; i++)
+  uint8_t b;
+  for (b = 0; b < LCD_WIDTH / 8; b++)
   {
-    uint8_t mask = 0b10000000;
-    mask = mask >> (i % 8);
-    if ((matrix_buffer[tamaLCD_y][i / 8] & mask) != 0)
-    {
-      display.drawBox(i + i + i + 16, ActualLCD_y, 2, thick);
-    }
+    // U8g2 has no pattern write, the cells of a run are still boxes of their own
+    uint8_t x0 = b * 24 + 16;
+    forEachSpan(matrix_buffer[tamaLCD_y][b], [&](uint8_t start, uint8_t cells) {
+      for (uint8_t x = x0 + start * 3; cells > 0; cells--, x += 3)
+      {
+        display.drawBox(x, ActualLCD_y, 2, thick);
+      }
+    });
   }
 }
 
@@ -1117,15 +3432,128 @@ uint8_t reverseBits(uint8_t num)
   return reverse_num;
 }
 
-void setup()
+#ifdef ENABLE_DEEPSLEEP_CATCH_UP
+// Run the emulated time missed while in deep sleep as fast as possible, silent and without drawing
+static void catch_up_after_deepsleep(void)
 {
-  Serial.begin(SERIAL_BAUD);
+  int64_t slept_us = wall_clock_us() - sleep_started_us;
+  bool woke_up = sleep_started_us != 0 && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+
+  sleep_started_us = 0;
+  if (!woke_up || slept_us <= 0)
+  {
+    return;
+  }
+  if (slept_us > CATCH_UP_MAX_SECONDS * 1000000LL)
+  {
+    slept_us = CATCH_UP_MAX_SECONDS * 1000000LL;
+  }
+
+  // 32768 Hz ticks, slowed down like the rest of the emulation
+  uint32_t ticks = (uint32_t)(slept_us * 32768 / 1000000 / SPEED_DIVIDER);
 
 #ifdef M5STICKC_PLUS2
-  M5.begin();
-  M5.Lcd.setRotation(3); // Landscape mode
-  
-  // 90s Retro Splash Screen
+  M5.Lcd.fillScreen(TFT_BLACK);
+  M5.Lcd.setTextColor(TFT_WHITE);
+  M5.Lcd.setTextSize(1);
+  M5.Lcd.drawString("Catching up...", 10, 60);
+#endif
+
+  unsigned long started = millis();
+  tamalib_register_hal(&headless_hal);
+  tamalib_set_speed(0);
+  while (ticks > 0)
+  {
+    uint32_t chunk = ticks < CATCH_UP_CHUNK_CYCLES ? ticks : CATCH_UP_CHUNK_CYCLES;
+    cpu_run_cycles(chunk);
+    ticks -= chunk;
+    headless_yield();
+  }
+#ifdef ENABLE_REAL_TIME_PACING
+  tamalib_set_speed(1); // Also rebases the pacing on the current time
+#endif
+  tamalib_register_hal(&hal);
+
+  Serial.print(F("Caught up "));
+  Serial.print((uint32_t)(slept_us / 1000));
+  Serial.print(F(" ms of sleep in "));
+  Serial.print(millis() - started);
+  Serial.println(F(" ms"));
+}
+#endif
+
+/***** Fast resume: the state stays in RTC memory across deep sleep, flash is only written on a schedule *****/
+#ifdef ENABLE_FAST_RESUME
+#if !defined(ESP32) || !defined(ENABLE_DEEPSLEEP) || !defined(ENABLE_LOAD_STATE_FROM_EEPROM)
+#error "ENABLE_FAST_RESUME requires ESP32, ENABLE_DEEPSLEEP and ENABLE_LOAD_STATE_FROM_EEPROM"
+#endif
+
+#ifndef FAST_RESUME_SAVE_SECONDS
+#define FAST_RESUME_SAVE_SECONDS (AUTO_SAVE_MINUTES * 60) // Of wall clock between two flash saves on the way to sleep
+#endif
+#define RESUME_MAGIC 0x54524553
+
+RTC_DATA_ATTR static uint32_t resume_magic = 0;
+RTC_DATA_ATTR static uint32_t resume_checksum = 0;
+RTC_DATA_ATTR static u8_t resume_state[CPU_PACKED_STATE_SIZE];
+RTC_DATA_ATTR static int64_t resume_saved_us = 0; // Wall clock of the last flash save, 0 for none
+
+// FNV-1a, RTC memory holds garbage after a power on and survives software resets
+static uint32_t resume_state_checksum(void)
+{
+  uint32_t h = 2166136261u;
+
+  for (uint16_t i = 0; i < CPU_PACKED_STATE_SIZE; i++)
+  {
+    h = (h ^ resume_state[i]) * 16777619u;
+  }
+  return h;
+}
+
+// A timer wakeup with a state left by save_resume_state()
+static bool fast_resume_available(void)
+{
+  return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && resume_magic == RESUME_MAGIC &&
+         resume_checksum == resume_state_checksum();
+}
+
+static void load_resume_state(void)
+{
+  cpu_unpack_state(resume_state);
+  resume_magic = 0; // Used once, a later reset goes back to the flash
+}
+
+// False if the state could not be taken, the caller then saves to flash as before
+static bool save_resume_state(void)
+{
+#ifdef ENABLE_DUAL_CORE
+  if (!take_snapshot())
+  {
+    return false;
+  }
+  memcpy(resume_state, snapshot_state, CPU_PACKED_STATE_SIZE);
+#else
+  cpu_pack_state(resume_state);
+#endif
+  resume_checksum = resume_state_checksum();
+  resume_magic = RESUME_MAGIC;
+
+  int64_t now = wall_clock_us();
+  if (resume_saved_us == 0 || now - resume_saved_us >= FAST_RESUME_SAVE_SECONDS * 1000000LL)
+  {
+    writeStateToEEPROM(resume_state);
+    resume_saved_us = now;
+  }
+  return true;
+}
+#else
+#define fast_resume_available() false
+#endif
+
+#ifdef M5STICKC_PLUS2
+// 90s Retro Splash Screen
+static void drawSplash()
+{
   M5.Lcd.fillScreen(TFT_BLACK);
   
   // Animated border
@@ -1159,6 +3587,23 @@ void setup()
   
   // Show controls briefly
   delay(4000);
+}
+#endif
+
+void setup()
+{
+  // Straight back to the emulation after a deep sleep, the log is read once it runs
+  bool resuming = fast_resume_available();
+
+  Serial.begin(SERIAL_BAUD);
+
+#ifdef M5STICKC_PLUS2
+  M5.begin();
+  M5.Lcd.setRotation(3); // Landscape mode
+  if (!resuming)
+  {
+    drawSplash();
+  }
 #else
   pinMode(PIN_BTN_L, INPUT);
   pinMode(PIN_BTN_M, INPUT);
@@ -1171,18 +3616,54 @@ void setup()
   display.begin();
 #endif
 
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  init_button_interrupts();
+#endif
+#ifdef ENABLE_AUDIO_ENGINE
+  init_audio_engine();
+#endif
   tamalib_register_hal(&hal);
   tamalib_set_framerate(TAMA_DISPLAY_FRAMERATE);
   tamalib_init(1000000);
+#ifdef ENABLE_REAL_TIME_PACING
+  tamalib_set_speed(1);
+#endif
+
+  // Report the RAM and boot time cost of the opcode decode tables
+  cpu_decode_info_t decodeInfo;
+  cpu_get_decode_info(&decodeInfo);
+  Serial.print(F("Decode table: "));
+  Serial.print(decodeInfo.decode_table_size);
+  Serial.print(F(" bytes, ROM cache: "));
+  Serial.print(decodeInfo.rom_cache_size);
+  Serial.print(F(" bytes, built in "));
+  Serial.print(decodeInfo.init_time * SPEED_DIVIDER);
+  Serial.println(F(" us"));
 
 #if defined(ENABLE_AUTO_SAVE_STATUS) || defined(ENABLE_LOAD_STATE_FROM_EEPROM)
-  initEEPROM();
+  if (!resuming)
+  {
+    initEEPROM();
+  }
 #endif
 
 #ifdef ENABLE_LOAD_STATE_FROM_EEPROM
+#ifdef ENABLE_FAST_RESUME
+  if (resuming)
+  {
+    load_resume_state();
+#ifdef ENABLE_DEEPSLEEP_CATCH_UP
+    catch_up_after_deepsleep();
+#endif
+  }
+  else
+#endif
   if (validEEPROM())
   {
-    loadStateFromEEPROM(&cpuState);
+    loadStateFromEEPROM();
+#ifdef ENABLE_DEEPSLEEP_CATCH_UP
+    catch_up_after_deepsleep();
+#endif
   }
   else
   {
@@ -1195,6 +3676,26 @@ void setup()
 #ifdef ENABLE_DUMP_STATE_TO_SERIAL_WHEN_START
   dumpStateToSerial();
 #endif
+
+#ifdef ENABLE_POWER_SCHEDULER
+  init_power_scheduler();
+#endif
+#ifdef ENABLE_REWIND
+  init_rewind();
+#endif
+
+#ifdef ENABLE_DUAL_CORE
+  // From now on only the emulation task touches the CPU state
+  xTaskCreatePinnedToCore(emulation_task, "tama_emu", TAMA_EMU_STACK_SIZE, NULL,
+                          TAMA_EMU_PRIORITY, NULL, TAMA_EMU_CORE);
+#endif
+
+#if defined(ENABLE_AUTO_SAVE_STATUS) || defined(ENABLE_LOAD_STATE_FROM_EEPROM)
+  if (resuming)
+  {
+    initEEPROM(); // Only needed by the next save
+  }
+#endif
 }
 
 uint32_t right_long_press_started = 0;
@@ -1203,18 +3704,137 @@ void upload_state()
 {
 }
 
+#if defined(ENABLE_AUTO_SAVE_STATUS) || defined(ENABLE_LOAD_STATE_FROM_EEPROM)
+static void save_state(void)
+{
+  PROF_BEGIN(PROF_SAVE);
+#ifdef ENABLE_DUAL_CORE
+  if (take_snapshot())
+  {
+    writeStateToEEPROM(snapshot_state);
+  }
+#else
+  saveStateToEEPROM();
+#endif
+  PROF_END(PROF_SAVE);
+}
+#endif
+
+#ifdef ENABLE_SAVE_SLOTS
+// Autosaves only hand the state over to the save task, enter_deepsleep() flushes it before sleeping
+static void save_state_in_background(void)
+{
+  PROF_BEGIN(PROF_SAVE);
+#ifdef ENABLE_DUAL_CORE
+  if (take_snapshot())
+  {
+    saveStateInBackground(snapshot_state);
+  }
+#else
+  static u8_t state[CPU_PACKED_STATE_SIZE];
+  cpu_pack_state(state);
+  saveStateInBackground(state);
+#endif
+  PROF_END(PROF_SAVE);
+}
+#endif
+
+#ifdef ENABLE_DUAL_CORE
+// Tones queued by hal_play_frequency(), unless the audio engine plays them
+static void play_queued_tones(void)
+{
+#ifndef ENABLE_AUDIO_ENGINE
+  uint32_t ev;
+
+  while (spsc_pop(&tone_queue, &ev))
+  {
+    play_frequency(ev >> 31, ev & 0x7FFFFFFF);
+  }
+#endif
+}
+
+// loop() body when the emulation runs in its own task
+static void ui_step(void)
+{
+  static unsigned long last_draw = 0;
+#ifdef ENABLE_POWER_SCHEDULER
+  int64_t start = esp_timer_get_time();
+#endif
+
+#ifdef ENABLE_TURBO_MODE
+  if (turbo_requested != 0)
+  {
+    // Headless, the display and the buttons wait until the turbo mode is left
+    poll_serial_input();
+    play_queued_tones();
+#ifdef ENABLE_POWER_SCHEDULER
+    power_step(esp_timer_get_time() - start, false);
+#else
+    delay(TAMA_UI_POLL_MS);
+#endif
+    return;
+  }
+#endif
+
+  poll_input();
+  play_queued_tones();
+
+  // New LCD frames are drawn right away, the effects keep animating at the frame rate
+  bool new_frame = fetch_frame();
+#ifdef ENABLE_POWER_SCHEDULER
+  uint32_t redraw_ms = power_redraw_ms(new_frame);
+#else
+  uint32_t redraw_ms = 1000 / TAMA_DISPLAY_FRAMERATE;
+#endif
+  if ((new_frame || (millis() - last_draw >= redraw_ms)) && !bannerShown())
+  {
+    last_draw = millis();
+    PROF_BEGIN(PROF_DISPLAY);
+    displayTama();
+    PROF_END(PROF_DISPLAY);
+  }
+
+#ifdef ENABLE_POWER_SCHEDULER
+  // The network, the speaker and a replay all need the cores awake
+  bool may_sleep = !tamaportal_active && !M5.Speaker.isPlaying();
+#ifdef ENABLE_INPUT_RECORD
+  may_sleep = may_sleep && !replay_running;
+#endif
+  power_step(esp_timer_get_time() - start, may_sleep);
+#else
+  delay(TAMA_UI_POLL_MS);
+#endif
+}
+#endif
+
 void enter_deepsleep(int _ms)
 {
 #ifndef ENABLE_DEEPSLEEP
   return;
 #endif
   // save CURRENT STATE
-  saveStateToEEPROM(&cpuState);
+#ifdef ENABLE_FAST_RESUME
+  if (!save_resume_state())
+  {
+    save_state();
+  }
+#else
+  save_state();
+#endif
+#ifdef ENABLE_SAVE_SLOTS
+  // The RTC copy may have skipped the flash, a background save must not be cut off by the sleep
+  flushBackgroundSave();
+#endif
+#ifdef ENABLE_DEEPSLEEP_CATCH_UP
+  sleep_started_us = wall_clock_us();
+#endif
 
 #ifdef M5STICKC_PLUS2
   M5.Lcd.fillScreen(TFT_BLACK);
   M5.Lcd.drawString("Deep Sleep...", 10, 60);
+#ifndef ENABLE_FAST_RESUME
   delay(1000);
+#endif
 #else
   //DISABLE DISPLAY
   display.clear();
@@ -1232,17 +3852,31 @@ void enter_deepsleep(int _ms)
 
 void loop()
 {
-  tamalib_mainloop_step_by_step();
+#ifdef ENABLE_DUAL_CORE
+  ui_step();
+#else
+  PROF_BEGIN(PROF_BURST);
+  tamalib_mainloop_burst(TAMA_BURST_CYCLES);
+  PROF_END(PROF_BURST);
+#endif
   
 #ifdef ENABLE_AUTO_SAVE_STATUS
   if ((millis() - lastSaveTimestamp) > (AUTO_SAVE_MINUTES * 60 * 1000))
   {
     lastSaveTimestamp = millis();
-    saveStateToEEPROM(&cpuState);
+#ifdef ENABLE_SAVE_SLOTS
+    save_state_in_background();
+#else
+    save_state();
+#endif
   }
 
 #ifdef M5STICKC_PLUS2
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  if (button_pressed[BTN_MIDDLE])
+#else
   if (M5.BtnB.isPressed())
+#endif
   {
     if (right_long_press_started == 0)
       right_long_press_started = millis();
@@ -1258,12 +3892,20 @@ void loop()
     right_long_press_started = 0;
   }
 
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  if (button_pressed_for(BTN_LEFT, 5000))
+#else
   if (M5.BtnA.pressedFor(5000))
+#endif
   {
     enter_deepsleep(DEEPSLEEP_INTERVAL * 1000);
   }
+#else
+#ifdef ENABLE_BUTTON_INTERRUPTS
+  if (button_pressed[BTN_MIDDLE])
 #else
   if (digitalRead(PIN_BTN_M) == BUTTON_VOLTAGE_LEVEL_PRESSED)
+#endif
   {
     if (millis() - right_long_press_started > AUTO_SAVE_MINUTES * 1000)
     {
@@ -0,0 +1,161 @@
+/*
+ * Ring of packed CPU states for the rewind console commands
+ *
+ * Records are never split: one that does not fit before the end of the
+ * data ring goes to offset 0, and the tail it skips is given up along with
+ * the oldest records still in it. Everything is plain memory, the ring is
+ * exercised on the host by bench/bench.c.
+ */
+#ifdef ENABLE_REWIND
+#include <string.h>
+
+#include "rewind_ring.h"
+
+void rewind_ring_init(rewind_ring_t *r, uint8_t *data, uint32_t data_size, rewind_entry_t *entries,
+		      uint32_t max_entries, uint16_t keyframe_every)
+{
+	memset(r, 0, sizeof(*r));
+	r->data = data;
+	r->data_size = data_size;
+	r->entries = entries;
+	r->max_entries = max_entries;
+	r->keyframe_every = keyframe_every;
+}
+
+rewind_entry_t *rewind_ring_entry(rewind_ring_t *r, uint32_t i)
+{
+	return &r->entries[(r->first + i) % r->max_entries];
+}
+
+/* Runs of state that differ from prev, -1 when not shorter than a keyframe */
+static int16_t encode_delta(rewind_ring_t *r, const u8_t *state)
+{
+	uint16_t size = 0;
+	uint16_t i = 0, start, end, j;
+
+	while (i < CPU_PACKED_STATE_SIZE) {
+		if (state[i] == r->prev[i]) {
+			i++;
+			continue;
+		}
+
+		/* Unchanged gaps shorter than a run header are cheaper to copy */
+		start = i;
+		end = i + 1;
+		for (j = end; j < CPU_PACKED_STATE_SIZE && j - end < REWIND_RUN_HEADER_SIZE && j - start < REWIND_RUN_MAX_LENGTH; j++) {
+			if (state[j] != r->prev[j]) {
+				end = j + 1;
+			}
+		}
+
+		if (size + REWIND_RUN_HEADER_SIZE + (end - start) >= CPU_PACKED_STATE_SIZE) {
+			return -1;
+		}
+		r->record[size++] = start & 0xFF;
+		r->record[size++] = start >> 8;
+		r->record[size++] = end - start;
+		memcpy(r->record + size, state + start, end - start);
+		size += end - start;
+		i = end;
+	}
+
+	return size;
+}
+
+static void apply_delta(u8_t *state, const uint8_t *p, uint16_t size)
+{
+	uint16_t offset;
+	uint8_t length;
+
+	while (size >= REWIND_RUN_HEADER_SIZE) {
+		offset = p[0] | (p[1] << 8);
+		length = p[2];
+
+		memcpy(state + offset, p + REWIND_RUN_HEADER_SIZE, length);
+		p += REWIND_RUN_HEADER_SIZE + length;
+		size -= REWIND_RUN_HEADER_SIZE + length;
+	}
+}
+
+/* Then the deltas left without their keyframe */
+static void drop_oldest(rewind_ring_t *r)
+{
+	do {
+		r->bytes -= rewind_ring_entry(r, 0)->size;
+		r->first = (r->first + 1) % r->max_entries;
+		r->num--;
+	} while (r->num != 0 && !rewind_ring_entry(r, 0)->keyframe);
+}
+
+static bool_t overlaps_oldest(rewind_ring_t *r, uint32_t offset, uint16_t size)
+{
+	rewind_entry_t *e = rewind_ring_entry(r, 0);
+
+	return e->offset < offset + size && offset < e->offset + e->size;
+}
+
+void rewind_ring_append(rewind_ring_t *r, const u8_t *state, u32_t tick)
+{
+	int16_t size = -1;
+	uint16_t room;
+	uint32_t offset;
+	rewind_entry_t *e;
+
+	if (r->num != 0 && r->since_key + 1 < r->keyframe_every) {
+		size = encode_delta(r, state);
+	}
+
+	room = (size < 0) ? CPU_PACKED_STATE_SIZE : size;
+	offset = (r->data_head + room > r->data_size) ? 0 : r->data_head;
+
+	/* On a wrap, the oldest records are the ones in the tail being skipped,
+	 * they go before the ones at offset 0 can be tested for overlap
+	 */
+	if (offset != r->data_head) {
+		while (r->num != 0 && rewind_ring_entry(r, 0)->offset >= r->data_head) {
+			drop_oldest(r);
+		}
+	}
+	while (r->num != 0 && (r->num == r->max_entries || overlaps_oldest(r, offset, room))) {
+		drop_oldest(r);
+	}
+	if (r->num == 0) {
+		size = -1;
+		room = CPU_PACKED_STATE_SIZE;
+		offset = 0;
+	}
+
+	e = rewind_ring_entry(r, r->num);
+	e->tick = tick;
+	e->offset = offset;
+	e->size = room;
+	e->keyframe = (size < 0);
+	memcpy(r->data + offset, (size < 0) ? state : r->record, room);
+
+	r->num++;
+	r->bytes += room;
+	r->data_head = offset + room;
+	r->since_key = e->keyframe ? 0 : r->since_key + 1;
+	memcpy(r->prev, state, CPU_PACKED_STATE_SIZE);
+}
+
+void rewind_ring_decode(rewind_ring_t *r, uint32_t i)
+{
+	uint32_t key = i, k;
+
+	while (!rewind_ring_entry(r, key)->keyframe) {
+		key--;
+	}
+	memcpy(r->prev, r->data + rewind_ring_entry(r, key)->offset, CPU_PACKED_STATE_SIZE);
+	for (k = key + 1; k <= i; k++) {
+		apply_delta(r->prev, r->data + rewind_ring_entry(r, k)->offset, rewind_ring_entry(r, k)->size);
+	}
+
+	while (r->num > i + 1) {
+		r->num--;
+		r->bytes -= rewind_ring_entry(r, r->num)->size;
+	}
+	r->data_head = rewind_ring_entry(r, i)->offset + rewind_ring_entry(r, i)->size;
+	r->since_key = i - key;
+}
+#endif
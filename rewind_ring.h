@@ -0,0 +1,65 @@
+/*
+ * Ring of packed CPU states for the rewind console commands, see rewind_ring.c
+ */
+#ifndef _REWIND_RING_H_
+#define _REWIND_RING_H_
+
+#include "cpu.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REWIND_RUN_HEADER_SIZE			3 // Offset (LE), length
+#define REWIND_RUN_MAX_LENGTH			255
+
+typedef struct {
+	u32_t tick;
+	uint32_t offset; // In data
+	uint16_t size;
+	bool_t keyframe;
+} rewind_entry_t;
+
+/*
+ * Each snapshot is a keyframe (the packed state) or a delta against the one
+ * before it, as the runs of bytes that changed, like the save log. Records
+ * are appended to the data ring and indexed in the entry ring, the oldest
+ * ones are dropped to make room, and the oldest one left is always a
+ * keyframe. The caller provides both buffers and serializes the calls.
+ */
+typedef struct {
+	uint8_t *data;
+	uint32_t data_size;
+	rewind_entry_t *entries;
+	uint32_t max_entries;
+	uint16_t keyframe_every; // Longest chain of deltas to apply is keyframe_every - 1
+
+	uint32_t first; // Index of the oldest entry
+	uint32_t num;
+	uint32_t data_head; // Where the next record goes
+	uint32_t bytes; // Of the records kept
+	uint16_t since_key;
+
+	u8_t prev[CPU_PACKED_STATE_SIZE]; // State of the newest entry
+	u8_t record[CPU_PACKED_STATE_SIZE];
+} rewind_ring_t;
+
+/* data_size must hold at least one keyframe */
+void rewind_ring_init(rewind_ring_t *r, uint8_t *data, uint32_t data_size, rewind_entry_t *entries,
+		      uint32_t max_entries, uint16_t keyframe_every);
+
+void rewind_ring_append(rewind_ring_t *r, const u8_t *state, u32_t tick);
+
+/* Entry i counts from the oldest one */
+rewind_entry_t *rewind_ring_entry(rewind_ring_t *r, uint32_t i);
+
+/* Rebuilds entry i into prev from the keyframe before it, then drops the
+ * entries after it, the next append follows it
+ */
+void rewind_ring_decode(rewind_ring_t *r, uint32_t i);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _REWIND_RING_H_ */
@@ -4,32 +4,643 @@
 #include "savestate.h"
 #include "hardcoded_state.h"
 
+/*
+ * Save image:
+ *   EEPROM_MAGIC_NUMBER, SAVE_FORMAT_VERSION, payload size (16-bit LE),
+ *   cpu_pack_state() payload, CRC-32 of everything before it (LE)
+ *
+ * Images saved before the format had a version (magic, then a raw
+ * cpu_state_t and the memory) are still loaded, and replaced by the
+ * next save.
+ */
+#define SAVE_HEADER_SIZE 4
+#define SAVE_IMAGE_SIZE (SAVE_HEADER_SIZE + CPU_PACKED_STATE_SIZE + 4)
+#define LEGACY_IMAGE_SIZE (1 + sizeof(cpu_state_t) + MEMORY_SIZE)
+#define EEPROM_IMAGE_SIZE (SAVE_IMAGE_SIZE > LEGACY_IMAGE_SIZE ? SAVE_IMAGE_SIZE : LEGACY_IMAGE_SIZE)
+
+#if defined(ENABLE_SAVE_SLOTS) && !defined(ENABLE_SAVE_LOG)
+#error "ENABLE_SAVE_SLOTS requires ENABLE_SAVE_LOG"
+#endif
+
+// Start from 0xFFFFFFFF and invert the result
+static uint32_t crc32Update(uint32_t crc, uint8_t v)
+{
+    // Bitwise, a table would cost 1 KB of RAM on AVR for a few hundred bytes per save
+    crc ^= v;
+    for (uint8_t k = 0; k < 8; k++)
+        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    return crc;
+}
+
+static bool hasImageHeader(const uint8_t *image)
+{
+    return image[0] == EEPROM_MAGIC_NUMBER && image[1] == SAVE_FORMAT_VERSION &&
+           (image[2] | (image[3] << 8)) == CPU_PACKED_STATE_SIZE;
+}
+
+// A corrupted image must not be mistaken for an old one
+static bool isLegacyImage(const uint8_t *image)
+{
+    return image[0] == EEPROM_MAGIC_NUMBER && !hasImageHeader(image);
+}
+
+#ifdef ENABLE_SAVE_LOG
+// Whole images are only staged in RAM with the save log, they are streamed to the EEPROM
+static uint32_t crc32(const uint8_t *p, uint16_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    while (size--)
+        crc = crc32Update(crc, *p++);
+    return ~crc;
+}
+
+static void sealImage(uint8_t *image)
+{
+    uint32_t crc;
+
+    image[0] = EEPROM_MAGIC_NUMBER;
+    image[1] = SAVE_FORMAT_VERSION;
+    image[2] = CPU_PACKED_STATE_SIZE & 0xFF;
+    image[3] = CPU_PACKED_STATE_SIZE >> 8;
+    crc = crc32(image, SAVE_IMAGE_SIZE - 4);
+    for (uint8_t i = 0; i < 4; i++)
+        image[SAVE_IMAGE_SIZE - 4 + i] = crc >> (i * 8);
+}
+
+static bool checkImage(const uint8_t *image)
+{
+    uint32_t crc = 0;
+
+    if (!hasImageHeader(image))
+        return false;
+    for (uint8_t i = 0; i < 4; i++)
+        crc |= (uint32_t)image[SAVE_IMAGE_SIZE - 4 + i] << (i * 8);
+    return crc == crc32(image, SAVE_IMAGE_SIZE - 4);
+}
+#endif
+
+// Only portable between builds with the same cpu_state_t layout, as it always was
+static void loadLegacyImage()
+{
+    cpu_state_t cpuState;
+    cpu_get_state(&cpuState);
+    u4_t *memTemp = cpuState.memory;
+    EEPROM.get(1, cpuState);
+    cpuState.memory = memTemp;
+    // Before cpu_set_state(), which copies memory in with ENABLE_UNPACKED_RAM
+    for (uint16_t i = 0; i < MEMORY_SIZE; i++)
+    {
+        memTemp[i] = EEPROM.read(1 + sizeof(cpu_state_t) + i);
+    }
+    cpu_set_state(&cpuState);
+    Serial.println(F("Loaded a save from before the versioned format"));
+}
+
+#ifdef ENABLE_SAVE_LOG
+#ifndef ESP32
+#error "ENABLE_SAVE_LOG requires ESP32 (LittleFS)"
+#endif
+#include <LittleFS.h>
+
+/*
+ * Append-only save log: a full image, then one record per save with only
+ * the bytes that changed since the previous one. Loading replays the log,
+ * it is compacted back into a single full image once it grows too large,
+ * and the log before that is kept as a B copy.
+ * The images are the same as in the EEPROM.
+ *
+ * Record: type, payload size (16-bit LE), payload, 8-bit sum of the payload
+ * Delta payload: runs of offset (16-bit LE), length, new bytes
+ */
+#ifndef SAVE_LOG_MAX_SIZE
+#define SAVE_LOG_MAX_SIZE 8192
+#endif
+#define SAVE_LOG_PATH "/tama_state.log"
+#define SAVE_LOG_TMP_PATH "/tama_state.tmp"
+#define SAVE_LOG_BAK_PATH "/tama_state.bak"
+
+#define RECORD_FULL 'F'
+#define RECORD_DELTA 'D'
+#define RECORD_HEADER_SIZE 3
+#define RUN_HEADER_SIZE 3
+#define RUN_MAX_LENGTH 255
+
+static uint8_t shadow[SAVE_IMAGE_SIZE]; // Last persisted image
+static uint8_t image[SAVE_IMAGE_SIZE];
+static uint8_t record[RECORD_HEADER_SIZE + SAVE_IMAGE_SIZE + 1];
+
+static uint8_t checksum(const uint8_t *p, uint16_t size)
+{
+    uint8_t sum = 0;
+    while (size--)
+        sum += *p++;
+    return sum;
+}
+
+// Runs of changed bytes from shadow to image into out, -1 when the full image is not larger
+static int16_t encodeDelta(uint8_t *out)
+{
+    uint16_t size = 0;
+    uint16_t i = 0;
+
+    while (i < SAVE_IMAGE_SIZE)
+    {
+        if (image[i] == shadow[i])
+        {
+            i++;
+            continue;
+        }
+
+        // Unchanged gaps shorter than a run header are cheaper to rewrite
+        uint16_t start = i, end = i + 1;
+        for (uint16_t j = end; j < SAVE_IMAGE_SIZE && j - end < RUN_HEADER_SIZE && j - start < RUN_MAX_LENGTH; j++)
+        {
+            if (image[j] != shadow[j])
+                end = j + 1;
+        }
+
+        if (size + RUN_HEADER_SIZE + (end - start) >= SAVE_IMAGE_SIZE)
+            return -1;
+        out[size++] = start & 0xFF;
+        out[size++] = start >> 8;
+        out[size++] = end - start;
+        memcpy(out + size, image + start, end - start);
+        size += end - start;
+        i = end;
+    }
+
+    return size;
+}
+
+static bool applyDelta(const uint8_t *p, uint16_t size)
+{
+    while (size >= RUN_HEADER_SIZE)
+    {
+        uint16_t offset = p[0] | (p[1] << 8);
+        uint8_t length = p[2];
+
+        if (size - RUN_HEADER_SIZE < length || offset + length > SAVE_IMAGE_SIZE)
+            return false;
+        memcpy(shadow + offset, p + RUN_HEADER_SIZE, length);
+        p += RUN_HEADER_SIZE + length;
+        size -= RUN_HEADER_SIZE + length;
+    }
+    return size == 0;
+}
+
+static bool writeRecord(File &f, uint8_t type, uint16_t size)
+{
+    record[0] = type;
+    record[1] = size & 0xFF;
+    record[2] = size >> 8;
+    record[RECORD_HEADER_SIZE + size] = checksum(record + RECORD_HEADER_SIZE, size);
+    return f.write(record, RECORD_HEADER_SIZE + size + 1) == RECORD_HEADER_SIZE + size + 1;
+}
+
+// Rebuild shadow from a log, false if some records could not be read back
+static bool replayLog(const char *path, bool *loaded)
+{
+    File f = LittleFS.open(path, "r");
+    bool has_base = false;
+    bool clean = false;
+
+    *loaded = false;
+    if (!f)
+        return true;
+
+    for (;;)
+    {
+        size_t n = f.read(record, RECORD_HEADER_SIZE);
+        uint16_t size;
+
+        if (n != RECORD_HEADER_SIZE)
+        {
+            clean = (n == 0);
+            break;
+        }
+        size = record[1] | (record[2] << 8);
+        if (size > SAVE_IMAGE_SIZE || f.read(record + RECORD_HEADER_SIZE, size + 1) != size + 1u ||
+            checksum(record + RECORD_HEADER_SIZE, size) != record[RECORD_HEADER_SIZE + size])
+            break; // Torn write, the records before it are still good
+        if (record[0] == RECORD_FULL && size == SAVE_IMAGE_SIZE)
+        {
+            memcpy(shadow, record + RECORD_HEADER_SIZE, SAVE_IMAGE_SIZE);
+            has_base = true;
+        }
+        else if (record[0] != RECORD_DELTA || !has_base || !applyDelta(record + RECORD_HEADER_SIZE, size))
+            break;
+    }
+    f.close();
+
+    *loaded = has_base && checkImage(shadow);
+    return clean;
+}
+
+/*
+ * Start a new log from a full image of shadow. The previous log is kept as
+ * the B copy, and as each rename is atomic, a power cut at any point still
+ * leaves one of the log, the new image or the B copy to load.
+ */
+static bool compactLog()
+{
+    File f = LittleFS.open(SAVE_LOG_TMP_PATH, "w");
+    bool ok;
+
+    if (!f)
+        return false;
+    memcpy(record + RECORD_HEADER_SIZE, shadow, SAVE_IMAGE_SIZE);
+    ok = writeRecord(f, RECORD_FULL, SAVE_IMAGE_SIZE);
+    f.close();
+    if (!ok)
+        return false;
+
+    LittleFS.rename(SAVE_LOG_PATH, SAVE_LOG_BAK_PATH); // Fails when there is no log yet
+    return LittleFS.rename(SAVE_LOG_TMP_PATH, SAVE_LOG_PATH);
+}
+
+// The state of a device saved before the log existed is moved over once
+static void importEEPROM()
+{
+    EEPROM.begin(EEPROM_IMAGE_SIZE);
+    EEPROM.get(0, shadow);
+    if (isLegacyImage(shadow))
+    {
+        loadLegacyImage();
+        cpu_pack_state(shadow + SAVE_HEADER_SIZE);
+        sealImage(shadow);
+    }
+    if (checkImage(shadow) && compactLog())
+    {
+        EEPROM.write(0, 0);
+        EEPROM.commit();
+        Serial.println(F("Save state moved from EEPROM to the save log"));
+    }
+    EEPROM.end();
+}
+
+static void writeImage()
+{
+    int16_t size;
+    File f;
+
+    sealImage(image);
+
+    if (!checkImage(shadow))
+    {
+        // Nothing to diff against, start a new log
+        memcpy(shadow, image, SAVE_IMAGE_SIZE);
+        compactLog();
+        return;
+    }
+
+    size = encodeDelta(record + RECORD_HEADER_SIZE);
+    if (size == 0)
+        return;
+
+    f = LittleFS.open(SAVE_LOG_PATH, FILE_APPEND);
+    if (!f)
+        return;
+    uint8_t type = RECORD_DELTA;
+    if (size < 0)
+    {
+        memcpy(record + RECORD_HEADER_SIZE, image, SAVE_IMAGE_SIZE);
+        type = RECORD_FULL;
+        size = SAVE_IMAGE_SIZE;
+    }
+    bool ok = writeRecord(f, type, size);
+    bool full = f.size() > SAVE_LOG_MAX_SIZE;
+    f.close();
+    memcpy(shadow, image, SAVE_IMAGE_SIZE);
+
+    // A short write would hide every later record from replayLog()
+    if (!ok || full)
+        compactLog();
+
+#ifdef ENABLE_DUMP_STATE_TO_SERIAL_WHEN_START
+    Serial.print(F("Saved "));
+    Serial.print(RECORD_HEADER_SIZE + size + 1);
+    Serial.println(F(" bytes"));
+#endif
+}
+
+#ifdef ENABLE_SAVE_SLOTS
+#include <time.h>
+
+/*
+ * Snapshot ring: every SAVE_SLOT_EVERY background saves, the full image is
+ * also written to the next of SAVE_SLOT_NUM slot files, after a sequence
+ * number and a time() stamp (8 bytes, LE). Slot files are replaced with a
+ * rename too. Background saves are written by a task of their own.
+ */
+#ifndef SAVE_SLOT_EVERY
+#define SAVE_SLOT_EVERY 15 // 30 minutes with AUTO_SAVE_MINUTES=2
+#endif
+#define SAVE_SLOT_HEADER_SIZE 8
+#define SAVE_SLOT_TMP_PATH "/tama_slot.tmp" // Not SAVE_LOG_TMP_PATH, initEEPROM() would take it for a log
+#define SAVE_TASK_STACK_SIZE 4096
+#define SAVE_TASK_PRIORITY 1
+
+static SemaphoreHandle_t fs_mutex = NULL;      // Taken around every access to the files and the buffers above
+static portMUX_TYPE pending_mux = portMUX_INITIALIZER_UNLOCKED;
+static uint8_t pending_state[CPU_PACKED_STATE_SIZE];
+static bool pending = false;
+static TaskHandle_t save_task = NULL;
+static uint32_t slot_seq = 0; // Of the last slot written
+static uint8_t saves_since_slot = 0;
+
+#define FS_LOCK()   xSemaphoreTake(fs_mutex, portMAX_DELAY)
+#define FS_UNLOCK() xSemaphoreGive(fs_mutex)
+
+static void slotPath(char *path, uint8_t slot)
+{
+    sprintf(path, "/tama_slot%u.bin", slot);
+}
+
+static bool readSlotHeader(uint8_t slot, save_slot_info_t *info)
+{
+    char path[20];
+    uint8_t header[SAVE_SLOT_HEADER_SIZE];
+
+    slotPath(path, slot);
+    File f = LittleFS.open(path, "r");
+    if (!f)
+        return false;
+    bool ok = f.read(header, SAVE_SLOT_HEADER_SIZE) == SAVE_SLOT_HEADER_SIZE;
+    f.close();
+
+    info->seq = header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    info->time = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+    return ok;
+}
+
+// Image already sealed in image[]
+static void writeSlot()
+{
+    uint32_t seq = slot_seq + 1;
+    uint32_t now = time(NULL);
+    uint8_t header[SAVE_SLOT_HEADER_SIZE];
+    char path[20];
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        header[i] = seq >> (i * 8);
+        header[4 + i] = now >> (i * 8);
+    }
+
+    File f = LittleFS.open(SAVE_SLOT_TMP_PATH, "w");
+    if (!f)
+        return;
+    bool ok = f.write(header, SAVE_SLOT_HEADER_SIZE) == SAVE_SLOT_HEADER_SIZE &&
+              f.write(image, SAVE_IMAGE_SIZE) == SAVE_IMAGE_SIZE;
+    f.close();
+
+    slotPath(path, seq % SAVE_SLOT_NUM);
+    if (ok && LittleFS.rename(SAVE_SLOT_TMP_PATH, path))
+        slot_seq = seq;
+}
+
+// With fs_mutex taken
+static void writePendingSave()
+{
+    portENTER_CRITICAL(&pending_mux);
+    bool has_state = pending;
+    memcpy(image + SAVE_HEADER_SIZE, pending_state, CPU_PACKED_STATE_SIZE);
+    pending = false;
+    portEXIT_CRITICAL(&pending_mux);
+
+    if (has_state)
+    {
+        writeImage();
+        if (++saves_since_slot >= SAVE_SLOT_EVERY)
+        {
+            saves_since_slot = 0;
+            writeSlot();
+        }
+    }
+}
+
+static void saveTask(void *arg)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        FS_LOCK();
+        writePendingSave();
+        FS_UNLOCK();
+    }
+}
+
+// A synchronous save or an erase supersedes the background save not started yet
+static void dropPendingSave()
+{
+    portENTER_CRITICAL(&pending_mux);
+    pending = false;
+    portEXIT_CRITICAL(&pending_mux);
+}
+
+void saveStateInBackground(const uint8_t *packedState)
+{
+    if (save_task == NULL)
+        return;
+
+    portENTER_CRITICAL(&pending_mux);
+    memcpy(pending_state, packedState, CPU_PACKED_STATE_SIZE);
+    pending = true;
+    portEXIT_CRITICAL(&pending_mux);
+    xTaskNotifyGive(save_task);
+}
+
+void flushBackgroundSave()
+{
+    if (save_task == NULL)
+        return;
+
+    FS_LOCK();
+    writePendingSave();
+    FS_UNLOCK();
+}
+
+bool getSaveSlotInfo(uint8_t slot, save_slot_info_t *info)
+{
+    FS_LOCK();
+    bool ok = readSlotHeader(slot, info);
+    FS_UNLOCK();
+    return ok;
+}
+
+bool loadStateFromSlot(uint8_t slot, uint8_t *packedState)
+{
+    char path[20];
+    bool ok = false;
+
+    slotPath(path, slot);
+    FS_LOCK();
+    File f = LittleFS.open(path, "r");
+    if (f)
+    {
+        // record[] is free outside of a save
+        ok = f.seek(SAVE_SLOT_HEADER_SIZE) && f.read(record, SAVE_IMAGE_SIZE) == SAVE_IMAGE_SIZE && checkImage(record);
+        f.close();
+    }
+    if (ok)
+        memcpy(packedState, record + SAVE_HEADER_SIZE, CPU_PACKED_STATE_SIZE);
+    FS_UNLOCK();
+    return ok;
+}
+
+static void initSaveSlots()
+{
+    save_slot_info_t info;
+
+    for (uint8_t i = 0; i < SAVE_SLOT_NUM; i++)
+    {
+        if (readSlotHeader(i, &info) && info.seq > slot_seq)
+            slot_seq = info.seq;
+    }
+
+    xTaskCreate(saveTask, "tama_save", SAVE_TASK_STACK_SIZE, NULL, SAVE_TASK_PRIORITY, &save_task);
+}
+#else
+#define FS_LOCK()
+#define FS_UNLOCK()
+#define dropPendingSave()
+#endif
+
+void initEEPROM()
+{
+    // Most recent first, see compactLog()
+    static const char *const logs[] = {SAVE_LOG_PATH, SAVE_LOG_TMP_PATH, SAVE_LOG_BAK_PATH};
+    bool loaded = false;
+
+#ifdef ENABLE_SAVE_SLOTS
+    fs_mutex = xSemaphoreCreateMutex();
+#endif
+    if (!LittleFS.begin(true))
+    {
+        Serial.println(F("LittleFS mount failed, state will not be saved"));
+        return;
+    }
+
+    for (uint8_t i = 0; i < sizeof(logs) / sizeof(logs[0]) && !loaded; i++)
+    {
+        memset(shadow, 0, sizeof(shadow));
+        bool clean = replayLog(logs[i], &loaded);
+        if (loaded && i != 0)
+        {
+            // Do not let the broken log replace the good B copy
+            LittleFS.remove(SAVE_LOG_PATH);
+            Serial.print(F("Save log recovered from "));
+            Serial.println(logs[i]);
+        }
+        if (loaded && (i != 0 || !clean))
+            compactLog(); // Drop the unreadable tail before appending to it
+    }
+    if (!loaded)
+    {
+        memset(shadow, 0, sizeof(shadow));
+        importEEPROM();
+    }
+
+#ifdef ENABLE_SAVE_SLOTS
+    initSaveSlots();
+#endif
+}
+
+bool validEEPROM()
+{
+    return checkImage(shadow);
+}
+
+void loadStateFromEEPROM()
+{
+    cpu_unpack_state(shadow + SAVE_HEADER_SIZE);
+}
+
+void eraseStateFromEEPROM() {
+    dropPendingSave();
+    FS_LOCK();
+    LittleFS.remove(SAVE_LOG_PATH);
+    LittleFS.remove(SAVE_LOG_BAK_PATH);
+    memset(shadow, 0, sizeof(shadow));
+    FS_UNLOCK();
+}
+
+void saveStateToEEPROM()
+{
+    dropPendingSave();
+    FS_LOCK();
+    cpu_pack_state(image + SAVE_HEADER_SIZE);
+    writeImage();
+    FS_UNLOCK();
+}
+
+void writeStateToEEPROM(const uint8_t *packedState)
+{
+    dropPendingSave();
+    FS_LOCK();
+    memcpy(image + SAVE_HEADER_SIZE, packedState, CPU_PACKED_STATE_SIZE);
+    writeImage();
+    FS_UNLOCK();
+}
+#else
 void initEEPROM()
 {
 #if defined(ESP8266) || defined(ESP32)
-    EEPROM.begin(1 + sizeof(cpu_state_t) + MEMORY_SIZE);
+    EEPROM.begin(EEPROM_IMAGE_SIZE);
 #endif
 }
 
+// The EEPROM image is read and written one byte at a time, AVR has no RAM for a whole one
+static void readImageHeader(uint8_t *header)
+{
+    for (uint8_t i = 0; i < SAVE_HEADER_SIZE; i++)
+        header[i] = EEPROM.read(i);
+}
+
+static bool checkEEPROMImage()
+{
+    uint8_t header[SAVE_HEADER_SIZE];
+    uint32_t crc = 0xFFFFFFFF;
+    uint32_t stored = 0;
+
+    readImageHeader(header);
+    if (!hasImageHeader(header))
+        return false;
+    for (uint16_t i = 0; i < SAVE_IMAGE_SIZE - 4; i++)
+        crc = crc32Update(crc, EEPROM.read(i));
+    for (uint8_t i = 0; i < 4; i++)
+        stored |= (uint32_t)EEPROM.read(SAVE_IMAGE_SIZE - 4 + i) << (i * 8);
+    return stored == ~crc;
+}
+
 bool validEEPROM()
 {
-    return EEPROM.read(0) == EEPROM_MAGIC_NUMBER;
+    uint8_t header[SAVE_HEADER_SIZE];
+
+    readImageHeader(header);
+    return checkEEPROMImage() || isLegacyImage(header);
 }
 
-void loadStateFromEEPROM(cpu_state_t* cpuState)
+void loadStateFromEEPROM()
 {
-    cpu_get_state(cpuState);
-    u4_t *memTemp = cpuState->memory;
-    EEPROM.get(1, *cpuState);
-    cpu_set_state(cpuState);
-    uint32_t i = 0;
-    for (i = 0; i < MEMORY_SIZE; i++)
+    uint8_t header[SAVE_HEADER_SIZE];
+    uint8_t regs[CPU_PACKED_REGS_SIZE];
+
+    readImageHeader(header);
+    if (checkEEPROMImage())
     {
-        memTemp[i] = EEPROM.read(1 + sizeof(cpu_state_t) + i);
+        for (uint8_t i = 0; i < CPU_PACKED_REGS_SIZE; i++)
+            regs[i] = EEPROM.read(SAVE_HEADER_SIZE + i);
+        cpu_unpack_regs(regs);
+        for (uint16_t i = 0; i < MEMORY_SIZE; i++)
+            cpu_set_packed_ram(i, EEPROM.read(SAVE_HEADER_SIZE + CPU_PACKED_REGS_SIZE + i));
     }
+    else if (isLegacyImage(header))
+        loadLegacyImage();
 #ifdef ENABLE_DUMP_STATE_TO_SERIAL_WHEN_START    
     Serial.print(F("Loaded "));
-    Serial.print(1 + sizeof(cpu_state_t) + MEMORY_SIZE);
+    Serial.print(SAVE_IMAGE_SIZE);
     Serial.println(F(" bytes"));
 #endif
 }
@@ -42,28 +653,45 @@ void eraseStateFromEEPROM() {
 #endif
 }
 
-void saveStateToEEPROM(cpu_state_t* cpuState)
+static void writeEEPROMByte(uint16_t i, uint8_t v)
 {
-    uint32_t i = 0;
-    if (EEPROM.read(0) != EEPROM_MAGIC_NUMBER)
-        eraseStateFromEEPROM();
-
-#if defined(ESP8266) || defined(ESP32)
-    EEPROM.write(0, EEPROM_MAGIC_NUMBER);
+#ifdef __AVR__
+    EEPROM.update(i, v); // Only rewrites the bytes that changed
 #else
-    EEPROM.update(0, EEPROM_MAGIC_NUMBER);
+    EEPROM.write(i, v);
 #endif
+}
+
+// packedState NULL: the running state, packed on the way
+static void writeImage(const uint8_t *packedState)
+{
+    const uint8_t header[SAVE_HEADER_SIZE] = {EEPROM_MAGIC_NUMBER, SAVE_FORMAT_VERSION, CPU_PACKED_STATE_SIZE & 0xFF,
+                                              CPU_PACKED_STATE_SIZE >> 8};
+    uint8_t regs[CPU_PACKED_REGS_SIZE];
+    uint32_t crc = 0xFFFFFFFF;
+
+    if (packedState == NULL)
+        cpu_pack_regs(regs);
 
-    cpu_get_state(cpuState);
-    EEPROM.put(1, *cpuState);
-    for (i = 0; i < MEMORY_SIZE; i++)
+    for (uint16_t i = 0; i < SAVE_IMAGE_SIZE - 4; i++)
     {
-#if defined(ESP8266) || defined(ESP32)
-        EEPROM.write(1 + sizeof(cpu_state_t) + i, cpuState->memory[i]);
-#else
-        EEPROM.update(1 + sizeof(cpu_state_t) + i, cpuState->memory[i]);
-#endif
+        uint16_t n = i - SAVE_HEADER_SIZE;
+        uint8_t v;
+
+        if (i < SAVE_HEADER_SIZE)
+            v = header[i];
+        else if (packedState != NULL)
+            v = packedState[n];
+        else if (n < CPU_PACKED_REGS_SIZE)
+            v = regs[n];
+        else
+            v = cpu_get_packed_ram(n - CPU_PACKED_REGS_SIZE);
+        crc = crc32Update(crc, v);
+        writeEEPROMByte(i, v);
     }
+    crc = ~crc;
+    for (uint8_t i = 0; i < 4; i++)
+        writeEEPROMByte(SAVE_IMAGE_SIZE - 4 + i, crc >> (i * 8));
 
 #if defined(ESP8266) || defined(ESP32)
     EEPROM.commit();
@@ -71,11 +699,22 @@ void saveStateToEEPROM(cpu_state_t* cpuState)
 
 #ifdef ENABLE_DUMP_STATE_TO_SERIAL_WHEN_START    
     Serial.print(F("Saved "));
-    Serial.print(1 + sizeof(cpu_state_t) + MEMORY_SIZE);
+    Serial.print(SAVE_IMAGE_SIZE);
     Serial.println(F(" bytes"));
 #endif
 }
 
+void saveStateToEEPROM()
+{
+    writeImage(NULL);
+}
+
+void writeStateToEEPROM(const uint8_t *packedState)
+{
+    writeImage(packedState);
+}
+#endif
+
 void loadHardcodedState(cpu_state_t* cpuState)
 {
   cpu_get_state(cpuState);
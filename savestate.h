@@ -1,15 +1,35 @@
 #pragma once
 
 #define EEPROM_MAGIC_NUMBER 0x12
+#define SAVE_FORMAT_VERSION CPU_PACKED_STATE_VERSION
 
 void initEEPROM();
 
 bool validEEPROM();
 
-void loadStateFromEEPROM(cpu_state_t* cpuState);
+void loadStateFromEEPROM();
 
 void eraseStateFromEEPROM();
 
-void saveStateToEEPROM(cpu_state_t* cpuState);
+void saveStateToEEPROM();
 
-void loadHardcodedState(cpu_state_t* cpuState);
\ No newline at end of file
+void writeStateToEEPROM(const uint8_t *packedState); // CPU_PACKED_STATE_SIZE bytes from cpu_pack_state()
+
+void loadHardcodedState(cpu_state_t* cpuState);
+
+#ifdef ENABLE_SAVE_SLOTS
+#define SAVE_SLOT_NUM 4
+
+typedef struct {
+    uint32_t seq;  // Slots are written in sequence, the highest is the most recent
+    uint32_t time; // time() of the save, counts from boot when the clock was never set
+} save_slot_info_t;
+
+void saveStateInBackground(const uint8_t *packedState); // Returns at once, a task writes the save
+
+void flushBackgroundSave(); // Waits for the save being written and writes the pending one, before a deep sleep
+
+bool getSaveSlotInfo(uint8_t slot, save_slot_info_t *info);
+
+bool loadStateFromSlot(uint8_t slot, uint8_t *packedState);
+#endif
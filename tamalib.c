@@ -17,6 +17,7 @@
  * along with this program; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
  */
+#include <string.h>
 #include "tamalib.h"
 #include "hw.h"
 #include "cpu.h"
@@ -24,29 +25,41 @@
 
 #define DEFAULT_FRAMERATE				3// fps
 
-static exec_mode_t exec_mode = EXEC_MODE_RUN;
+tamalib_t g_tamalib = {
+	.cpu.hw = &g_tamalib.hw,
+	.hw.cpu = &g_tamalib.cpu,
+	.exec_mode = EXEC_MODE_RUN,
+	.framerate = DEFAULT_FRAMERATE,
+};
 
-static u32_t step_depth = 0;
 
-static timestamp_t screen_ts = 0;
-
-static u32_t ts_freq;
+bool_t tamalib_init_ctx(tamalib_t *t, hal_t *hal, u32_t freq)
+{
+	bool_t res = 0;
 
-static u8_t g_framerate = DEFAULT_FRAMERATE;
+	memset(t, 0, sizeof(tamalib_t));
+	t->cpu.hw = &t->hw;
+	t->hw.cpu = &t->cpu;
+	tamalib_register_hal_ctx(t, hal);
+	t->exec_mode = EXEC_MODE_RUN;
+	t->framerate = DEFAULT_FRAMERATE;
+	t->ts_freq = freq;
 
-hal_t *g_hal;
+	res |= cpu_init_ctx(&t->cpu, freq);
+	res |= hw_init_ctx(&t->hw);
 
+	return res;
+}
 
 bool_t tamalib_init(u32_t freq)
 //bool_t tamalib_init(breakpoint_t *breakpoints, u32_t freq)
 {
-	bool_t res = 0;
-  res |= cpu_init( freq);
-
-//	res |= cpu_init(program, breakpoints, freq);
-	res |= hw_init();
+	/* The framerate can be set before */
+	u8_t framerate = g_tamalib.framerate;
+	bool_t res;
 
-	ts_freq = freq;
+	res = tamalib_init_ctx(&g_tamalib, g_tamalib.hal, freq);
+	g_tamalib.framerate = framerate;
 
 	return res;
 }
@@ -59,9 +72,14 @@ void tamalib_release(void)
 }*/
 
 
+void tamalib_set_framerate_ctx(tamalib_t *t, u8_t framerate)
+{
+	t->framerate = framerate;
+}
+
 void tamalib_set_framerate(u8_t framerate)
 {
-	g_framerate = framerate;
+	tamalib_set_framerate_ctx(&g_tamalib, framerate);
 }
 /*
 u8_t tamalib_get_framerate(void)
@@ -71,9 +89,16 @@ u8_t tamalib_get_framerate(void)
   return DEFAULT_FRAMERATE;
 }
 */
+void tamalib_register_hal_ctx(tamalib_t *t, hal_t *hal)
+{
+	t->hal = hal;
+	t->cpu.hal = hal;
+	t->hw.hal = hal;
+}
+
 void tamalib_register_hal(hal_t *hal)
 {
-	g_hal = hal;
+	tamalib_register_hal_ctx(&g_tamalib, hal);
 }
 /*
 void tamalib_set_exec_mode(exec_mode_t mode)
@@ -144,28 +169,140 @@ void tamalib_mainloop(void)
 	}
 } */
 
-void tamalib_mainloop_step_by_step(void)
+static void update_screen_if_needed(tamalib_t *t)
 {
   timestamp_t ts;
 
-  if (!g_hal->handler()) {
+  /* Update the screen @ framerate fps */
+  ts = t->hal->get_timestamp();
+
+  if (ts - t->screen_ts >= t->ts_freq/t->framerate) {
+  //if (ts - screen_ts >= ts_freq/DEFAULT_FRAMERATE) {
+    t->screen_ts = ts;
+#ifdef LCD_FRAMEBUFFER
+    hw_publish_frame_ctx(&t->hw);
+#endif
+    t->hal->update_screen();
+  }
+}
+
+void tamalib_mainloop_step_by_step_ctx(tamalib_t *t)
+{
+  if (!t->hal->handler()) {
     //tamalib_step();
 
-    if (exec_mode == EXEC_MODE_RUN) {
-      if (cpu_step()) {
-        exec_mode = EXEC_MODE_PAUSE;
-        step_depth = cpu_get_depth();
+    if (t->exec_mode == EXEC_MODE_RUN) {
+      if (cpu_step_ctx(&t->cpu)) {
+        t->exec_mode = EXEC_MODE_PAUSE;
+        t->step_depth = cpu_get_depth_ctx(&t->cpu);
       }
     }
 
+    update_screen_if_needed(t);
+  }
+}
 
-    /* Update the screen @ g_framerate fps */
-    ts = g_hal->get_timestamp();
-    
-    if (ts - screen_ts >= ts_freq/g_framerate) {
-    //if (ts - screen_ts >= ts_freq/DEFAULT_FRAMERATE) {
-      screen_ts = ts;
-      g_hal->update_screen();
+void tamalib_mainloop_step_by_step(void)
+{
+  tamalib_mainloop_step_by_step_ctx(&g_tamalib);
+}
+
+void tamalib_mainloop_burst_ctx(tamalib_t *t, u32_t cycles)
+{
+  if (!t->hal->handler()) {
+    if (t->exec_mode == EXEC_MODE_RUN) {
+      if (cpu_run_cycles_ctx(&t->cpu, cycles)) {
+        t->exec_mode = EXEC_MODE_PAUSE;
+        t->step_depth = cpu_get_depth_ctx(&t->cpu);
+      }
     }
+
+    update_screen_if_needed(t);
   }
 }
+
+void tamalib_mainloop_burst(u32_t cycles)
+{
+  tamalib_mainloop_burst_ctx(&g_tamalib, cycles);
+}
+
+#ifdef ENABLE_INPUT_RECORD
+int tamalib_replay_ctx(tamalib_t *t, const input_event_t *events, u32_t num, u32_t end_tick)
+{
+	u32_t i = 0;
+	u32_t until;
+	int32_t left;
+
+	for (;;) {
+		until = (i < num) ? events[i].tick : end_tick;
+		left = (int32_t) (until - cpu_get_tick_count_ctx(&t->cpu));
+
+		/* Stops on the first instruction boundary at or after until, the one the event was recorded at */
+		if (left > 0) {
+			/* An unknown opcode does not advance the ticks */
+			if (cpu_run_cycles_ctx(&t->cpu, left)) {
+				return 1;
+			}
+			continue;
+		}
+
+		if (i == num) {
+			break;
+		}
+		hw_set_button_ctx(&t->hw, (button_t) events[i].btn, (btn_state_t) events[i].state);
+		i++;
+	}
+
+	return 0;
+}
+#endif
+
+static void hash_u32(uint64_t *h, u32_t v)
+{
+	*h = (*h ^ v) * 1099511628211ULL;
+}
+
+uint64_t tamalib_get_state_hash_ctx(tamalib_t *t)
+{
+	cpu_state_t state;
+	uint64_t h = 14695981039346656037ULL;
+#ifdef LCD_FRAMEBUFFER
+	lcd_frame_t frame;
+#endif
+	uint16_t i;
+
+	cpu_get_state_ctx(&t->cpu, &state);
+	hash_u32(&h, state.pc);
+	hash_u32(&h, state.x);
+	hash_u32(&h, state.y);
+	hash_u32(&h, state.a);
+	hash_u32(&h, state.b);
+	hash_u32(&h, state.np);
+	hash_u32(&h, state.sp);
+	hash_u32(&h, state.flags);
+	hash_u32(&h, state.tick_counter);
+	hash_u32(&h, state.clk_timer_timestamp);
+	hash_u32(&h, state.prog_timer_timestamp);
+	hash_u32(&h, state.prog_timer_enabled);
+	hash_u32(&h, state.prog_timer_data);
+	hash_u32(&h, state.prog_timer_rld);
+	for (i = 0; i < 6; i++) {
+		hash_u32(&h, state.interrupts[i].factor_flag_reg);
+		hash_u32(&h, state.interrupts[i].mask_reg);
+		hash_u32(&h, state.interrupts[i].triggered);
+	}
+	for (i = 0; i < MEMORY_SIZE; i++) {
+		hash_u32(&h, state.memory[i]);
+	}
+
+#ifdef LCD_FRAMEBUFFER
+	hw_publish_frame_ctx(&t->hw);
+	tamalib_get_frame_ctx(t, &frame);
+	for (i = 0; i < sizeof(frame.matrix); i++) {
+		hash_u32(&h, ((u8_t *) frame.matrix)[i]);
+	}
+	hash_u32(&h, frame.icons);
+#endif
+
+	return h;
+}
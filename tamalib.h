@@ -27,12 +27,32 @@
 #define tamalib_set_button(btn, state)			hw_set_button(btn, state)
 
 #define tamalib_set_speed(speed)			cpu_set_speed(speed)
+#define tamalib_get_op_count()				cpu_get_op_count()
+#define tamalib_get_tick_count()			cpu_get_tick_count()
+
+#ifdef LCD_FRAMEBUFFER
+#define tamalib_get_frame(frame)			hw_get_frame(frame)
+#define tamalib_get_frame_num()				hw_get_frame_num()
+#endif
 
 //#define tamalib_get_state()				cpu_get_state()
 #define tamalib_refresh_hw()				cpu_refresh_hw()
 
 #define tamalib_reset()					cpu_reset()
 
+#define tamalib_set_button_ctx(t, btn, state)		hw_set_button_ctx(&(t)->hw, btn, state)
+
+#define tamalib_set_speed_ctx(t, speed)			cpu_set_speed_ctx(&(t)->cpu, speed)
+#define tamalib_get_op_count_ctx(t)			cpu_get_op_count_ctx(&(t)->cpu)
+#define tamalib_get_tick_count_ctx(t)			cpu_get_tick_count_ctx(&(t)->cpu)
+
+#ifdef LCD_FRAMEBUFFER
+#define tamalib_get_frame_ctx(t, frame)			hw_get_frame_ctx(&(t)->hw, frame)
+#define tamalib_get_frame_num_ctx(t)			hw_get_frame_num_ctx(&(t)->hw)
+#endif
+
+#define tamalib_reset_ctx(t)				cpu_reset_ctx(&(t)->cpu)
+
 //#define tamalib_add_bp(list, addr)			cpu_add_bp(list, addr)
 //#define tamalib_free_bp(list)				cpu_free_bp(list)
 
@@ -45,6 +65,24 @@ typedef enum {
 	EXEC_MODE_TO_RET,
 } exec_mode_t;
 
+/* One emulated pet. Each function with a state has a _ctx variant taking
+ * one of these, a pet is only run by one thread at a time (the frame can
+ * be read from anywhere). The functions without a context use g_tamalib.
+ */
+typedef struct {
+	cpu_t cpu;
+	hw_t hw;
+	hal_t *hal;
+
+	exec_mode_t exec_mode;
+	u32_t step_depth;
+	timestamp_t screen_ts;
+	u32_t ts_freq;
+	u8_t framerate;
+} tamalib_t;
+
+extern tamalib_t g_tamalib;
+
 
 #ifdef __cplusplus
  extern "C" {
@@ -52,13 +90,17 @@ typedef enum {
 
 //void tamalib_release(void);
 bool_t tamalib_init(u32_t freq);
+/* Clears the whole pet, it then runs from the reset state */
+bool_t tamalib_init_ctx(tamalib_t *t, hal_t *hal, u32_t freq);
 //bool_t tamalib_init( breakpoint_t *breakpoints, u32_t freq);
 
 
 void tamalib_set_framerate(u8_t framerate);
+void tamalib_set_framerate_ctx(tamalib_t *t, u8_t framerate);
 //u8_t tamalib_get_framerate(void);
 
 void tamalib_register_hal(hal_t *hal);
+void tamalib_register_hal_ctx(tamalib_t *t, hal_t *hal);
 
 //void tamalib_set_exec_mode(exec_mode_t mode);
 
@@ -69,6 +111,35 @@ void tamalib_register_hal(hal_t *hal);
 //void tamalib_step(void);
 //void tamalib_mainloop(void);
 void tamalib_mainloop_step_by_step(void);
+void tamalib_mainloop_step_by_step_ctx(tamalib_t *t);
+
+/* Same as tamalib_mainloop_step_by_step(), but the handler, the clock and the
+ * screen are only polled once per burst of cycles (32768 Hz ticks)
+ */
+void tamalib_mainloop_burst(u32_t cycles);
+void tamalib_mainloop_burst_ctx(tamalib_t *t, u32_t cycles);
+
+#ifdef ENABLE_INPUT_RECORD
+/* Recorded session file, little-endian: "TREC", the end tick (4 bytes), the
+ * event count (4), the cpu_pack_state() at the start, then each event as its
+ * tick (4), button and state. Written on the device, replayed there or by bench/.
+ */
+#define INPUT_SESSION_MAGIC			"TREC"
+#define INPUT_SESSION_HEADER_SIZE		(12 + CPU_PACKED_STATE_SIZE)
+#define INPUT_SESSION_EVENT_SIZE		6
+
+/* Run up to end_tick, applying each event of hw_record_inputs() at its exact
+ * tick on the way, as fast as the speed allows. The HAL handler and the
+ * screen are left out, as they only see the inputs and not the state.
+ * Returns 1 if the CPU stopped on an unknown opcode before end_tick.
+ */
+int tamalib_replay_ctx(tamalib_t *t, const input_event_t *events, u32_t num, u32_t end_tick);
+#endif
+
+/* FNV-1a of the CPU state and of the LCD (when there is a framebuffer),
+ * the same wherever the emulation runs
+ */
+uint64_t tamalib_get_state_hash_ctx(tamalib_t *t);
 #ifdef __cplusplus
 }
 #endif